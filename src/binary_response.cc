@@ -0,0 +1,86 @@
+//
+// memxy::binary_response - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "binary_response.h"
+#include "memproto/memproto.h"
+#include <stdexcept>
+#include <string.h>
+#include <arpa/inet.h>
+
+namespace memxy {
+
+
+static inline uint16_t get_be16(const char* p)
+{
+	uint16_t v;
+	memcpy(&v, p, 2);
+	return ntohs(v);
+}
+
+static inline uint32_t get_be32(const char* p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return ntohl(v);
+}
+
+static inline uint64_t get_be64(const char* p)
+{
+	return ((uint64_t)get_be32(p) << 32) | get_be32(p+4);
+}
+
+size_t parse_binary_response(const char* data, size_t size,
+		binary_response* res)
+{
+	if(size < MEMPROTO_HEADER_SIZE) {
+		return 0;
+	}
+
+	if((uint8_t)data[0] != MEMPROTO_RESPONSE) {
+		throw std::runtime_error("invalid response magic");
+	}
+
+	const uint16_t keylen  = get_be16(data+2);
+	const uint8_t  extlen  = (uint8_t)data[4];
+	const uint32_t bodylen = get_be32(data+8);
+
+	if((size_t)extlen + keylen > bodylen) {
+		throw std::runtime_error("invalid response length");
+	}
+
+	if(size - MEMPROTO_HEADER_SIZE < bodylen) {
+		return 0;
+	}
+
+	const char* const ext = data + MEMPROTO_HEADER_SIZE;
+
+	res->opcode = (uint8_t)data[1];
+	res->status = get_be16(data+6);
+	memcpy(&res->opaque, data+12, 4);
+	res->cas    = get_be64(data+16);
+	res->flags  = (extlen >= 4) ? get_be32(ext) : 0;
+	res->key    = ext + extlen;
+	res->keylen = keylen;
+	res->val    = res->key + keylen;
+	res->vallen = bodylen - extlen - keylen;
+
+	return MEMPROTO_HEADER_SIZE + bodylen;
+}
+
+
+}  // namespace memxy
+
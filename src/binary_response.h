@@ -0,0 +1,51 @@
+//
+// memxy::binary_response - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef MEMXY_BINARY_RESPONSE_H__
+#define MEMXY_BINARY_RESPONSE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace memxy {
+
+
+// A response of the memcached binary protocol.  The pointers refer to
+// the parsed buffer; the opaque is copied as is, without byte swapping,
+// like the request header writes it.
+struct binary_response {
+	uint8_t opcode;
+	uint16_t status;
+	uint32_t opaque;
+	uint64_t cas;
+	uint32_t flags;  // 0 unless the extras carry flags
+	const char* key;
+	size_t keylen;
+	const char* val;
+	size_t vallen;
+};
+
+// returns the number of consumed bytes, or 0 if more data is required;
+// throws std::runtime_error if the header is invalid
+size_t parse_binary_response(const char* data, size_t size,
+		binary_response* res);
+
+
+}  // namespace memxy
+
+#endif /* binary_response.h */
+
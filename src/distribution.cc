@@ -0,0 +1,288 @@
+//
+// memxy::distribution - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "distribution.h"
+#include <algorithm>
+#include <math.h>
+
+#ifndef DISTRIBUTION_KETAMA_POINTS
+#define DISTRIBUTION_KETAMA_POINTS 160
+#endif
+
+namespace memxy {
+
+
+static uint64_t hash_fnv1a64(const char* key, size_t keylen)
+{
+	uint64_t value = 14695981039346656037ULL;
+	for(size_t i=0; i < keylen; ++i) {
+		value ^= (uint8_t)key[i];
+		value *= 1099511628211ULL;
+	}
+	return value;
+}
+
+// finalizer of splitmix64; spreads every input bit to all output bits
+static inline uint64_t mix64(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+
+distribution::distribution()
+#if DISTRIBUTION == DISTRIBUTION_KETAMA
+	: m_first(0)
+#elif DISTRIBUTION == DISTRIBUTION_RENDEZVOUS
+	: m_uniform(true)
+#endif
+{ }
+
+distribution::~distribution() { }
+
+void distribution::add(const std::string& name, unsigned int weight)
+{
+	m_seeds.push_back(hash_fnv1a64(name.data(), name.size()));
+	m_weights.push_back(weight);
+}
+
+#if DISTRIBUTION == DISTRIBUTION_KETAMA
+
+void distribution::build()
+{
+	// (point << 32 | owner) sorts points and breaks ties by the owner
+	std::vector<uint64_t> sorted;
+	for(size_t s=0; s < m_seeds.size(); ++s) {
+		const size_t num = DISTRIBUTION_KETAMA_POINTS * m_weights[s];
+		for(size_t i=0; i < num; ++i) {
+			uint32_t point = (uint32_t)(mix64(m_seeds[s] + i) >> 32);
+			sorted.push_back(((uint64_t)point << 32) | s);
+		}
+	}
+	std::sort(sorted.begin(), sorted.end());
+
+	m_points.resize(sorted.size() + 1);
+	m_owners.resize(sorted.size() + 1);
+	layout(sorted, 0, 1);
+
+	m_first = 1;
+	while(m_first * 2 < m_points.size()) {
+		m_first *= 2;
+	}
+}
+
+// places sorted points in the order of a breadth-first walk of the
+// binary search tree so that a lookup touches a few cache lines;
+// "make bench" compares it with a sorted array
+size_t distribution::layout(const std::vector<uint64_t>& sorted, size_t i, size_t k)
+{
+	if(k < m_points.size()) {
+		i = layout(sorted, i, 2*k);
+		m_points[k] = (uint32_t)(sorted[i] >> 32);
+		m_owners[k] = (uint32_t)sorted[i];
+		++i;
+		i = layout(sorted, i, 2*k + 1);
+	}
+	return i;
+}
+
+// the first point at or after the hash on the ring
+size_t distribution::position(uint32_t h) const
+{
+	const uint32_t* const points = &m_points[0];
+	const size_t n = m_points.size() - 1;
+
+	// branch-free descent; the subtree 4 levels below fits in a cache line
+	unsigned long k = 1;
+	while(k <= n) {
+		__builtin_prefetch(points + k * 16);
+		k = 2*k + (points[k] < h);
+	}
+	k >>= __builtin_ffsl(~k);
+
+	if(k == 0) {
+		k = m_first;  // wraps around the ring
+	}
+	return k;
+}
+
+// in-order successor in the Eytzinger layout
+size_t distribution::next_position(size_t k) const
+{
+	const size_t n = m_points.size() - 1;
+	if(2*k + 1 <= n) {
+		k = 2*k + 1;
+		while(2*k <= n) {
+			k = 2*k;
+		}
+		return k;
+	}
+	while(k & 1) {
+		k >>= 1;  // up from a right child
+	}
+	k >>= 1;
+	return k == 0 ? m_first : k;
+}
+
+size_t distribution::find(const char* key, size_t keylen) const
+{
+	const uint32_t h = (uint32_t)(mix64(hash_fnv1a64(key, keylen)) >> 32);
+	return m_owners[position(h)];
+}
+
+size_t distribution::find_available(const char* key, size_t keylen,
+		available_t available, void* user) const
+{
+	const uint32_t h = (uint32_t)(mix64(hash_fnv1a64(key, keylen)) >> 32);
+	const size_t start = position(h);
+	size_t k = start;
+	do {
+		if(available(user, m_owners[k])) {
+			return m_owners[k];
+		}
+		k = next_position(k);
+	} while(k != start);
+	return m_owners[start];
+}
+
+#elif DISTRIBUTION == DISTRIBUTION_JUMP
+
+void distribution::build() { }
+
+// Lamping and Veach, "A Fast, Minimal Memory, Consistent Hash Algorithm"
+size_t distribution::find(const char* key, size_t keylen) const
+{
+	uint64_t h = mix64(hash_fnv1a64(key, keylen));
+	int64_t b = -1;
+	int64_t j = 0;
+	const int64_t n = m_seeds.size();
+	while(j < n) {
+		b = j;
+		h = h * 2862933555777941757ULL + 1;
+		j = (int64_t)((b + 1) * ((double)(1LL << 31) / (double)((h >> 33) + 1)));
+	}
+	return b;
+}
+
+#elif DISTRIBUTION == DISTRIBUTION_RENDEZVOUS
+
+void distribution::build()
+{
+	m_uniform = true;
+	for(size_t s=1; s < m_weights.size(); ++s) {
+		if(m_weights[s] != m_weights[0]) {
+			m_uniform = false;
+		}
+	}
+}
+
+// the available server which scores highest for the key;
+// all servers are available if available is NULL
+size_t distribution::best(uint64_t h, available_t available, void* user) const
+{
+	size_t best = m_seeds.size();
+
+	if(m_uniform) {
+		uint64_t max = 0;
+		for(size_t s=0; s < m_seeds.size(); ++s) {
+			uint64_t score = mix64(h ^ m_seeds[s]);
+			if(score >= max && (!available || available(user, s))) {
+				max = score;
+				best = s;
+			}
+		}
+
+	} else {
+		// weight / -ln(u) keeps the share of each server proportional
+		// to its weight
+		double max = 0.0;
+		for(size_t s=0; s < m_seeds.size(); ++s) {
+			double u = ((mix64(h ^ m_seeds[s]) >> 11) + 0.5) / (double)(1ULL << 53);
+			double score = m_weights[s] / -log(u);
+			if(score >= max && (!available || available(user, s))) {
+				max = score;
+				best = s;
+			}
+		}
+	}
+
+	return best;
+}
+
+size_t distribution::find(const char* key, size_t keylen) const
+{
+	return best(hash_fnv1a64(key, keylen), NULL, NULL);
+}
+
+size_t distribution::find_available(const char* key, size_t keylen,
+		available_t available, void* user) const
+{
+	const uint64_t h = hash_fnv1a64(key, keylen);
+	size_t s = best(h, available, user);
+	if(s == m_seeds.size()) {
+		s = best(h, NULL, NULL);
+	}
+	return s;
+}
+
+#else
+
+// Bob Jenkins' one-at-a-time hash; same as libmemcached's default
+static uint32_t hash_one_at_a_time(const char* key, size_t keylen)
+{
+	uint32_t value = 0;
+	for(size_t i=0; i < keylen; ++i) {
+		value += (uint8_t)key[i];
+		value += (value << 10);
+		value ^= (value >> 6);
+	}
+	value += (value << 3);
+	value ^= (value >> 11);
+	value += (value << 15);
+	return value;
+}
+
+void distribution::build() { }
+
+size_t distribution::find(const char* key, size_t keylen) const
+{
+	return hash_one_at_a_time(key, keylen) % m_seeds.size();
+}
+
+#endif
+
+#if DISTRIBUTION != DISTRIBUTION_KETAMA && DISTRIBUTION != DISTRIBUTION_RENDEZVOUS
+// the next index
+size_t distribution::find_available(const char* key, size_t keylen,
+		available_t available, void* user) const
+{
+	const size_t start = find(key, keylen);
+	const size_t n = m_seeds.size();
+	for(size_t i=0; i < n; ++i) {
+		const size_t s = (start + i) % n;
+		if(available(user, s)) {
+			return s;
+		}
+	}
+	return start;
+}
+#endif
+
+
+}  // namespace memxy
+
@@ -0,0 +1,96 @@
+//
+// memxy::distribution - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef MEMXY_DISTRIBUTION_H__
+#define MEMXY_DISTRIBUTION_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#define DISTRIBUTION_MODULO      0
+#define DISTRIBUTION_KETAMA      1
+#define DISTRIBUTION_JUMP        2
+#define DISTRIBUTION_RENDEZVOUS  3
+
+#ifndef DISTRIBUTION
+#define DISTRIBUTION DISTRIBUTION_KETAMA
+#endif
+
+namespace memxy {
+
+
+// Maps keys to servers.  The strategy is selected at compile time:
+//   DISTRIBUTION_MODULO:     hash % servers; same as libmemcached's default
+//   DISTRIBUTION_KETAMA:     consistent hashing ring with weighted points
+//   DISTRIBUTION_JUMP:       jump consistent hash; weights are ignored and
+//                            only servers appended to the end keep keys
+//   DISTRIBUTION_RENDEZVOUS: highest random weight; O(servers) lookup
+class distribution {
+public:
+	distribution();
+	~distribution();
+
+	// name identifies the server independently of its position
+	void add(const std::string& name, unsigned int weight);
+
+	// must be called after all servers are added
+	void build();
+
+	// returns the index of the server
+	size_t find(const char* key, size_t keylen) const;
+
+	typedef bool (*available_t)(void* user, size_t index);
+
+	// returns the index of the server which takes over the key while the
+	// servers before it are not available: the next position on the ring,
+	// the next highest score or the next index; returns find() if none of
+	// the servers is available
+	size_t find_available(const char* key, size_t keylen,
+			available_t available, void* user) const;
+
+	size_t size() const { return m_seeds.size(); }
+
+private:
+	std::vector<uint64_t> m_seeds;
+	std::vector<unsigned int> m_weights;
+
+#if DISTRIBUTION == DISTRIBUTION_KETAMA
+	// points of the ring in Eytzinger layout; [0] is unused
+	std::vector<uint32_t> m_points;
+	std::vector<uint32_t> m_owners;
+	size_t m_first;  // position of the smallest point
+
+	size_t layout(const std::vector<uint64_t>& sorted, size_t i, size_t k);
+	size_t position(uint32_t h) const;
+	size_t next_position(size_t k) const;
+#elif DISTRIBUTION == DISTRIBUTION_RENDEZVOUS
+	bool m_uniform;
+
+	size_t best(uint64_t h, available_t available, void* user) const;
+#endif
+
+private:
+	distribution(const distribution&);
+};
+
+
+}  // namespace memxy
+
+#endif /* distribution.h */
+
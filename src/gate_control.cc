@@ -17,12 +17,15 @@
 //
 #include "gate_control.h"
 #include "proxy_client.h"
+#include "upstream.h"
+#include "stats.h"
 #include "wavy_core.h"
 #include "exception.h"
 #include <mp/endian.h>
 #include <cclog/cclog.h>
 #include <mp/stream_buffer.h>
 #include <stdexcept>
+#include <string>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -51,6 +54,7 @@ public:
 public:
 	void read_event();
 	void process_body(char* data, size_t size);
+	void send_stats();
 
 public:
 	mp::stream_buffer m_buffer;
@@ -103,8 +107,119 @@ try {
 	throw;
 }
 
+// returns the arguments if str is the command, or NULL
+static const char* command_args(const char* str, const char* name)
+{
+	const size_t len = strlen(name);
+	if(strncmp(str, name, len) != 0) {
+		return NULL;
+	}
+	if(str[len] == ' ') {
+		return str + len + 1;
+	} else if(str[len] == '\0') {
+		return str + len;
+	}
+	return NULL;
+}
+
+// parses a decimal number followed by a space or the end; a sign or an
+// out of range number is rejected
+static bool parse_count(const char* str, const char** end, size_t* val)
+{
+	if(*str < '0' || *str > '9') {
+		return false;
+	}
+	char* e;
+	errno = 0;
+	unsigned long n = strtoul(str, &e, 10);
+	if(errno == ERANGE || (*e != ' ' && *e != '\0')) {
+		return false;
+	}
+	*val = n;
+	*end = e;
+	return true;
+}
+
+// "<inflight> <waiting>"
+static void set_bulkhead(const char* args)
+{
+	const char* p = args;
+	size_t inflight;
+	size_t waiting;
+	if(!parse_count(p, &p, &inflight) || *p != ' ' ||
+			!parse_count(p + strspn(p, " "), &p, &waiting) || *p != '\0') {
+		throw std::runtime_error("invalid bulkhead");
+	}
+	LOG_INFO("set bulkhead: inflight=",inflight," waiting=",waiting);
+	upstream::set_bulkhead(inflight, waiting);
+}
+
+static void set_pool(const char* args)
+{
+	const size_t len = strcspn(args, " ");
+	if(len == 0) {
+		throw std::runtime_error("invalid pool name");
+	}
+	std::string name(args, len);
+	const char* list = args + len + strspn(args + len, " ");
+	LOG_INFO("set pool ",name,": ",list);
+	proxy_client::set_pool(name.c_str(), list);
+}
+
+static void set_shadow(const char* args)
+{
+	char* end;
+	unsigned long percent = strtoul(args, &end, 10);
+	if(end == args || (*end != ' ' && *end != '\0')) {
+		throw std::runtime_error("invalid shadow percentage");
+	}
+	const char* list = end + strspn(end, " ");
+	LOG_INFO("set shadow ",percent,"%: ",list);
+	proxy_client::set_shadow(percent, list);
+}
+
+// "<both|cold> <promote|nopromote> <server list>"; empty to disable
+static void set_tier(const char* args)
+{
+	if(*args == '\0') {
+		LOG_INFO("disable tier");
+		proxy_client::set_tier(false, false, "");
+		return;
+	}
+
+	const char* p = args;
+	size_t len = strcspn(p, " ");
+	std::string sets(p, len);
+	p += len;
+	p += strspn(p, " ");
+	len = strcspn(p, " ");
+	std::string promote(p, len);
+	p += len;
+	const char* list = p + strspn(p, " ");
+
+	if((sets != "both" && sets != "cold") ||
+			(promote != "promote" && promote != "nopromote")) {
+		throw std::runtime_error("invalid tier policy");
+	}
+	if(sets == "cold" && promote != "promote") {
+		// the primary set would never get the values
+		throw std::runtime_error("tier: cold sets require promote");
+	}
+	LOG_INFO("set tier sets=",sets," ",promote,": ",list);
+	proxy_client::set_tier(promote == "promote", sets == "cold", list);
+}
+
+// the body is "stats", "replica <server lists>",
+// "bulkhead <inflight> <waiting>", "pool <name> <server list>",
+// "route <prefix>=<pool> ...", "shadow <percent> <server list>",
+// "tier <sets> <promote> <server list>" or a server list
 void handler::process_body(char* data, size_t size)
 {
+	if(size == 5 && memcmp(data, "stats", 5) == 0) {
+		send_stats();
+		return;
+	}
+
 	char* str = (char*)::malloc(size + 1);
 	if(!str) { throw std::bad_alloc(); }
 
@@ -112,8 +227,25 @@ void handler::process_body(char* data, size_t size)
 	str[size] = '\0';
 
 	try {
-		LOG_INFO("set server list: ",str);
-		proxy_client::set_servers(str);
+		const char* args;
+		if((args = command_args(str, "replica")) != NULL) {
+			LOG_INFO("set replica lists: ",args);
+			proxy_client::set_replicas(args);
+		} else if((args = command_args(str, "bulkhead")) != NULL) {
+			set_bulkhead(args);
+		} else if((args = command_args(str, "pool")) != NULL) {
+			set_pool(args);
+		} else if((args = command_args(str, "route")) != NULL) {
+			LOG_INFO("set routes: ",args);
+			proxy_client::set_routes(args);
+		} else if((args = command_args(str, "shadow")) != NULL) {
+			set_shadow(args);
+		} else if((args = command_args(str, "tier")) != NULL) {
+			set_tier(args);
+		} else {
+			LOG_INFO("set server list: ",str);
+			proxy_client::set_servers(str);
+		}
 	} catch(...) {
 		::free(str);
 		throw;
@@ -121,6 +253,23 @@ void handler::process_body(char* data, size_t size)
 	free(str);
 }
 
+// replies the STAT lines in the same framing as requests
+void handler::send_stats()
+{
+	std::string str;
+	stats::dump(&str);
+	proxy_client::dump_stats(&str);
+	str.append("END\r\n");
+
+	char* buf = (char*)::malloc(sizeof(uint32_t) + str.size());
+	if(!buf) { throw std::bad_alloc(); }
+
+	*(uint32_t*)buf = htonl(str.size());
+	memcpy(buf + sizeof(uint32_t), str.data(), str.size());
+
+	core::write(fd(), buf, sizeof(uint32_t) + str.size(), &::free, buf);
+}
+
 
 void accepted(int fd, int err)
 {
@@ -15,8 +15,12 @@
 //    See the License for the specific language governing permissions and
 //    limitations under the License.
 //
+#define __STDC_LIMIT_MACROS
 #include "gate_memtext.h"
+#include "gate_memtext_impl.h"
 #include "gate_memtext_retrieval.h"
+#include "gate_memtext_balance.h"
+#include "gate_memtext_hedge.h"
 #include "gate_memtext_storage.h"
 #include "gate_memtext_delete.h"
 #include "wavy_core.h"
@@ -25,6 +29,8 @@
 #include <cclog/cclog.h>
 #include <mp/stream_buffer.h>
 #include <stdexcept>
+#include <algorithm>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <netinet/tcp.h>
@@ -40,31 +46,23 @@
 #define MEMTEXT_RESERVE_SIZE (4*1024)
 #endif
 
+// command lines of streamed sets are looked for within this length
+#ifndef MEMTEXT_STREAM_LINE_MAX
+#define MEMTEXT_STREAM_LINE_MAX 512
+#endif
+
 
 namespace memxy {
 namespace memtext {
-namespace {
-
-
-class handler : public core::handler {
-public:
-	handler(int fd);
-	~handler();
-
-public:
-	void read_event();
-
-public:
-	mp::stream_buffer m_buffer;
-	memtext_parser m_parser;
-	size_t m_off;
-};
 
 
 handler::handler(int fd) :
 	core::handler(fd),
 	m_buffer(MEMTEXT_INITIAL_ALLOCATION_SIZE),
-	m_off(0)
+	m_off(0),
+	m_value_left(0),
+	m_paused(false),
+	m_closed(false)
 {
 	memtext_callback cb = {
 		request_get,    // get
@@ -80,26 +78,53 @@ handler::handler(int fd) :
 		NULL,           // decr
 	};
 
-	memtext_init(&m_parser, &cb, (void*)(ptrdiff_t)fd);
+	memtext_init(&m_parser, &cb, this);
 }
 
-handler::~handler() { }
+handler::~handler()
+{
+	abort_value();
+	for(std::deque<reply*>::iterator it(m_reply.begin()), it_end(m_reply.end());
+			it != it_end; ++it) {
+		delete *it;
+	}
+}
 
 
 void handler::read_event()
 try {
-	m_buffer.reserve_buffer(MEMTEXT_RESERVE_SIZE);
+	if(m_paused) {
+		// resumed; the data left in the buffer is processed first
+		m_paused = false;
+	} else {
+		m_buffer.reserve_buffer(MEMTEXT_RESERVE_SIZE);
 
-	ssize_t rl = ::read(fd(), m_buffer.buffer(), m_buffer.buffer_capacity());
-	if(rl <= 0) {
-		if(rl == 0) { throw connection_closed_error(); }
-		if(errno == EAGAIN || errno == EINTR) { return; }
-		else { throw connection_broken_error(); }
-	}
+		ssize_t rl = ::read(fd(), m_buffer.buffer(), m_buffer.buffer_capacity());
+		if(rl <= 0) {
+			if(rl == 0) { throw connection_closed_error(); }
+			if(errno == EAGAIN || errno == EINTR) { return; }
+			else { throw connection_broken_error(); }
+		}
 
-	m_buffer.buffer_consumed(rl);
+		m_buffer.buffer_consumed(rl);
+	}
 
 	do {
+		if(m_value) {
+			if(!forward_value()) { return; }
+			continue;
+		}
+
+		if(m_off == 0) {
+			// at the beginning of a command
+			int ret = start_value_stream();
+			if(ret < 0) {
+				return;
+			} else if(ret > 0) {
+				continue;
+			}
+		}
+
 		int ret = memtext_execute(&m_parser,
 				(char*)m_buffer.data(), m_buffer.data_size(), &m_off);
 		if(ret < 0) {
@@ -113,16 +138,171 @@ try {
 
 } catch(connection_error& e) {
 	LOG_DEBUG(e.what());
+	disconnected();
 	throw;
 } catch (std::exception& e) {
 	LOG_DEBUG("memcached text protocol error: ",e.what());
+	disconnected();
 	throw;
 } catch (...) {
 	LOG_DEBUG("memcached text protocol error: unknown error");
+	disconnected();
 	throw;
 }
 
 
+// parses ('0' | [1-9][0-9]*) like m_parser; returns NULL if it's invalid
+static const char* parse_uint(const char* p, const char* end, uint64_t* result)
+{
+	const char* const start = p;
+	uint64_t n = 0;
+	for(; p != end && *p >= '0' && *p <= '9'; ++p) {
+		if(n > (UINT64_MAX - 9) / 10) { return NULL; }
+		n = n * 10 + (*p - '0');
+	}
+	if(p == start || (*start == '0' && p - start > 1)) {
+		return NULL;
+	}
+	*result = n;
+	return p;
+}
+
+// A set of a value larger than the threshold is sent to the server as
+// soon as its command line is received, and the value follows as it
+// arrives.  Returns 1 if the value is streamed, -1 if more data is needed
+// to decide, or 0 if the command is parsed by m_parser as usual.
+int handler::start_value_stream()
+{
+	const size_t threshold = get_store_streaming();
+	if(threshold == 0) {
+		return 0;
+	}
+
+	const char* const data = (const char*)m_buffer.data();
+	const size_t size = m_buffer.data_size();
+	if(size < 4) {
+		return memcmp(data, "set ", size) == 0 ? -1 : 0;
+	}
+	if(memcmp(data, "set ", 4) != 0) {
+		return 0;
+	}
+
+	const char* nl = (const char*)memchr(data, '\n',
+			std::min(size, (size_t)MEMTEXT_STREAM_LINE_MAX));
+	if(!nl) {
+		return size < MEMTEXT_STREAM_LINE_MAX ? -1 : 0;
+	}
+	if(nl[-1] != '\r') {
+		return 0;
+	}
+	const char* const end = nl - 1;
+
+	// "set <key> <flags> <exptime> <bytes>[ noreply][ ]\r\n"
+	const char* key = data + 4;
+	const char* p = key;
+	while(p != end && *p != ' ' && *p != '\0') { ++p; }
+	const size_t keylen = p - key;
+	uint64_t flags, exptime, bytes;
+	if(keylen == 0 || p == end ||
+			!(p = parse_uint(p+1, end, &flags)) || p == end || *p != ' ' ||
+			!(p = parse_uint(p+1, end, &exptime)) || p == end || *p != ' ' ||
+			!(p = parse_uint(p+1, end, &bytes)) ||
+			flags > UINT32_MAX || exptime > UINT32_MAX || bytes == 0) {
+		return 0;
+	}
+	bool noreply = false;
+	if(end - p >= 8 && memcmp(p, " noreply", 8) == 0) {
+		noreply = true;
+		p += 8;
+	}
+	if(p != end && !(*p == ' ' && p+1 == end)) {
+		return 0;
+	}
+
+	const size_t linelen = nl + 1 - data;
+	if(bytes <= threshold || size - linelen >= bytes + 2) {
+		// the whole value is small or already received
+		return 0;
+	}
+
+	m_value = stream_set(this, key, keylen, flags, exptime, bytes, noreply);
+	if(!m_value) {
+		return 0;
+	}
+	m_value_left = bytes;
+	m_buffer.data_used(linelen);
+	return 1;
+}
+
+// the client closed the connection before sending the whole value
+void handler::abort_value()
+{
+	if(m_value) {
+		m_value->abort();
+		m_value.reset();
+	}
+}
+
+void handler::disconnected()
+{
+	m_closed = true;
+	abort_value();
+}
+
+void handler::resume(mp::weak_ptr<handler> wh)
+{
+	shared_handler h(wh.lock());
+	if(h) {
+		core::resume_handler(h);
+	}
+}
+
+// returns false if more data is needed or the upstream is behind; the
+// last byte of the value is held until the trailer is checked so that a
+// broken set is never completed on the server
+bool handler::forward_value()
+{
+	if(m_value_left > 1) {
+		size_t len = std::min(m_value_left - 1, m_buffer.data_size());
+		if(len == 0) {
+			return false;
+		}
+		// the part refers to m_buffer until it is written
+		std::auto_ptr<mp::stream_buffer::reference> ref(m_buffer.release());
+		const bool room = m_value->write((const char*)m_buffer.data(), len, ref);
+		m_buffer.data_used(len);
+		m_value_left -= len;
+		if(!room) {
+			// stop reading the client until the upstream catches up
+			m_paused = true;
+			hold_events();
+			return false;
+		}
+		if(m_value_left > 1) {
+			return false;
+		}
+	}
+
+	if(m_buffer.data_size() < 3) {
+		return false;
+	}
+
+	const char* p = (const char*)m_buffer.data();
+	if(p[1] != '\r' || p[2] != '\n') {
+		throw std::runtime_error("bad data chunk");
+	}
+	m_value->write(p, 1, std::auto_ptr<mp::stream_buffer::reference>(m_buffer.release()));
+	m_buffer.data_used(3);
+	m_value_left = 0;
+
+	m_value->close();
+	m_value.reset();
+	return true;
+}
+
+
+namespace {
+
 void accepted(int fd, int err)
 {
 	if(fd < 0) {
@@ -151,6 +331,26 @@ gate_memtext::gate_memtext() { }
 
 gate_memtext::~gate_memtext() { }
 
+void gate_memtext::set_streaming(bool enable)
+{
+	memtext::set_multi_get_streaming(enable);
+}
+
+void gate_memtext::set_store_streaming(size_t bytes)
+{
+	memtext::set_store_streaming(bytes);
+}
+
+void gate_memtext::set_hedge(unsigned int delay_usec, unsigned int budget_percent)
+{
+	memtext::set_hedge(delay_usec, budget_percent);
+}
+
+void gate_memtext::set_balance(bool enable)
+{
+	memtext::set_balance(enable);
+}
+
 void gate_memtext::listen(
 		int socket_family, int socket_type, int protocol,
 		const sockaddr* addr, socklen_t addrlen,
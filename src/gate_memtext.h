@@ -35,6 +35,24 @@ public:
 			const sockaddr* addr, socklen_t addrlen,
 			int backlog = 1024);
 
+	// writes VALUEs of a multi-get reply as soon as they arrive
+	// instead of in the order of the keys; enabled by default
+	static void set_streaming(bool enable);
+
+	// sends the command of a set of a value larger than bytes before
+	// the value is received, and forwards the value as it arrives;
+	// 0 disables it
+	static void set_store_streaming(size_t bytes);
+
+	// sends a get to a replica too if the server doesn't respond within
+	// delay_usec, or its 95th percentile response time if it's 0;
+	// budget_percent limits the extra gets
+	static void set_hedge(unsigned int delay_usec, unsigned int budget_percent);
+
+	// sends gets to the less loaded of the owners of the key in the
+	// primary set and the replicas; disabled by default
+	static void set_balance(bool enable);
+
 private:
 	gate_memtext(const gate_memtext&);
 };
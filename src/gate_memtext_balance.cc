@@ -0,0 +1,117 @@
+//
+// memxy::gate_memtext - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "gate_memtext_balance.h"
+#include "stats.h"
+#include <stdint.h>
+#include <time.h>
+#include <algorithm>
+
+namespace memxy {
+namespace memtext {
+
+
+static volatile bool s_balance_enabled = false;
+
+static stats::counter s_replica_gets("balanced_replica_gets");
+
+void set_balance(bool enable)
+{
+	s_balance_enabled = enable;
+}
+
+bool balance_enabled()
+{
+	return s_balance_enabled;
+}
+
+// xorshift; seeded per thread on the first call
+static __thread uint32_t s_random = 0;
+
+static uint32_t next_random()
+{
+	uint32_t x = s_random;
+	if(x == 0) {
+		x = (uint32_t)time(NULL) ^ (uint32_t)(uintptr_t)&s_random;
+		if(x == 0) { x = 1; }
+	}
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	s_random = x;
+	return x;
+}
+
+// index 0 is the primary set, i+1 is replicas[i]
+static const proxy_client::shared_server_set& set_at(
+		const proxy_client::topology& tp, size_t i)
+{
+	return i == 0 ? tp.primary : tp.replicas[i-1];
+}
+
+static upstream::server* owner_at(const proxy_client::topology& tp,
+		upstream::server* sv, const char* key, size_t keylen, size_t i)
+{
+	return i == 0 ? sv : tp.replicas[i-1]->route(key, keylen);
+}
+
+upstream::server* balanced_owner(const proxy_client::topology& tp,
+		upstream::server* sv, const char* key, size_t keylen,
+		proxy_client::shared_server_set* other)
+{
+	const size_t num = tp.replicas.size() + 1;
+	if(num == 1) {
+		return sv;
+	}
+
+	// the primary is one of the two if there is only one replica;
+	// it's preferred when both are equal, which keeps its cache warm
+	size_t a = 0;
+	size_t b = 1;
+	if(num > 2) {
+		a = next_random() % num;
+		b = next_random() % (num - 1);
+		if(b >= a) { ++b; }
+		if(b < a) { std::swap(a, b); }
+	}
+
+	upstream::server* sa = owner_at(tp, sv, key, keylen, a);
+	upstream::server* sb = owner_at(tp, sv, key, keylen, b);
+
+	size_t pick = a;
+	upstream::server* result = sa;
+	if(!sa || (sb && sb->load() < sa->load())) {
+		pick = b;
+		result = sb;
+	}
+	if(!result) {
+		// the replicas have no server
+		pick = 0;
+		result = sv;
+	}
+
+	*other = set_at(tp, pick == 0 ? 1 : 0);
+	if(pick != 0) {
+		s_replica_gets.incr();
+	}
+	return result;
+}
+
+
+}  // namespace memtext
+}  // namespace memxy
+
@@ -0,0 +1,50 @@
+//
+// memxy::gate_memtext - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef GATE_MEMTEXT_BALANCE_H__
+#define GATE_MEMTEXT_BALANCE_H__
+
+#include "upstream.h"
+#include "proxy_client.h"
+
+namespace memxy {
+namespace memtext {
+
+
+// A key of the primary set has an owner in the primary set and in each
+// of the replicas.  Gets are sent to the owner with the least load()
+// of two owners chosen at random, so that a slow or busy replica gets
+// fewer of them without being ejected.
+
+// returns the owner which a get of the key is sent to; sv is the owner
+// in the primary set.  *other is set to a set other than the one of the
+// returned server, which a hedge can be sent to
+upstream::server* balanced_owner(const proxy_client::topology& tp,
+		upstream::server* sv, const char* key, size_t keylen,
+		proxy_client::shared_server_set* other);
+
+// returns false if gets are sent only to the primary set
+bool balance_enabled();
+
+void set_balance(bool enable);
+
+
+}  // namespace memtext
+}  // namespace memxy
+
+#endif /* gate_memtext_balance.h */
+
@@ -17,32 +17,87 @@
 //
 #include "gate_memtext_impl.h"
 #include "gate_memtext_delete.h"
+#include "gate_memtext_migration.h"
+#include "gate_memtext_shadow.h"
+#include "gate_memtext_tier.h"
+#include "replication.h"
 
 namespace memxy {
 namespace memtext {
 
 
+class delete_request : public upstream::request {
+public:
+	delete_request(handler* h, reply* r) :
+		m_handler(h->shared_self<handler>()),
+		m_reply(r) { }
+
+	void complete(upstream::status st)
+	{
+		if(st != upstream::STATUS_SUCCESS) {
+			commit_error(m_handler.get(), m_reply, st);
+			return;
+		}
+		m_handler->commit_static(m_reply, "DELETED\r\n");
+	}
+
+	bool cancelled()
+	{
+		return m_handler->is_closed();
+	}
+
+private:
+	shared_handler m_handler;
+	reply* m_reply;
+};
+
+
 int request_delete(void* user,
 		memtext_command cmd,
 		memtext_request_delete* r)
 {
-	int fd = CAST_USER(user);
+	handler* h = CAST_USER(user);
 
-	memcached_return err;
+	proxy_client::shared_topology tp( proxy_client::current_topology() );
 
-	{
-		proxy_client::ref mc( proxy_client::get() );
-		err = memcached_delete(*mc, r->key, r->key_len, r->exptime);
+	proxy_client::server_set* ss = tp->pool_of(r->key, r->key_len);
+
+	upstream::server* owner = ss->route(r->key, r->key_len);
+	upstream::server* sv = owner;
+	if(owner && ss == tp->primary.get()) {
+		sv = tier_set_owner(*tp, owner, r->key, r->key_len);
+	}
+	if(!sv) {
+		if(!r->noreply) {
+			send_error(h, upstream::STATUS_NO_SERVER);
+		}
+		return 0;
 	}
 
-	if(r->noreply) { return 0; }
+	if(r->noreply) {
+		sv->remove(r->key, r->key_len, r->exptime,
+				upstream::shared_request());
+	} else {
+		reply* rp = h->hold();
+		try {
+			upstream::shared_request req(new delete_request(h, rp));
+			sv->remove(r->key, r->key_len, r->exptime, req);
+		} catch (...) {
+			commit_error(h, rp, upstream::STATUS_SERVER_ERROR);
+			throw;
+		}
+	}
 
-	if(err) {
-		send_error(fd, err);
-		return 0;
+	// replicas mirror the primary set; the reply doesn't wait for them
+	if(ss == tp->primary.get()) {
+		replication::remove(*tp, r->key, r->key_len, r->exptime);
+		tier_remove(*tp, owner, r->key, r->key_len, r->exptime);
+		migration_remove(*tp, owner, r->key, r->key_len, r->exptime);
+		if(shadow_sampled(*tp, r->key, r->key_len)) {
+			shadow_remove(*tp, r->key, r->key_len, r->exptime);
+		}
 	}
 
-	send_static(fd, "DELETED\r\n");
 	return 0;
 }
 
@@ -0,0 +1,287 @@
+//
+// memxy::gate_memtext - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "gate_memtext_flight.h"
+#include <mp/pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef MEMTEXT_FLIGHT_TABLE_SIZE
+#define MEMTEXT_FLIGHT_TABLE_SIZE 1024  // must be power of 2
+#endif
+
+#ifndef MEMTEXT_FLIGHT_PROBE_MAX
+#define MEMTEXT_FLIGHT_PROBE_MAX 8
+#endif
+
+namespace memxy {
+namespace memtext {
+
+
+namespace {
+
+// a get request in flight and the requests waiting for its response
+class flight : public upstream::request {
+public:
+	flight(upstream::server* sv, const char* key, size_t keylen,
+			bool require_cas) :
+		m_server(sv), m_key(key, keylen), m_require_cas(require_cas),
+		m_done(false),
+		m_found(false), m_flags(0), m_cas(0), m_val(NULL), m_vallen(0) { }
+
+	bool match(const upstream::server* sv, const char* key, size_t keylen,
+			bool require_cas) const
+	{
+		return m_server == sv && m_key.size() == keylen &&
+			(m_require_cas || !require_cas) &&
+			memcmp(m_key.data(), key, keylen) == 0;
+	}
+
+	bool is_done() const
+	{
+		return m_done;
+	}
+
+	// returns false if the response is already being delivered
+	bool attach(upstream::shared_request req)
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		if(m_done) {
+			return false;
+		}
+		m_waiters.push_back(req);
+		return true;
+	}
+
+	// the request is not sent; nobody else is attached yet
+	void abandon()
+	{
+		m_done = true;
+	}
+
+	void value(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* val, size_t vallen,
+			upstream::chunk* ck)
+	{
+		if(m_found) { return; }
+
+		// keep the value for the waiters attached later
+		m_ref.reset(ck->retain());
+		m_val = val;
+		m_vallen = vallen;
+		m_flags = flags;
+		m_cas = cas;
+		m_found = true;
+	}
+
+	// a spliced value can't be shared; it is accepted only if there is
+	// one waiter and nobody attaches later
+	bool accept_splice(const char* key, size_t keylen)
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		if(m_waiters.size() != 1 || !m_waiters[0]->accept_splice(key, keylen)) {
+			return false;
+		}
+		m_done = true;
+		return true;
+	}
+
+	void value_splice(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* head, size_t headlen, upstream::chunk* ck,
+			int pipefd, size_t pipelen)
+	{
+		// m_waiters is not changed after accept_splice()
+		m_waiters[0]->value_splice(key, keylen, flags, cas,
+				head, headlen, ck, pipefd, pipelen);
+	}
+
+	void complete(upstream::status st)
+	{
+		waiters_t waiters;
+		{
+			mp::pthread_scoped_lock lk(m_mutex);
+			m_done = true;
+			waiters.swap(m_waiters);
+		}
+
+		upstream::reference_chunk ck(m_ref.get());
+
+		for(waiters_t::iterator it(waiters.begin()), it_end(waiters.end());
+				it != it_end; ++it) {
+			try {
+				if(st == upstream::STATUS_SUCCESS && m_found &&
+						!(*it)->cancelled()) {
+					(*it)->value(m_key.data(), m_key.size(),
+							m_flags, m_cas, m_val, m_vallen, &ck);
+				}
+				(*it)->complete(st);
+			} catch (...) { }
+		}
+	}
+
+	// cancelled if all waiters are; nobody attaches after that
+	bool cancelled()
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		if(m_done) {
+			return false;
+		}
+		for(waiters_t::iterator it(m_waiters.begin()), it_end(m_waiters.end());
+				it != it_end; ++it) {
+			if(!(*it)->cancelled()) {
+				return false;
+			}
+		}
+		m_done = true;
+		return true;
+	}
+
+private:
+	upstream::server* const m_server;
+	const std::string m_key;
+	const bool m_require_cas;
+
+	mp::pthread_mutex m_mutex;
+	volatile bool m_done;
+	typedef std::vector<upstream::shared_request> waiters_t;
+	waiters_t m_waiters;
+
+	// written by value() before complete()
+	bool m_found;
+	uint32_t m_flags;
+	uint64_t m_cas;
+	const char* m_val;
+	size_t m_vallen;
+	std::auto_ptr<mp::stream_buffer::reference> m_ref;
+
+private:
+	flight();
+	flight(const flight&);
+};
+
+typedef mp::shared_ptr<flight> shared_flight;
+
+
+// Open addressing table owned by a worker thread. Flights complete on
+// other threads, so finished slots are not removed but reused when
+// they are found on probing.
+class flight_table {
+public:
+	flight_table() { }
+
+	void get(upstream::server* sv, const char* key, size_t keylen,
+			bool require_cas, upstream::shared_request req);
+
+private:
+	static uint32_t hash(const upstream::server* sv,
+			const char* key, size_t keylen);
+
+	struct slot {
+		uint32_t hash;
+		shared_flight f;
+	};
+
+	slot m_slots[MEMTEXT_FLIGHT_TABLE_SIZE];
+
+private:
+	flight_table(const flight_table&);
+};
+
+// FNV-1a
+uint32_t flight_table::hash(const upstream::server* sv,
+		const char* key, size_t keylen)
+{
+	uint32_t h = 2166136261U ^ (uint32_t)((uintptr_t)sv >> 4);
+	for(size_t i=0; i < keylen; ++i) {
+		h ^= (uint8_t)key[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+void flight_table::get(upstream::server* sv, const char* key, size_t keylen,
+		bool require_cas, upstream::shared_request req)
+{
+	const uint32_t h = hash(sv, key, keylen);
+
+	slot* free_slot = NULL;
+	for(size_t i=0; i < MEMTEXT_FLIGHT_PROBE_MAX; ++i) {
+		slot& s( m_slots[(h + i) & (MEMTEXT_FLIGHT_TABLE_SIZE-1)] );
+
+		if(s.f && s.f->is_done()) {
+			s.f.reset();
+		}
+
+		if(!s.f) {
+			if(!free_slot) { free_slot = &s; }
+			continue;
+		}
+
+		if(s.hash == h && s.f->match(sv, key, keylen, require_cas)) {
+			if(s.f->attach(req)) {
+				return;
+			}
+			s.f.reset();
+			if(!free_slot) { free_slot = &s; }
+		}
+	}
+
+	if(!free_slot) {
+		// the table is crowded around this key; don't collapse
+		sv->get(&key, &keylen, 1, require_cas, req);
+		return;
+	}
+
+	shared_flight f(new flight(sv, key, keylen, require_cas));
+	f->attach(req);
+
+	free_slot->hash = h;
+	free_slot->f = f;
+
+	try {
+		sv->get(&key, &keylen, 1, require_cas, f);
+	} catch (...) {
+		f->abandon();
+		free_slot->f.reset();
+		throw;
+	}
+}
+
+static __thread flight_table* s_table = NULL;
+
+}  // noname namespace
+
+
+void flight_get(upstream::server* sv,
+		const char* key, size_t keylen,
+		bool require_cas, upstream::shared_request req)
+{
+	if(!s_table) {
+		s_table = new flight_table();
+	}
+	s_table->get(sv, key, keylen, require_cas, req);
+}
+
+
+}  // namespace memtext
+}  // namespace memxy
+
@@ -0,0 +1,38 @@
+//
+// memxy::gate_memtext - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef GATE_MEMTEXT_FLIGHT_H__
+#define GATE_MEMTEXT_FLIGHT_H__
+
+#include "upstream.h"
+
+namespace memxy {
+namespace memtext {
+
+
+// Sends a single-key get to the server. If a get of the same key is
+// already in flight on the server, the request is attached to it and
+// receives the same response instead of sending another one.
+void flight_get(upstream::server* sv,
+		const char* key, size_t keylen,
+		bool require_cas, upstream::shared_request req);
+
+
+}  // namespace memtext
+}  // namespace memxy
+
+#endif /* gate_memtext_flight.h */
@@ -0,0 +1,336 @@
+//
+// memxy::gate_memtext - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "gate_memtext_hedge.h"
+#include "gate_memtext_flight.h"
+#include "wavy_core.h"
+#include "stats.h"
+#include <cclog/cclog.h>
+#include <mp/pthread.h>
+
+// hedges which can be sent at once after a quiet period
+#ifndef MEMTEXT_HEDGE_BURST
+#define MEMTEXT_HEDGE_BURST 10
+#endif
+
+namespace memxy {
+namespace memtext {
+
+
+static volatile bool s_hedge_enabled = false;
+static volatile unsigned int s_hedge_delay = 0;
+static volatile unsigned int s_hedge_budget = 5;
+
+void set_hedge(unsigned int delay_usec, unsigned int budget_percent)
+{
+	s_hedge_delay = delay_usec;
+	s_hedge_budget = budget_percent;
+	s_hedge_enabled = true;
+}
+
+bool hedge_enabled()
+{
+	return s_hedge_enabled;
+}
+
+static stats::counter s_hedge_sent("hedge_sent");
+static stats::counter s_hedge_won("hedge_won");
+static stats::counter s_hedge_budget_exhausted("hedge_budget_exhausted");
+
+
+namespace {
+
+// Token bucket shared by all threads. Each get earns budget_percent
+// tokens and a hedge spends 100 of them.
+class hedge_budget {
+public:
+	static void earn()
+	{
+		if(s_tokens < 100 * MEMTEXT_HEDGE_BURST) {
+			__sync_add_and_fetch(&s_tokens, s_hedge_budget);
+		}
+	}
+
+	static bool spend()
+	{
+		long t = s_tokens;
+		while(t >= 100) {
+			if(__sync_bool_compare_and_swap(&s_tokens, t, t - 100)) {
+				return true;
+			}
+			t = s_tokens;
+		}
+		return false;
+	}
+
+private:
+	static volatile long s_tokens;
+};
+
+volatile long hedge_budget::s_tokens = 0;
+
+
+// The original get and the hedge are two legs of a hedge. The first leg
+// which receives a response forwards it to the client's request and the
+// other leg discards its response.  An error is forwarded only if the
+// other leg can't answer.
+class hedge : public mp::enable_shared_from_this<hedge> {
+public:
+	hedge(proxy_client::shared_server_set replica,
+			const char* key, size_t keylen,
+			bool require_cas, upstream::shared_request req) :
+		m_replica(replica), m_key(key, keylen),
+		m_require_cas(require_cas), m_req(req),
+		m_winner(-1), m_hedged(false)
+	{
+		m_failed[0] = m_failed[1] = false;
+	}
+
+	void start(upstream::server* sv, unsigned int delay_usec);
+
+	// returns true if the leg delivers the response
+	bool claim(int leg, bool error);
+
+	upstream::request* target() { return m_req.get(); }
+
+	// the response is delivered; the losing leg must not keep the
+	// client's request and the hedge is not sent any more
+	void release();
+
+	// true if the client is gone or the other leg delivered the response
+	bool cancelled(int leg);
+
+private:
+	void fire();
+	void fail_hedge();
+
+	proxy_client::shared_server_set m_replica;
+	const std::string m_key;
+	const bool m_require_cas;
+	upstream::shared_request m_req;
+
+	mp::pthread_mutex m_mutex;
+	core::shared_deadline m_timer;
+	int m_winner;
+	bool m_hedged;
+	bool m_failed[2];
+
+private:
+	hedge();
+	hedge(const hedge&);
+};
+
+typedef mp::shared_ptr<hedge> shared_hedge;
+
+
+class leg : public upstream::request {
+public:
+	leg(shared_hedge hg, int id) :
+		m_hedge(hg), m_id(id), m_claimed(false) { }
+
+	void value(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* val, size_t vallen,
+			upstream::chunk* ck)
+	{
+		if(claim(false)) {
+			m_hedge->target()->value(key, keylen, flags, cas, val, vallen, ck);
+		}
+	}
+
+	bool accept_splice(const char* key, size_t keylen)
+	{
+		return claim(false) && m_hedge->target()->accept_splice(key, keylen);
+	}
+
+	void value_splice(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* head, size_t headlen, upstream::chunk* ck,
+			int pipefd, size_t pipelen)
+	{
+		m_hedge->target()->value_splice(key, keylen, flags, cas,
+				head, headlen, ck, pipefd, pipelen);
+	}
+
+	void complete(upstream::status st)
+	{
+		if(claim(st != upstream::STATUS_SUCCESS &&
+					st != upstream::STATUS_NOT_FOUND)) {
+			if(m_id == 1 && st == upstream::STATUS_SUCCESS) {
+				s_hedge_won.incr();
+			}
+			m_hedge->target()->complete(st);
+			m_hedge->release();
+		}
+	}
+
+	bool cancelled()
+	{
+		return m_hedge->cancelled(m_id);
+	}
+
+private:
+	bool claim(bool error)
+	{
+		if(!m_claimed) {
+			m_claimed = m_hedge->claim(m_id, error);
+		}
+		return m_claimed;
+	}
+
+	shared_hedge m_hedge;
+	const int m_id;
+	bool m_claimed;
+};
+
+
+bool hedge::claim(int leg, bool error)
+{
+	mp::pthread_scoped_lock lk(m_mutex);
+	if(m_winner >= 0) {
+		return m_winner == leg;
+	}
+	if(error) {
+		m_failed[leg] = true;
+		// let the other leg answer if it can
+		const int other = 1 - leg;
+		if(other == 0 ? !m_failed[0] : (m_hedged && !m_failed[1])) {
+			return false;
+		}
+	}
+	m_winner = leg;
+	return true;
+}
+
+void hedge::release()
+{
+	upstream::shared_request req;  // released after unlocking
+	core::shared_deadline timer;
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		req.swap(m_req);
+		timer.swap(m_timer);
+	}
+	// the timer holds the hedge until it's cancelled
+	core::cancel_deadline(timer);
+}
+
+bool hedge::cancelled(int leg)
+{
+	upstream::shared_request req;
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		if(m_winner >= 0) {
+			return m_winner != leg;
+		}
+		req = m_req;
+	}
+	return !req || req->cancelled();
+}
+
+void hedge::start(upstream::server* sv, unsigned int delay_usec)
+{
+	upstream::shared_request first(new leg(shared_from_this(), 0));
+	flight_get(sv, m_key.data(), m_key.size(), m_require_cas, first);
+
+	try {
+		core::shared_deadline timer = core::deadline_event(
+				(delay_usec + 999) / 1000,
+				mp::bind(&hedge::fire, shared_from_this()));
+		mp::pthread_scoped_lock lk(m_mutex);
+		if(m_winner < 0) {
+			m_timer = timer;
+			return;
+		}
+	} catch (std::exception& e) {
+		LOG_WARN("hedge timer failed: ",e.what());
+		return;
+	}
+	// the first leg has answered already
+	release();
+}
+
+void hedge::fire()
+{
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		m_timer.reset();
+		if(m_winner >= 0 || m_failed[0]) {
+			return;
+		}
+		if(!hedge_budget::spend()) {
+			s_hedge_budget_exhausted.incr();
+			return;
+		}
+		m_hedged = true;
+	}
+
+	upstream::server* sv = m_replica->route(m_key.data(), m_key.size());
+	if(!sv) {
+		fail_hedge();
+		return;
+	}
+
+	s_hedge_sent.incr();
+	try {
+		upstream::shared_request second(new leg(shared_from_this(), 1));
+		flight_get(sv, m_key.data(), m_key.size(), m_require_cas, second);
+	} catch (std::exception& e) {
+		LOG_WARN("hedge failed: ",e.what());
+		fail_hedge();
+	}
+}
+
+// the hedge is not sent; answers the error if the first leg has
+// already failed while waiting for it
+void hedge::fail_hedge()
+{
+	if(claim(1, true)) {
+		upstream::shared_request req;
+		{
+			mp::pthread_scoped_lock lk(m_mutex);
+			req.swap(m_req);
+		}
+		if(req) {
+			req->complete(upstream::STATUS_SERVER_ERROR);
+		}
+	}
+}
+
+}  // noname namespace
+
+
+void hedged_get(upstream::server* sv,
+		proxy_client::shared_server_set replica,
+		const char* key, size_t keylen,
+		bool require_cas, upstream::shared_request req)
+{
+	hedge_budget::earn();
+
+	unsigned int delay = s_hedge_delay;
+	if(delay == 0) {
+		delay = sv->latency_p95();
+	}
+
+	shared_hedge hg(new hedge(replica, key, keylen, require_cas, req));
+	hg->start(sv, delay);
+}
+
+
+}  // namespace memtext
+}  // namespace memxy
+
@@ -0,0 +1,47 @@
+//
+// memxy::gate_memtext - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef GATE_MEMTEXT_HEDGE_H__
+#define GATE_MEMTEXT_HEDGE_H__
+
+#include "upstream.h"
+#include "proxy_client.h"
+
+namespace memxy {
+namespace memtext {
+
+
+// Sends a single-key get to the server. If it doesn't respond within
+// the hedge delay, the same get is sent to the owner of the key in the
+// replica set and the response which arrives first is used.
+void hedged_get(upstream::server* sv,
+		proxy_client::shared_server_set replica,
+		const char* key, size_t keylen,
+		bool require_cas, upstream::shared_request req);
+
+// returns false if hedging is disabled
+bool hedge_enabled();
+
+// enables hedging; delay_usec 0 waits for the 95th percentile response
+// time of the server; at most budget_percent of gets are hedged
+void set_hedge(unsigned int delay_usec, unsigned int budget_percent);
+
+
+}  // namespace memtext
+}  // namespace memxy
+
+#endif /* gate_memtext_hedge.h */
@@ -16,39 +16,101 @@
 //    limitations under the License.
 //
 #include "gate_memtext_impl.h"
+#include <memory>
 
 namespace memxy {
 namespace memtext {
 
 
-void send_error(int fd, int err)
+const char* error_reply(upstream::status st)
 {
-	switch(err) {
-	case MEMCACHED_NOTSTORED:
-		send_static(fd, "NOT_STORED\r\n");
-		break;
-	case MEMCACHED_DELETED:
-		send_static(fd, "DELETED\r\n");
-		break;
-	case MEMCACHED_NOTFOUND:
-		send_static(fd, "NOT_FOUND\r\n");
-		break;
-	case MEMCACHED_CLIENT_ERROR:
-		send_static(fd, "CLIENT_ERROR\r\n");
-		break;
-	case MEMCACHED_NO_SERVERS:
-		send_static(fd, "SERVER_ERROR no server\r\n");
-		break;
-	case MEMCACHED_SERVER_ERROR:
-		send_static(fd, "SERVER_ERROR\r\n");
-		break;
+	using namespace upstream;
+	switch(st) {
+	case STATUS_NOT_STORED:
+		return "NOT_STORED\r\n";
+	case STATUS_EXISTS:
+		return "EXISTS\r\n";
+	case STATUS_NOT_FOUND:
+		return "NOT_FOUND\r\n";
+	case STATUS_ERROR:
+		return "ERROR\r\n";
+	case STATUS_CLIENT_ERROR:
+		return "CLIENT_ERROR\r\n";
+	case STATUS_NO_SERVER:
+		return "SERVER_ERROR no server\r\n";
+	case STATUS_CONNECTION_ERROR:
+		return "SERVER_ERROR connection failure\r\n";
+	case STATUS_TIMEOUT:
+		return "SERVER_ERROR timeout\r\n";
+	case STATUS_OVERLOADED:
+		return "SERVER_ERROR overloaded\r\n";
+	case STATUS_CANCELLED:
+		return "SERVER_ERROR cancelled\r\n";
+	case STATUS_SERVER_ERROR:
+		return "SERVER_ERROR\r\n";
 	default:
-		send_static(fd, "SERVER_ERROR unknown error\r\n");
-		break;
+		return "SERVER_ERROR unknown error\r\n";
 	}
 }
 
 
+reply* handler::hold()
+{
+	std::auto_ptr<reply> r(new reply());
+	mp::pthread_scoped_lock lk(m_reply_mutex);
+	m_reply.push_back(r.get());
+	return r.release();
+}
+
+void handler::commit(reply* r)
+{
+	mp::pthread_scoped_lock lk(m_reply_mutex);
+	r->done = true;
+	while(!m_reply.empty() && m_reply.front()->done) {
+		reply* f = m_reply.front();
+		m_reply.pop_front();
+		core::commit(fd(), &f->xf);
+		delete f;
+	}
+
+	// sends the part of the streaming reply which became the head
+	if(!m_reply.empty() && !m_reply.front()->xf.empty()) {
+		core::commit(fd(), &m_reply.front()->xf);
+	}
+}
+
+void handler::stream(reply* r, core::xfer* xf)
+{
+	mp::pthread_scoped_lock lk(m_reply_mutex);
+	if(m_reply.front() == r) {
+		core::commit(fd(), xf);
+	} else {
+		xf->migrate(&r->xf);
+	}
+}
+
+void handler::commit_static(reply* r, const char* str)
+{
+	r->xf.push_write(str, strlen(str));
+	commit(r);
+}
+
+void handler::send_static(const char* str)
+{
+	mp::pthread_scoped_lock lk(m_reply_mutex);
+	if(m_reply.empty()) {
+		core::write(fd(), str, strlen(str));
+		return;
+	}
+
+	std::auto_ptr<reply> r(new reply());
+	r->xf.push_write(str, strlen(str));
+	r->done = true;
+	m_reply.push_back(r.get());
+	r.release();
+}
+
+
 }  // namespace memtext
 }  // namespace memxy
 
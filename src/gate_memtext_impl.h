@@ -20,13 +20,85 @@
 
 #include "gate_memtext.h"
 #include "proxy_client.h"
+#include "upstream.h"
 #include "wavy_core.h"
+#include "memproto/memtext.h"
+#include <mp/stream_buffer.h>
+#include <mp/pthread.h>
+#include <deque>
 
 namespace memxy {
 namespace memtext {
 
 
-#define CAST_USER(user) ((int)(ptrdiff_t)(user))
+// replies are sent in the order of requests even if
+// upstream servers respond in different order.
+struct reply {
+	reply() : done(false) { }
+	core::xfer xf;
+	bool done;
+};
+
+
+class handler : public core::handler {
+public:
+	handler(int fd);
+	~handler();
+
+public:
+	void read_event();
+
+	// reserves a place of the reply
+	reply* hold();
+
+	// sends the reply after preceding replies are sent
+	void commit(reply* r);
+
+	// appends a part of the reply which is not done yet; it is sent
+	// immediately if preceding replies are already sent
+	void stream(reply* r, core::xfer* xf);
+
+	void commit_static(reply* r, const char* str);
+
+	void send_static(const char* str);
+
+	// true after the client closed the connection; requests of the
+	// client are cancelled
+	bool is_closed() const { return m_closed; }
+
+	// continues reading after the upstream drained a streamed value
+	static void resume(mp::weak_ptr<handler> wh);
+
+private:
+	int start_value_stream();
+	bool forward_value();
+	void abort_value();
+	void disconnected();
+
+private:
+	mp::stream_buffer m_buffer;
+	memtext_parser m_parser;
+	size_t m_off;
+
+	// the value of a set which is forwarded as it arrives
+	upstream::shared_value_stream m_value;
+	size_t m_value_left;  // bytes of the value not received yet
+	bool m_paused;        // events are held until resume() is called
+
+	volatile bool m_closed;
+
+	mp::pthread_mutex m_reply_mutex;
+	std::deque<reply*> m_reply;
+
+private:
+	handler();
+	handler(const handler&);
+};
+
+typedef mp::shared_ptr<handler> shared_handler;
+
+
+#define CAST_USER(user) static_cast<handler*>(user)
 
 
 static const char* const NOT_SUPPORTED_REPLY = "CLIENT_ERROR supported\r\n";
@@ -35,12 +107,17 @@ static const char* const STORE_FAILED_REPLY  = "SERVER_ERROR store failed\r\n";
 static const char* const DELETE_FAILED_REPLY = "SERVER_ERROR delete failed\r\n";
 
 
-static inline void send_static(int fd, const char* str)
+const char* error_reply(upstream::status st);
+
+static inline void send_error(handler* h, upstream::status st)
 {
-	core::write(fd, str, strlen(str));
+	h->send_static(error_reply(st));
 }
 
-void send_error(int fd, int err);
+static inline void commit_error(handler* h, reply* r, upstream::status st)
+{
+	h->commit_static(r, error_reply(st));
+}
 
 
 }  // namespace memtext
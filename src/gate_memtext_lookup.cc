@@ -0,0 +1,173 @@
+//
+// memxy::gate_memtext - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "gate_memtext_lookup.h"
+#include "gate_memtext_flight.h"
+#include <cclog/cclog.h>
+#include <string>
+
+namespace memxy {
+namespace memtext {
+
+
+namespace {
+
+// the get sent to the secondary server after a miss
+class secondary_request : public upstream::request {
+public:
+	secondary_request(shared_secondary_lookup sl,
+			upstream::shared_request req, upstream::status miss) :
+		m_lookup(sl), m_req(req), m_miss(miss), m_hit(false) { }
+
+	void value(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* val, size_t vallen,
+			upstream::chunk* ck)
+	{
+		m_hit = true;
+		m_req->value(key, keylen, flags, cas, val, vallen, ck);
+		m_lookup->found(key, keylen, flags, val, vallen);
+	}
+
+	bool accept_splice(const char* key, size_t keylen)
+	{
+		return !m_lookup->copies() && m_req->accept_splice(key, keylen);
+	}
+
+	void value_splice(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* head, size_t headlen, upstream::chunk* ck,
+			int pipefd, size_t pipelen)
+	{
+		m_hit = true;
+		m_req->value_splice(key, keylen, flags, cas,
+				head, headlen, ck, pipefd, pipelen);
+	}
+
+	void complete(upstream::status st)
+	{
+		if(st == upstream::STATUS_CANCELLED) {
+			m_req->complete(st);
+			return;
+		}
+		m_lookup->done(m_hit, st);
+		if(m_hit) {
+			m_req->complete(upstream::STATUS_SUCCESS);
+		} else {
+			m_req->complete(m_miss);
+		}
+	}
+
+	bool cancelled()
+	{
+		return m_req->cancelled();
+	}
+
+private:
+	shared_secondary_lookup m_lookup;
+	upstream::shared_request m_req;
+	const upstream::status m_miss;
+	bool m_hit;
+};
+
+
+// the get sent to the primary server
+class primary_request : public upstream::request {
+public:
+	primary_request(shared_secondary_lookup sl,
+			const char* key, size_t keylen,
+			upstream::shared_request req) :
+		m_lookup(sl), m_key(key, keylen), m_req(req), m_hit(false) { }
+
+	void value(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* val, size_t vallen,
+			upstream::chunk* ck)
+	{
+		m_hit = true;
+		m_req->value(key, keylen, flags, cas, val, vallen, ck);
+	}
+
+	bool accept_splice(const char* key, size_t keylen)
+	{
+		return m_req->accept_splice(key, keylen);
+	}
+
+	void value_splice(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* head, size_t headlen, upstream::chunk* ck,
+			int pipefd, size_t pipelen)
+	{
+		m_hit = true;
+		m_req->value_splice(key, keylen, flags, cas,
+				head, headlen, ck, pipefd, pipelen);
+	}
+
+	void complete(upstream::status st)
+	{
+		if(m_hit || (st != upstream::STATUS_SUCCESS &&
+					st != upstream::STATUS_NOT_FOUND)) {
+			m_req->complete(st);
+			return;
+		}
+
+		const char* key = m_key.data();
+		size_t keylen = m_key.size();
+		upstream::server* sv = m_lookup->route(key, keylen);
+		if(!sv) {
+			m_req->complete(st);
+			return;
+		}
+
+		try {
+			upstream::shared_request sr(
+					new secondary_request(m_lookup, m_req, st));
+			flight_get(sv, key, keylen, false, sr);
+		} catch (std::exception& e) {
+			LOG_WARN("lookup of a miss failed: ",e.what());
+			m_lookup->done(false, upstream::STATUS_SERVER_ERROR);
+			m_req->complete(st);
+		}
+	}
+
+	bool cancelled()
+	{
+		return m_req->cancelled();
+	}
+
+private:
+	shared_secondary_lookup m_lookup;
+	const std::string m_key;
+	upstream::shared_request m_req;
+	bool m_hit;
+};
+
+}  // noname namespace
+
+
+upstream::shared_request lookup_on_miss(shared_secondary_lookup sl,
+		const char* key, size_t keylen,
+		upstream::shared_request req)
+{
+	return upstream::shared_request(new primary_request(
+				sl, key, keylen, req));
+}
+
+
+}  // namespace memtext
+}  // namespace memxy
+
@@ -0,0 +1,67 @@
+//
+// memxy::gate_memtext - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef GATE_MEMTEXT_LOOKUP_H__
+#define GATE_MEMTEXT_LOOKUP_H__
+
+#include "upstream.h"
+
+namespace memxy {
+namespace memtext {
+
+
+// Where a get which missed is looked up again before the client is
+// answered: the previous owner of the key during a migration window, or
+// the cold pool of a tiered topology.
+class secondary_lookup {
+public:
+	virtual ~secondary_lookup() { }
+
+	// returns the server which a miss of the key is looked up in, or
+	// NULL to answer the miss
+	virtual upstream::server* route(const char* key, size_t keylen) = 0;
+
+	// true if values found in the secondary server are passed to found()
+	// and must be received into memory instead of being spliced
+	virtual bool copies() const = 0;
+
+	// called with a value found in the secondary server after it's
+	// forwarded to the client
+	virtual void found(const char* key, size_t keylen, uint32_t flags,
+			const char* val, size_t vallen) = 0;
+
+	// called when the lookup completed unless the client is gone;
+	// st is the status of the secondary server
+	virtual void done(bool hit, upstream::status st) = 0;
+};
+
+typedef mp::shared_ptr<secondary_lookup> shared_secondary_lookup;
+
+
+// returns the request to send a single-key get to the primary server
+// instead of req; a miss is looked up in the server which sl routes the
+// key to, and an error of that server is answered as the miss
+upstream::shared_request lookup_on_miss(shared_secondary_lookup sl,
+		const char* key, size_t keylen,
+		upstream::shared_request req);
+
+
+}  // namespace memtext
+}  // namespace memxy
+
+#endif /* gate_memtext_lookup.h */
+
@@ -0,0 +1,170 @@
+//
+// memxy::gate_memtext - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "gate_memtext_migration.h"
+#include "gate_memtext_lookup.h"
+#include "stats.h"
+#include <cclog/cclog.h>
+
+// exptime of the values written through to the new owner; the previous
+// owner doesn't tell the remaining time, so they expire after this
+// instead of living on after the original one
+#ifndef MEMTEXT_MIGRATION_EXPTIME
+#define MEMTEXT_MIGRATION_EXPTIME 600
+#endif
+
+namespace memxy {
+namespace memtext {
+
+
+static stats::counter s_fallbacks("migration_fallbacks");
+static stats::counter s_fallback_hits("migration_fallback_hits");
+static stats::counter s_write_through_failed("migration_write_through_failed");
+static stats::counter s_previous_failed("migration_previous_failed");
+
+
+upstream::server* previous_owner(const proxy_client::topology& tp,
+		upstream::server* owner, const char* key, size_t keylen)
+{
+	const proxy_client::migration* mg = tp.migrating.get();
+	if(!mg || !mg->active()) {
+		return NULL;
+	}
+	upstream::server* sv = mg->previous()->route(key, keylen);
+	if(!sv || sv->is_same(owner)) {
+		return NULL;
+	}
+	return sv;
+}
+
+void migration_set(const proxy_client::topology& tp, upstream::server* owner,
+		const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime,
+		const char* data, size_t datalen)
+{
+	upstream::server* sv = previous_owner(tp, owner, key, keylen);
+	if(!sv) {
+		return;
+	}
+
+	// noreply; the client doesn't wait for it
+	try {
+		sv->set(key, keylen, flags, exptime, data, datalen,
+				upstream::shared_request());
+	} catch (std::exception& e) {
+		LOG_WARN("migration set failed: ",e.what());
+		s_previous_failed.incr();
+	}
+}
+
+void migration_remove(const proxy_client::topology& tp, upstream::server* owner,
+		const char* key, size_t keylen, uint32_t exptime)
+{
+	upstream::server* sv = previous_owner(tp, owner, key, keylen);
+	if(!sv) {
+		return;
+	}
+
+	// noreply; the client doesn't wait for it
+	try {
+		sv->remove(key, keylen, exptime, upstream::shared_request());
+	} catch (std::exception& e) {
+		LOG_WARN("migration delete failed: ",e.what());
+		s_previous_failed.incr();
+	}
+}
+
+
+void count_migration_lookups(size_t keys)
+{
+	s_fallbacks.incr(keys);
+}
+
+void migration_write_through(upstream::server* owner,
+		const char* key, size_t keylen, uint32_t flags,
+		const char* val, size_t vallen)
+{
+	// noreply; the client doesn't wait for it. add doesn't
+	// overwrite a value which a client has set in the meantime
+	try {
+		owner->add(key, keylen, flags, MEMTEXT_MIGRATION_EXPTIME,
+				val, vallen, upstream::shared_request());
+	} catch (std::exception& e) {
+		LOG_WARN("migration write-through failed: ",e.what());
+		s_write_through_failed.incr();
+	}
+}
+
+void count_migration_result(const proxy_client::topology& tp, bool hit)
+{
+	tp.migrating->record(hit);
+	if(hit) {
+		s_fallback_hits.incr();
+	}
+}
+
+
+namespace {
+
+// a miss of the new owner is looked up in the previous owner
+class migration_lookup : public secondary_lookup {
+public:
+	migration_lookup(proxy_client::shared_topology tp,
+			upstream::server* owner, upstream::server* previous) :
+		m_topology(tp), m_owner(owner), m_previous(previous) { }
+
+	upstream::server* route(const char* key, size_t keylen)
+	{
+		s_fallbacks.incr();
+		return m_previous;
+	}
+
+	bool copies() const { return true; }
+
+	void found(const char* key, size_t keylen, uint32_t flags,
+			const char* val, size_t vallen)
+	{
+		migration_write_through(m_owner, key, keylen, flags, val, vallen);
+	}
+
+	void done(bool hit, upstream::status st)
+	{
+		count_migration_result(*m_topology, hit);
+	}
+
+private:
+	proxy_client::shared_topology m_topology;
+	upstream::server* m_owner;
+	upstream::server* m_previous;
+};
+
+}  // noname namespace
+
+
+upstream::shared_request migrating_get(proxy_client::shared_topology tp,
+		upstream::server* owner, upstream::server* previous,
+		const char* key, size_t keylen,
+		upstream::shared_request req)
+{
+	shared_secondary_lookup sl(new migration_lookup(tp, owner, previous));
+	return lookup_on_miss(sl, key, keylen, req);
+}
+
+
+}  // namespace memtext
+}  // namespace memxy
+
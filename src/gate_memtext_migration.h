@@ -0,0 +1,69 @@
+//
+// memxy::gate_memtext - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef GATE_MEMTEXT_MIGRATION_H__
+#define GATE_MEMTEXT_MIGRATION_H__
+
+#include "upstream.h"
+#include "proxy_client.h"
+
+namespace memxy {
+namespace memtext {
+
+
+// returns the owner of the key in the previous server list if the
+// topology is in a migration window and the owner has changed, or NULL
+upstream::server* previous_owner(const proxy_client::topology& tp,
+		upstream::server* owner, const char* key, size_t keylen);
+
+// writes the set to the previous owner of the key too, so that a miss of
+// the owner doesn't fall back to an older value
+void migration_set(const proxy_client::topology& tp, upstream::server* owner,
+		const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime,
+		const char* data, size_t datalen);
+
+// deletes the key from its previous owner too, so that a miss of the
+// owner doesn't bring back the deleted value
+void migration_remove(const proxy_client::topology& tp, upstream::server* owner,
+		const char* key, size_t keylen, uint32_t exptime);
+
+// returns the request to send a single-key get to the owner instead of
+// req; a miss falls back to the previous owner, and a value found there
+// is forwarded to req and added to the owner unless it has been set
+// there in the meantime
+upstream::shared_request migrating_get(proxy_client::shared_topology tp,
+		upstream::server* owner, upstream::server* previous,
+		const char* key, size_t keylen,
+		upstream::shared_request req);
+
+// a multi-get looks up the keys which the owner missed in their previous
+// owners by itself; these count the keys looked up, add a value found to
+// the owner unless it has been set there in the meantime, and record the
+// result of each key
+void count_migration_lookups(size_t keys);
+void migration_write_through(upstream::server* owner,
+		const char* key, size_t keylen, uint32_t flags,
+		const char* val, size_t vallen);
+void count_migration_result(const proxy_client::topology& tp, bool hit);
+
+
+}  // namespace memtext
+}  // namespace memxy
+
+#endif /* gate_memtext_migration.h */
+
@@ -20,87 +20,308 @@
 #include <inttypes.h>
 #include "gate_memtext_impl.h"
 #include "gate_memtext_retrieval.h"
+#include "gate_memtext_balance.h"
+#include "gate_memtext_flight.h"
+#include "gate_memtext_hedge.h"
+#include "gate_memtext_migration.h"
+#include "gate_memtext_shadow.h"
+#include "gate_memtext_tier.h"
+#include <stdio.h>
+#include <memory>
+#include <vector>
 
 #ifndef MEMTEXT_MULTI_MAX
 #define MEMTEXT_MULTI_MAX 1024
 #endif
 
+// values larger than this are not copied but sent from
+// the receive buffer of the upstream connection
+#ifndef MEMTEXT_ZERO_COPY_THRESHOLD
+#define MEMTEXT_ZERO_COPY_THRESHOLD (4*1024)
+#endif
+
 namespace memxy {
 namespace memtext {
 
 
+static volatile bool s_multi_get_streaming = true;
+
+void set_multi_get_streaming(bool enable)
+{
+	s_multi_get_streaming = enable;
+}
+
+
 // "VALUE "+keylen+" "+uint32+" "+uint32+" "+uint64+"\r\n\0"
 //          keylen     flags      vallen      cas
 #define HEADER_SIZE(keylen) \
 		(6 +(keylen)+ 1+  10  + 1 +  10  + 1 +  20  +  3)
 
 
-static int request_get_single(void* user,
-		memtext_command cmd,
-		memtext_request_retrieval* r,
-		bool require_cas)
+static void close_pipe(void* fd)
 {
-	int fd = CAST_USER(user);
+	::close((int)(intptr_t)fd);
+}
 
-	memcached_return err;
-	const char* const key = r->key[0];
-	size_t const keylen   = r->key_len[0];
-	char* val;
-	size_t vallen;
-	uint32_t flags;
+// closes the pipe unless it is released
+struct pipe_guard {
+	pipe_guard(int fd) : m_fd(fd) { }
+	~pipe_guard() { if(m_fd >= 0) { ::close(m_fd); } }
+	void release() { m_fd = -1; }
+private:
+	int m_fd;
+	pipe_guard();
+	pipe_guard(const pipe_guard&);
+};
+
+
+static char* fill_header(char* p, const char* key, size_t keylen,
+		uint32_t flags, size_t vallen, uint64_t cas, bool require_cas)
+{
+	memcpy(p, "VALUE ", 6);  p += 6;
+	memcpy(p, key, keylen);  p += keylen;
+	p += sprintf(p, " %" PRIu32 " %lu", flags, vallen);
+
+	if(require_cas) {
+		p += sprintf(p, " %" PRIu64 "\r\n", cas);
+	} else {
+		p[0] = '\r'; p[1] = '\n'; p += 2;
+	}
+
+	return p;
+}
 
+
+class get_request : public upstream::request {
+public:
+	get_request(handler* h, reply* r, bool require_cas) :
+		m_handler(h->shared_self<handler>()),
+		m_reply(r),
+		m_require_cas(require_cas),
+		m_buf(NULL), m_buflen(0),
+		m_val(NULL), m_vallen(0),
+		m_pipefd(-1), m_pipelen(0),
+		m_responded(0) { }
+
+	~get_request()
 	{
-		proxy_client::ref mc( proxy_client::get() );
-		val = memcached_get(*mc, key, keylen, &vallen, &flags, &err);
+		::free(m_buf);
+		if(m_pipefd >= 0) { ::close(m_pipefd); }
 	}
 
-	if(err && err != MEMCACHED_NOTFOUND) {
-		send_error(fd, err);
-		return 0;
+	void value(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* val, size_t vallen,
+			upstream::chunk* ck)
+	{
+		if(m_buf) { return; }
+
+		if(vallen < MEMTEXT_ZERO_COPY_THRESHOLD) {
+			// header + value + "\r\nEND\r\n"
+			m_buf = (char*)::malloc(HEADER_SIZE(keylen) + vallen + 7);
+			if(!m_buf) { throw std::bad_alloc(); }
+
+			char* p = fill_header(m_buf, key, keylen,
+					flags, vallen, cas, m_require_cas);
+			memcpy(p, val, vallen);  p += vallen;
+			memcpy(p, "\r\nEND\r\n", 7);  p += 7;
+
+			m_buflen = p - m_buf;
+
+		} else {
+			// header only; the value is sent from the receive buffer
+			m_buf = (char*)::malloc(HEADER_SIZE(keylen));
+			if(!m_buf) { throw std::bad_alloc(); }
+
+			char* p = fill_header(m_buf, key, keylen,
+					flags, vallen, cas, m_require_cas);
+
+			m_buflen = p - m_buf;
+			m_ref.reset(ck->retain());
+			m_val = val;
+			m_vallen = vallen;
+		}
 	}
 
-	if(!val) {
-		send_static(fd, "END\r\n");
-		return 0;
+	bool accept_splice(const char* key, size_t keylen)
+	{
+		return !m_buf;
 	}
 
-	char* const header = (char*)::malloc(HEADER_SIZE(keylen));
-	if(!header) { throw std::bad_alloc(); }
+	void value_splice(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* head, size_t headlen, upstream::chunk* ck,
+			int pipefd, size_t pipelen)
+	{
+		m_pipefd = pipefd;
+		m_pipelen = pipelen;
 
-	char* p = header;
+		m_buf = (char*)::malloc(HEADER_SIZE(keylen));
+		if(!m_buf) { throw std::bad_alloc(); }
 
-	memcpy(p, "VALUE ", 6);  p += 6;
-	memcpy(p, key, keylen);  p += keylen;
-	p += sprintf(p, " %"PRIu32" %lu", flags, vallen);
+		char* p = fill_header(m_buf, key, keylen,
+				flags, headlen + pipelen, cas, m_require_cas);
 
-	if(require_cas) {
-		// FIXME cas
-		p += sprintf(p, " %"PRIu64"\r\n", (uint64_t)0);
-	} else {
-		p[0] = '\r'; p[1] = '\n'; p += 2;
+		m_buflen = p - m_buf;
+		m_ref.reset(ck->retain());
+		m_val = head;
+		m_vallen = headlen;
+	}
+
+	// answers the client only once; request_get_single fails the request
+	// if sending it throws, even after a part of it was sent
+	void complete(upstream::status st)
+	{
+		if(!__sync_bool_compare_and_swap(&m_responded, 0, 1)) {
+			return;
+		}
+
+		if(st != upstream::STATUS_SUCCESS) {
+			commit_error(m_handler.get(), m_reply, st);
+			return;
+		}
+
+		if(!m_buf) {
+			m_handler->commit_static(m_reply, "END\r\n");
+			return;
+		}
+
+		if(m_pipefd >= 0) {
+			struct iovec vec[2];
+			vec[0].iov_base = m_buf;
+			vec[0].iov_len  = m_buflen;
+			vec[1].iov_base = (void*)m_val;
+			vec[1].iov_len  = m_vallen;
+			m_reply->xf.push_writev(vec, 2);
+			m_reply->xf.push_splice(m_pipefd, m_pipelen);
+			m_reply->xf.push_write("\r\nEND\r\n", 7);
+			m_reply->xf.push_finalize(&close_pipe, (void*)(intptr_t)m_pipefd);
+			m_pipefd = -1;
+			m_reply->xf.push_finalize(m_ref);
+		} else if(m_ref.get()) {
+			struct iovec vec[3];
+			vec[0].iov_base = m_buf;
+			vec[0].iov_len  = m_buflen;
+			vec[1].iov_base = (void*)m_val;
+			vec[1].iov_len  = m_vallen;
+			vec[2].iov_base = (void*)"\r\nEND\r\n";
+			vec[2].iov_len  = 7;
+			m_reply->xf.push_writev(vec, 3);
+			m_reply->xf.push_finalize(m_ref);
+		} else {
+			m_reply->xf.push_write(m_buf, m_buflen);
+		}
+		m_reply->xf.push_finalize(&::free, m_buf);
+		m_buf = NULL;
+		m_handler->commit(m_reply);
+	}
+
+	bool cancelled()
+	{
+		return m_handler->is_closed();
+	}
+
+private:
+	shared_handler m_handler;
+	reply* m_reply;
+	bool m_require_cas;
+	char* m_buf;
+	size_t m_buflen;
+
+	// refers the receive buffer if the value is large
+	const char* m_val;
+	size_t m_vallen;
+	std::auto_ptr<mp::stream_buffer::reference> m_ref;
+
+	// the rest of the value left in the pipe if it's spliced
+	int m_pipefd;
+	size_t m_pipelen;
+
+	volatile int m_responded;
+};
+
+
+static int request_get_single(void* user,
+		memtext_command cmd,
+		memtext_request_retrieval* r,
+		bool require_cas)
+{
+	handler* h = CAST_USER(user);
+
+	proxy_client::shared_topology tp( proxy_client::current_topology() );
+
+	proxy_client::server_set* ss = tp->pool_of(r->key[0], r->key_len[0]);
+
+	upstream::server* sv = ss->route(r->key[0], r->key_len[0]);
+	if(!sv) {
+		send_error(h, upstream::STATUS_NO_SERVER);
+		return 0;
 	}
 
-	struct iovec vec[3];
-	vec[0].iov_base = header;
-	vec[0].iov_len  = p - header;
-	vec[1].iov_base = const_cast<char*>(val);
-	vec[1].iov_len  = vallen;
-	vec[2].iov_base = const_cast<char*>("\r\nEND\r\n");
-	vec[2].iov_len  = 7;
+	reply* rp = h->hold();
+	mp::shared_ptr<get_request> gr;
+	try {
+		gr.reset(new get_request(h, rp, require_cas));
+		upstream::shared_request req(gr);
+
+		// cas values differ between replicas; gets is neither balanced
+		// nor hedged
+		upstream::server* owner = sv;
+		proxy_client::shared_server_set other;
+		if(!require_cas && ss == tp->primary.get() &&
+				!tp->replicas.empty()) {
+			other = tp->replicas[0];
+			if(balance_enabled()) {
+				sv = balanced_owner(*tp, owner, r->key[0], r->key_len[0], &other);
+			}
+		}
+
+		// after the migration fallback, a miss is looked up in the cold pool
+		if(ss == tp->primary.get() && !require_cas && tp->cold) {
+			req = tiered_get(tp, r->key[0], r->key_len[0], req);
+		}
+
+		// a replica has no previous owner to fall back to
+		if(ss == tp->primary.get() && !require_cas && sv == owner) {
+			upstream::server* prev = previous_owner(*tp, sv,
+					r->key[0], r->key_len[0]);
+			if(prev) {
+				req = migrating_get(tp, sv, prev, r->key[0], r->key_len[0], req);
+			}
+		}
+		if(ss == tp->primary.get() && shadow_sampled(*tp, r->key[0], r->key_len[0])) {
+			req = shadow_get(*tp, r->key[0], r->key_len[0], req);
+		}
+		if(other && hedge_enabled()) {
+			hedged_get(sv, other, r->key[0], r->key_len[0],
+					require_cas, req);
+		} else {
+			flight_get(sv, r->key[0], r->key_len[0], require_cas, req);
+		}
+	} catch (...) {
+		// rp belongs to the request once it's created; a hedge may have
+		// sent it and got the response already
+		if(gr) {
+			gr->complete(upstream::STATUS_SERVER_ERROR);
+		} else {
+			commit_error(h, rp, upstream::STATUS_SERVER_ERROR);
+		}
+		throw;
+	}
 
-	core::writev(fd, vec, 3, &::free, header);
 	return 0;
 }
 
 
 class multi_set {
 public:
-	multi_set() : val(NULL), vallen(0), flags(0) { }
+	multi_set() : val(NULL), vallen(0), flags(0), cas(0) { }
 	~multi_set() { ::free(val); }
 
 	char* val;
 	size_t vallen;
 	uint32_t flags;
+	uint64_t cas;
 
 private:
 	multi_set(const multi_set&);
@@ -137,97 +358,613 @@ private:
 	multi_set_carry(const multi_set&);
 };
 
-static int request_get_multi(void* user,
-		memtext_command cmd,
-		memtext_request_retrieval* r,
-		bool require_cas)
-{
-	int fd = CAST_USER(user);
 
-	if(r->key_num > MEMTEXT_MULTI_MAX) {
-		send_error(fd, MEMCACHED_CLIENT_ERROR);
-		return 0;
+// Keys are grouped by the owner server and its connection which the key
+// is assigned to, and all groups are sent at once.
+// Misses of a group are looked up again like a single-key get: in the
+// previous owner during a migration window, then in the cold pool.
+// Gets of the keys sampled for the shadow pool are mirrored one by one.
+// In streaming mode each VALUE is written as soon as it arrives;
+// otherwise values are kept until all groups complete and replied in
+// the order of the keys.
+class multi_get_request : public mp::enable_shared_from_this<multi_get_request> {
+public:
+	multi_get_request(handler* h, reply* r, bool require_cas,
+			proxy_client::shared_topology tp,
+			memtext_request_retrieval* req);
+
+	~multi_get_request();
+
+	void start();
+
+private:
+	class group;
+	friend class group;
+	typedef std::vector<mp::shared_ptr<group> > groups_t;
+
+	// where the keys of a group are looked up
+	enum source {
+		OWNER,     // the server which the keys are routed to
+		PREVIOUS,  // the previous owner of keys which the owner missed
+		COLD       // the cold pool
+	};
+
+	void assign(groups_t* groups, upstream::server* sv, size_t i,
+			source src, bool tiered, bool migrating);
+	void fall_through(const group& g);
+	void group_complete(upstream::status st);
+	void stream_value(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* val, size_t vallen,
+			upstream::chunk* ck,
+			int pipefd = -1, size_t pipelen = 0);
+	void send_reply();
+
+private:
+	shared_handler m_handler;
+	reply* m_reply;
+	bool m_require_cas;
+	bool m_streaming;
+
+	proxy_client::shared_topology m_topology;
+
+	size_t m_num;
+	char* m_keybuf;
+	std::vector<char*> m_key;
+	std::vector<size_t> m_key_len;
+
+	// each group writes only the entries of its keys;
+	// NULL in streaming mode
+	multi_set* m_multi;
+
+	// when the get of the key i was mirrored to the shadow pool, or 0;
+	// empty unless the topology has a shadow pool
+	std::vector<uint64_t> m_shadow;
+
+	// number of groups which are not completed yet
+	volatile size_t m_pending;
+	volatile int m_status;
+
+private:
+	multi_get_request();
+	multi_get_request(const multi_get_request&);
+};
+
+// keys sent to one connection of a server
+class multi_get_request::group : public upstream::request {
+public:
+	// misses of a migrating group are looked up in their previous owners
+	// by a PREVIOUS group, and then misses of a tiered group in the cold
+	// pool by a COLD group
+	group(mp::shared_ptr<multi_get_request> parent,
+			upstream::server* sv, size_t ch,
+			source src, bool tiered, bool migrating) :
+		m_parent(parent), m_server(sv), m_channel(ch),
+		m_source(src), m_tiered(tiered), m_migrating(migrating),
+		m_scan(0) { }
+
+	bool is(upstream::server* sv, size_t ch) const
+		{ return m_server == sv && m_channel == ch; }
+
+	void push_back(size_t i)
+	{
+		m_index.push_back(i);
+		m_hit.push_back(false);
 	}
 
-	memcached_return err;
-	multi_set multi[r->key_num];
-	size_t found_keys = 0;
-	size_t total_keylen = 0;
+	void send(mp::shared_ptr<group> self);
 
+	void value(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* val, size_t vallen,
+			upstream::chunk* ck);
+
+	// promote() and the write-through of a PREVIOUS group copy the
+	// values from memory
+	bool accept_splice(const char* key, size_t keylen)
 	{
-		proxy_client::ref mc( proxy_client::get() );
-		err = memcached_mget(*mc, r->key, r->key_len, r->key_num);
+		return m_parent->m_streaming && m_source != PREVIOUS &&
+			!(m_source == COLD && m_parent->m_topology->cold_promote);
+	}
+
+	void value_splice(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* head, size_t headlen, upstream::chunk* ck,
+			int pipefd, size_t pipelen);
+
+	void complete(upstream::status st);
+
+	bool cancelled()
+	{
+		return m_parent->m_handler->is_closed();
+	}
+
+private:
+	size_t find(const char* key, size_t keylen);
+	void write_through(const char* key, size_t keylen,
+			uint32_t flags, const char* val, size_t vallen);
+
+private:
+	mp::shared_ptr<multi_get_request> m_parent;
+	upstream::server* m_server;
+	size_t m_channel;
+	const source m_source;
+	const bool m_tiered;
+	const bool m_migrating;
+	std::vector<size_t> m_index;
+	std::vector<bool> m_hit;
+	size_t m_scan;
+
+	friend class multi_get_request;
+
+private:
+	group();
+	group(const group&);
+};
+
+multi_get_request::multi_get_request(handler* h, reply* r, bool require_cas,
+		proxy_client::shared_topology tp,
+		memtext_request_retrieval* req) :
+	m_handler(h->shared_self<handler>()),
+	m_reply(r),
+	m_require_cas(require_cas),
+	m_streaming(s_multi_get_streaming),
+	m_topology(tp),
+	m_num(req->key_num),
+	m_keybuf(NULL),
+	m_key(req->key_num),
+	m_key_len(req->key_len, req->key_len + req->key_num),
+	m_multi(NULL),
+	m_pending(0),
+	m_status(upstream::STATUS_SUCCESS)
+{
+	size_t total = 0;
+	for(size_t i=0; i < m_num; ++i) {
+		total += m_key_len[i];
+	}
+
+	m_keybuf = (char*)::malloc(total);
+	if(!m_keybuf) { throw std::bad_alloc(); }
+
+	char* p = m_keybuf;
+	for(size_t i=0; i < m_num; ++i) {
+		memcpy(p, req->key[i], m_key_len[i]);
+		m_key[i] = p;
+		p += m_key_len[i];
+	}
+
+	if(!m_streaming) {
+		m_multi = new multi_set[m_num];
+	}
+}
+
+multi_get_request::~multi_get_request()
+{
+	delete[] m_multi;
+	::free(m_keybuf);
+}
+
+void multi_get_request::start()
+{
+	groups_t groups;
+
+	const bool balance = !m_require_cas && balance_enabled() &&
+		!m_topology->replicas.empty();
+	const bool tiered = !m_require_cas && m_topology->cold;
+	const bool migrating = !m_require_cas && m_topology->migrating;
+
+	if(m_topology->shadow && m_topology->shadow_percent > 0) {
+		m_shadow.resize(m_num, 0);
+	}
 
-		if(err) {
-			send_error(fd, err);
-			return 0;
+	for(size_t i=0; i < m_num; ++i) {
+		proxy_client::server_set* ss =
+			m_topology->pool_of(m_key[i], m_key_len[i]);
+		upstream::server* sv = ss->route(m_key[i], m_key_len[i]);
+		if(!sv) {
+			// the key isn't routed to a pool and no server is set
+			m_status = upstream::STATUS_NO_SERVER;
+			continue;
+		}
+		const bool primary = ss == m_topology->primary.get();
+		if(!m_shadow.empty() && primary &&
+				shadow_sampled(*m_topology, m_key[i], m_key_len[i])) {
+			m_shadow[i] = shadow_get_key(*m_topology, m_key[i], m_key_len[i]);
+		}
+		upstream::server* owner = sv;
+		if(balance && primary) {
+			proxy_client::shared_server_set other;
+			sv = balanced_owner(*m_topology, owner,
+					m_key[i], m_key_len[i], &other);
 		}
+		// a replica has no previous owner to fall back to
+		assign(&groups, sv, i, OWNER, tiered && primary,
+				migrating && primary && sv == owner);
+	}
 
-		for(unsigned int i=0; i < r->key_num; ++i) {
-			multi[i].val = memcached_fetch(*mc, r->key[i], &r->key_len[i],
-					&multi[i].vallen, &multi[i].flags, &err);
+	// +1: completes after all groups are sent
+	m_pending = groups.size() + 1;
 
-			if(err) {
-				if(err == MEMCACHED_NOTFOUND) { continue; }
-				if(err == MEMCACHED_END) { break; }
-				send_error(fd, err);
-				return 0;
-			}
+	for(groups_t::iterator it(groups.begin()), it_end(groups.end());
+			it != it_end; ++it) {
+		try {
+			(*it)->send(*it);
+		} catch (...) {
+			// the group never completes
+			group_complete(upstream::STATUS_SERVER_ERROR);
+		}
+	}
+
+	group_complete(upstream::STATUS_SUCCESS);
+}
 
-			if(multi[i].val) {
-				++found_keys;
-				total_keylen += r->key_len[i];
+// adds the key i to the group of its connection of sv
+void multi_get_request::assign(groups_t* groups, upstream::server* sv,
+		size_t i, source src, bool tiered, bool migrating)
+{
+	size_t ch = sv->channel_of(m_key[i], m_key_len[i]);
+
+	groups_t::iterator it(groups->begin());
+	for(; it != groups->end(); ++it) {
+		if((*it)->is(sv, ch)) { break; }
+	}
+	if(it == groups->end()) {
+		groups->push_back(mp::shared_ptr<group>(
+					new group(shared_from_this(), sv, ch,
+						src, tiered, migrating)));
+		it = groups->end() - 1;
+	}
+
+	(*it)->push_back(i);
+}
+
+// sends the keys which the group missed to their previous owners, or to
+// the cold pool; called before the group completes so that m_pending
+// doesn't reach 0
+void multi_get_request::fall_through(const group& g)
+{
+	groups_t groups;
+	size_t previous_keys = 0;
+	size_t cold_keys = 0;
+
+	for(size_t j=0; j < g.m_index.size(); ++j) {
+		if(g.m_hit[j]) { continue; }
+		size_t i = g.m_index[j];
+		if(g.m_migrating) {
+			upstream::server* prev = previous_owner(*m_topology, g.m_server,
+					m_key[i], m_key_len[i]);
+			if(prev) {
+				assign(&groups, prev, i, PREVIOUS, g.m_tiered, false);
+				++previous_keys;
+				continue;
 			}
 		}
+		if(!g.m_tiered) { continue; }
+		upstream::server* sv = m_topology->cold->route(m_key[i], m_key_len[i]);
+		if(!sv) { continue; }
+		assign(&groups, sv, i, COLD, false, false);
+		++cold_keys;
 	}
 
-	if(found_keys == 0) {
-		send_static(fd, "END\r\n");
-		return 0;
+	if(groups.empty()) {
+		return;
+	}
+	if(previous_keys > 0) {
+		count_migration_lookups(previous_keys);
+	}
+	if(cold_keys > 0) {
+		count_cold_lookups(cold_keys);
 	}
 
-	std::auto_ptr<multi_set_carry> carry( new multi_set_carry(
-				multi, sizeof(multi)/sizeof(multi_set),
-				found_keys*HEADER_SIZE(0) + total_keylen) );
+	__sync_add_and_fetch(&m_pending, groups.size());
 
-	char* header = carry->buffer();
-	char* p = header;
-	struct iovec vec[found_keys*2 + 1];  // +1: last END
-	struct iovec* pv = vec;
+	for(groups_t::iterator it(groups.begin()), it_end(groups.end());
+			it != it_end; ++it) {
+		try {
+			(*it)->send(*it);
+		} catch (...) {
+			// answered as the misses of the group
+			(*it)->complete(upstream::STATUS_SERVER_ERROR);
+		}
+	}
+}
 
-	unsigned int i;
-	for(i=0; i < r->key_num; ++i) {
-		if( (*carry)[i] != NULL ) {
+void multi_get_request::group_complete(upstream::status st)
+{
+	if(st != upstream::STATUS_SUCCESS) {
+		__sync_bool_compare_and_swap(&m_status, upstream::STATUS_SUCCESS, st);
+	}
+
+	if(__sync_sub_and_fetch(&m_pending, 1) != 0) {
+		return;
+	}
+
+	if(m_status != upstream::STATUS_SUCCESS) {
+		commit_error(m_handler.get(), m_reply, (upstream::status)m_status);
+		return;
+	}
+
+	try {
+		if(m_streaming) {
+			m_handler->commit_static(m_reply, "END\r\n");
+		} else {
+			send_reply();
+		}
+	} catch (...) {
+		commit_error(m_handler.get(), m_reply, upstream::STATUS_SERVER_ERROR);
+	}
+}
+
+void multi_get_request::group::send(mp::shared_ptr<group> self)
+{
+	const multi_get_request& p(*m_parent);
+
+	if(m_index.size() == 1) {
+		size_t i = m_index[0];
+		flight_get(m_server, p.m_key[i], p.m_key_len[i],
+				p.m_require_cas, self);
+		return;
+	}
+
+	std::vector<const char*> keys(m_index.size());
+	std::vector<size_t> key_len(m_index.size());
+	for(size_t i=0; i < m_index.size(); ++i) {
+		keys[i] = p.m_key[m_index[i]];
+		key_len[i] = p.m_key_len[m_index[i]];
+	}
+
+	m_server->get(&keys[0], &key_len[0], m_index.size(),
+			p.m_require_cas, self);
+}
+
+void multi_get_request::group::complete(upstream::status st)
+{
+	if(m_source == COLD) {
+		size_t hits = 0;
+		for(size_t j=0; j < m_hit.size(); ++j) {
+			if(m_hit[j]) { ++hits; }
+		}
+		count_cold_result(hits, st);
+		if(st != upstream::STATUS_CANCELLED) {
+			// an error of the cold pool is a miss
+			st = upstream::STATUS_SUCCESS;
+		}
+		m_parent->group_complete(st);
+		return;
+	}
+
+	if(m_source == OWNER && !m_parent->m_shadow.empty() &&
+			(st == upstream::STATUS_SUCCESS ||
+			 st == upstream::STATUS_NOT_FOUND)) {
+		for(size_t j=0; j < m_hit.size(); ++j) {
+			uint64_t start = m_parent->m_shadow[m_index[j]];
+			if(start) {
+				count_primary_get(start, m_hit[j]);
+			}
+		}
+	}
+
+	if(m_source == PREVIOUS && st != upstream::STATUS_CANCELLED) {
+		for(size_t j=0; j < m_hit.size(); ++j) {
+			count_migration_result(*m_parent->m_topology, m_hit[j]);
+		}
+		// an error of the previous owner is a miss
+		st = upstream::STATUS_SUCCESS;
+	}
+
+	if((m_tiered || m_migrating) && (st == upstream::STATUS_SUCCESS ||
+				st == upstream::STATUS_NOT_FOUND)) {
+		try {
+			m_parent->fall_through(*this);
+		} catch (...) {
+			// the misses are answered as they are
+		}
+	}
+	m_parent->group_complete(st);
+}
+
+// values are returned in the order of the keys; returns the position of
+// the key in m_index, or m_index.size() if it's not found
+size_t multi_get_request::group::find(const char* key, size_t keylen)
+{
+	const multi_get_request& p(*m_parent);
+	for(; m_scan < m_index.size(); ++m_scan) {
+		size_t i = m_index[m_scan];
+		if(p.m_key_len[i] == keylen && memcmp(p.m_key[i], key, keylen) == 0) {
 			break;
 		}
 	}
+	return m_scan;
+}
 
-	pv->iov_base = p;
-	memcpy(p, "VALUE ", 6);  p += 6;
-	goto header_set;
+void multi_get_request::group::value(const char* key, size_t keylen,
+		uint32_t flags, uint64_t cas,
+		const char* val, size_t vallen,
+		upstream::chunk* ck)
+{
+	const multi_get_request& p(*m_parent);
+
+	if(find(key, keylen) >= m_index.size()) {
+		return;
+	}
+	m_hit[m_scan] = true;
+
+	if(m_source == COLD) {
+		promote(*p.m_topology, key, keylen, flags, val, vallen);
+	}
+
+	if(p.m_streaming) {
+		++m_scan;
+		m_parent->stream_value(key, keylen, flags, cas, val, vallen, ck);
+		write_through(key, keylen, flags, val, vallen);
+		return;
+	}
+
+	multi_set& m(p.m_multi[m_index[m_scan]]);
+	++m_scan;
+
+	m.val = (char*)::malloc(vallen);
+	if(!m.val) { throw std::bad_alloc(); }
+	memcpy(m.val, val, vallen);
+	m.vallen = vallen;
+	m.flags = flags;
+	m.cas = cas;
+
+	write_through(key, keylen, flags, val, vallen);
+}
+
+// adds a value found in the previous owner to the owner
+void multi_get_request::group::write_through(const char* key, size_t keylen,
+		uint32_t flags, const char* val, size_t vallen)
+{
+	if(m_source != PREVIOUS) {
+		return;
+	}
+	// only keys whose owner wasn't replaced by a replica fall back
+	upstream::server* owner = m_parent->m_topology->primary->route(key, keylen);
+	if(owner) {
+		migration_write_through(owner, key, keylen, flags, val, vallen);
+	}
+}
+
+void multi_get_request::group::value_splice(const char* key, size_t keylen,
+		uint32_t flags, uint64_t cas,
+		const char* head, size_t headlen, upstream::chunk* ck,
+		int pipefd, size_t pipelen)
+{
+	// accepted only in streaming mode
+	if(find(key, keylen) < m_index.size()) {
+		m_hit[m_scan] = true;
+		++m_scan;
+	}
+	m_parent->stream_value(key, keylen, flags, cas,
+			head, headlen, ck, pipefd, pipelen);
+}
+
+// the value is vallen bytes of val followed by pipelen bytes in pipefd
+void multi_get_request::stream_value(const char* key, size_t keylen,
+		uint32_t flags, uint64_t cas,
+		const char* val, size_t vallen,
+		upstream::chunk* ck,
+		int pipefd, size_t pipelen)
+{
+	core::xfer xf;
+
+	if(pipefd >= 0) {
+		pipe_guard pg(pipefd);
+		std::auto_ptr<mp::stream_buffer::reference> ref(ck->retain());
+
+		char* buf = (char*)::malloc(HEADER_SIZE(keylen));
+		if(!buf) { throw std::bad_alloc(); }
+
+		struct iovec vec[2];
+		vec[0].iov_base = buf;
+		vec[0].iov_len  = fill_header(buf, key, keylen,
+				flags, vallen + pipelen, cas, m_require_cas) - buf;
+		vec[1].iov_base = (void*)val;
+		vec[1].iov_len  = vallen;
+
+		try {
+			xf.push_writev(vec, 2);
+			xf.push_finalize(&::free, buf);
+		} catch (...) {
+			::free(buf);
+			throw;
+		}
+		xf.push_finalize(ref);
+		xf.push_splice(pipefd, pipelen);
+		xf.push_write("\r\n", 2);
+		xf.push_finalize(&close_pipe, (void*)(intptr_t)pipefd);
+		pg.release();
+
+	} else if(vallen < MEMTEXT_ZERO_COPY_THRESHOLD) {
+		// header + value + "\r\n"
+		char* buf = (char*)::malloc(HEADER_SIZE(keylen) + vallen + 2);
+		if(!buf) { throw std::bad_alloc(); }
+
+		char* p = fill_header(buf, key, keylen, flags, vallen, cas, m_require_cas);
+		memcpy(p, val, vallen);  p += vallen;
+		p[0] = '\r'; p[1] = '\n'; p += 2;
+
+		xf.push_write(buf, p - buf);
+		try {
+			xf.push_finalize(&::free, buf);
+		} catch (...) {
+			::free(buf);
+			throw;
+		}
+
+	} else {
+		std::auto_ptr<mp::stream_buffer::reference> ref(ck->retain());
+
+		char* buf = (char*)::malloc(HEADER_SIZE(keylen));
+		if(!buf) { throw std::bad_alloc(); }
+
+		struct iovec vec[3];
+		vec[0].iov_base = buf;
+		vec[0].iov_len  = fill_header(buf, key, keylen,
+				flags, vallen, cas, m_require_cas) - buf;
+		vec[1].iov_base = (void*)val;
+		vec[1].iov_len  = vallen;
+		vec[2].iov_base = (void*)"\r\n";
+		vec[2].iov_len  = 2;
 
-	for(; i < r->key_num; ++i) {
+		try {
+			xf.push_writev(vec, 3);
+			xf.push_finalize(&::free, buf);
+		} catch (...) {
+			::free(buf);
+			throw;
+		}
+		xf.push_finalize(ref);
+	}
+
+	m_handler->stream(m_reply, &xf);
+}
+
+void multi_get_request::send_reply()
+{
+	size_t found_keys = 0;
+	size_t total_keylen = 0;
+	for(size_t i=0; i < m_num; ++i) {
+		if(m_multi[i].val) {
+			++found_keys;
+			total_keylen += m_key_len[i];
+		}
+	}
+
+	if(found_keys == 0) {
+		m_handler->commit_static(m_reply, "END\r\n");
+		return;
+	}
+
+	std::auto_ptr<multi_set_carry> carry( new multi_set_carry(
+				m_multi, m_num,
+				found_keys*(2 + HEADER_SIZE(0)) + total_keylen) );
+
+	char* p = carry->buffer();
+	struct iovec vec[found_keys*2 + 1];  // +1: last END
+	struct iovec* pv = vec;
+
+	for(size_t i=0; i < m_num; ++i) {
 		if( (*carry)[i] == NULL ) {
 			continue;
 		}
 
-		pv->iov_base = p;
-		memcpy(p, "\r\nVALUE ", 8);  p += 8;
-	header_set:
-		memcpy(p, r->key[i], r->key_len[i]);  p += r->key_len[i];
-		p += sprintf(p, " %"PRIu32" %lu", multi[i].flags, multi[i].vallen);
-		if(require_cas) {
-			// FIXME cas
-			p += sprintf(p, " %"PRIu64"\r\n", (uint64_t)0);
-		} else {
+		char* const header = p;
+		if(pv != vec) {
+			// terminates previous value
 			p[0] = '\r'; p[1] = '\n'; p += 2;
 		}
-		pv->iov_len = p - header;
-		header = p;
+		p = fill_header(p, m_key[i], m_key_len[i],
+				m_multi[i].flags, m_multi[i].vallen, m_multi[i].cas,
+				m_require_cas);
+		pv->iov_base = header;
+		pv->iov_len  = p - header;
 		++pv;
 
 		pv->iov_base = (*carry)[i];
-		pv->iov_len  = multi[i].vallen;
+		pv->iov_len  = m_multi[i].vallen;
 		++pv;
 	}
 
@@ -235,7 +972,39 @@ static int request_get_multi(void* user,
 	pv->iov_len  = 7;
 	++pv;
 
-	core::writev(fd, vec, sizeof(vec)/sizeof(iovec), carry);
+	m_reply->xf.push_writev(vec, pv - vec);
+	m_reply->xf.push_finalize(carry);
+	m_handler->commit(m_reply);
+}
+
+
+static int request_get_multi(void* user,
+		memtext_command cmd,
+		memtext_request_retrieval* r,
+		bool require_cas)
+{
+	handler* h = CAST_USER(user);
+
+	if(r->key_num > MEMTEXT_MULTI_MAX) {
+		send_error(h, upstream::STATUS_CLIENT_ERROR);
+		return 0;
+	}
+
+	proxy_client::shared_topology tp( proxy_client::current_topology() );
+	if(tp->primary->size() == 0 && tp->pools.empty()) {
+		send_error(h, upstream::STATUS_NO_SERVER);
+		return 0;
+	}
+
+	reply* rp = h->hold();
+	try {
+		mp::shared_ptr<multi_get_request> req(
+				new multi_get_request(h, rp, require_cas, tp, r));
+		req->start();
+	} catch (...) {
+		commit_error(h, rp, upstream::STATUS_SERVER_ERROR);
+		throw;
+	}
 
 	return 0;
 }
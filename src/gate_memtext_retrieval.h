@@ -32,6 +32,8 @@ int request_gets(void* user,
 		memtext_command cmd,
 		memtext_request_retrieval* r);
 
+void set_multi_get_streaming(bool enable);
+
 
 }  // namespace memtext
 }  // namespace memxy
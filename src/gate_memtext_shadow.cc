@@ -0,0 +1,336 @@
+//
+// memxy::gate_memtext - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "gate_memtext_shadow.h"
+#include "wavy_core.h"
+#include "stats.h"
+#include <cclog/cclog.h>
+#include <time.h>
+#include <string>
+
+// mirrored requests queued or waiting for the response; the rest are
+// dropped
+#ifndef MEMTEXT_SHADOW_MAX_PENDING
+#define MEMTEXT_SHADOW_MAX_PENDING 4096
+#endif
+
+namespace memxy {
+namespace memtext {
+
+
+static stats::counter s_shadow_gets("shadow_gets");
+static stats::counter s_shadow_sets("shadow_sets");
+static stats::counter s_shadow_deletes("shadow_deletes");
+static stats::counter s_shadow_dropped("shadow_dropped");
+static stats::counter s_shadow_errors("shadow_errors");
+static stats::counter s_shadow_hits("shadow_hits");
+static stats::counter s_shadow_misses("shadow_misses");
+static stats::counter s_shadow_latency("shadow_latency_usec");
+static stats::counter s_primary_hits("shadow_primary_hits");
+static stats::counter s_primary_misses("shadow_primary_misses");
+static stats::counter s_primary_latency("shadow_primary_latency_usec");
+
+static volatile size_t s_pending = 0;
+
+static void release()
+{
+	__sync_sub_and_fetch(&s_pending, 1);
+}
+
+// FNV-1a; independent of the distribution so that the sample doesn't
+// follow the servers which the keys are assigned to
+static uint32_t hash_key(const char* key, size_t keylen)
+{
+	uint32_t h = 2166136261U;
+	for(size_t i=0; i < keylen; ++i) {
+		h ^= (unsigned char)key[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+bool shadow_sampled(const proxy_client::topology& tp,
+		const char* key, size_t keylen)
+{
+	if(!tp.shadow || tp.shadow_percent == 0) {
+		return false;
+	}
+	return hash_key(key, keylen) % 100 < tp.shadow_percent;
+}
+
+static uint64_t monotonic_usec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+namespace {
+
+enum operation {
+	OP_GET,
+	OP_SET,
+	OP_DELETE,
+};
+
+// the response from the shadow pool
+class shadow_response : public upstream::request {
+public:
+	shadow_response(operation op) :
+		m_op(op), m_hit(false), m_start(monotonic_usec()) { }
+
+	~shadow_response()
+	{
+		release();
+	}
+
+	void value(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* val, size_t vallen,
+			upstream::chunk* ck)
+	{
+		m_hit = true;
+	}
+
+	void complete(upstream::status st)
+	{
+		if(m_op == OP_SET) {
+			if(st != upstream::STATUS_SUCCESS) {
+				s_shadow_errors.incr();
+			}
+			return;
+		}
+		if(m_op == OP_DELETE) {
+			if(st != upstream::STATUS_SUCCESS && st != upstream::STATUS_NOT_FOUND) {
+				s_shadow_errors.incr();
+			}
+			return;
+		}
+		if(st != upstream::STATUS_SUCCESS && st != upstream::STATUS_NOT_FOUND) {
+			s_shadow_errors.incr();
+			return;
+		}
+		(m_hit ? s_shadow_hits : s_shadow_misses).incr();
+		s_shadow_latency.incr(monotonic_usec() - m_start);
+	}
+
+private:
+	const operation m_op;
+	bool m_hit;
+	const uint64_t m_start;
+};
+
+
+// forwards the response of the primary set to the client's request
+class measured_get : public upstream::request {
+public:
+	measured_get(upstream::shared_request req) :
+		m_req(req), m_hit(false), m_start(monotonic_usec()) { }
+
+	void value(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* val, size_t vallen,
+			upstream::chunk* ck)
+	{
+		m_hit = true;
+		m_req->value(key, keylen, flags, cas, val, vallen, ck);
+	}
+
+	bool accept_splice(const char* key, size_t keylen)
+	{
+		return m_req->accept_splice(key, keylen);
+	}
+
+	void value_splice(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* head, size_t headlen, upstream::chunk* ck,
+			int pipefd, size_t pipelen)
+	{
+		m_hit = true;
+		m_req->value_splice(key, keylen, flags, cas,
+				head, headlen, ck, pipefd, pipelen);
+	}
+
+	void complete(upstream::status st)
+	{
+		if(st == upstream::STATUS_SUCCESS || st == upstream::STATUS_NOT_FOUND) {
+			count_primary_get(m_start, m_hit);
+		}
+		m_req->complete(st);
+	}
+
+	bool cancelled()
+	{
+		return m_req->cancelled();
+	}
+
+private:
+	upstream::shared_request m_req;
+	bool m_hit;
+	const uint64_t m_start;
+};
+
+
+// a mirrored request; sent by a worker thread
+class mirror {
+public:
+	mirror(proxy_client::shared_server_set ss, operation op,
+			const char* key, size_t keylen) :
+		m_ss(ss), m_op(op), m_key(key, keylen),
+		m_flags(0), m_exptime(0) { }
+
+	void set_data(uint32_t flags, uint32_t exptime,
+			const char* data, size_t datalen)
+	{
+		m_flags = flags;
+		m_exptime = exptime;
+		m_data.assign(data, datalen);
+	}
+
+	static void send(mp::shared_ptr<mirror> self);
+
+private:
+	proxy_client::shared_server_set m_ss;
+	const operation m_op;
+	const std::string m_key;
+	uint32_t m_flags;
+	uint32_t m_exptime;
+	std::string m_data;
+
+private:
+	mirror();
+	mirror(const mirror&);
+};
+
+void mirror::send(mp::shared_ptr<mirror> self)
+{
+	const mirror& m(*self);
+
+	upstream::server* sv = m.m_ss->route(m.m_key.data(), m.m_key.size());
+	if(!sv) {
+		s_shadow_errors.incr();
+		release();
+		return;
+	}
+
+	upstream::shared_request res;
+	try {
+		// releases s_pending when the response is done
+		res.reset(new shadow_response(m.m_op));
+	} catch (...) {
+		s_shadow_errors.incr();
+		release();
+		return;
+	}
+
+	try {
+		switch(m.m_op) {
+		case OP_GET: {
+			const char* key = m.m_key.data();
+			size_t keylen = m.m_key.size();
+			sv->get(&key, &keylen, 1, false, res);
+			break; }
+		case OP_SET:
+			sv->set(m.m_key.data(), m.m_key.size(), m.m_flags, m.m_exptime,
+					m.m_data.data(), m.m_data.size(), res);
+			break;
+		case OP_DELETE:
+			sv->remove(m.m_key.data(), m.m_key.size(), m.m_exptime, res);
+			break;
+		}
+	} catch (std::exception& e) {
+		LOG_WARN("shadow request failed: ",e.what());
+		s_shadow_errors.incr();
+	}
+}
+
+// never fails the client's request; the request is dropped if too many
+// mirrored requests are pending
+static void submit(const proxy_client::topology& tp, operation op,
+		const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime,
+		const char* data, size_t datalen)
+{
+	if(__sync_add_and_fetch(&s_pending, 1) > MEMTEXT_SHADOW_MAX_PENDING) {
+		release();
+		s_shadow_dropped.incr();
+		return;
+	}
+
+	try {
+		mp::shared_ptr<mirror> m(new mirror(tp.shadow, op, key, keylen));
+		if(op != OP_GET) {
+			m->set_data(flags, exptime, data, datalen);
+		}
+		core::submit(&mirror::send, m);
+	} catch (std::exception& e) {
+		LOG_WARN("shadow request failed: ",e.what());
+		release();
+		s_shadow_dropped.incr();
+		return;
+	}
+
+	switch(op) {
+	case OP_GET:    s_shadow_gets.incr();    break;
+	case OP_SET:    s_shadow_sets.incr();    break;
+	case OP_DELETE: s_shadow_deletes.incr(); break;
+	}
+}
+
+}  // noname namespace
+
+
+upstream::shared_request shadow_get(const proxy_client::topology& tp,
+		const char* key, size_t keylen,
+		upstream::shared_request req)
+{
+	submit(tp, OP_GET, key, keylen, 0, 0, NULL, 0);
+	return upstream::shared_request(new measured_get(req));
+}
+
+uint64_t shadow_get_key(const proxy_client::topology& tp,
+		const char* key, size_t keylen)
+{
+	submit(tp, OP_GET, key, keylen, 0, 0, NULL, 0);
+	return monotonic_usec();
+}
+
+void count_primary_get(uint64_t start, bool hit)
+{
+	(hit ? s_primary_hits : s_primary_misses).incr();
+	s_primary_latency.incr(monotonic_usec() - start);
+}
+
+void shadow_set(const proxy_client::topology& tp,
+		const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime,
+		const char* data, size_t datalen)
+{
+	submit(tp, OP_SET, key, keylen, flags, exptime, data, datalen);
+}
+
+void shadow_remove(const proxy_client::topology& tp,
+		const char* key, size_t keylen, uint32_t exptime)
+{
+	submit(tp, OP_DELETE, key, keylen, 0, exptime, NULL, 0);
+}
+
+
+}  // namespace memtext
+}  // namespace memxy
+
@@ -0,0 +1,64 @@
+//
+// memxy::gate_memtext - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef GATE_MEMTEXT_SHADOW_H__
+#define GATE_MEMTEXT_SHADOW_H__
+
+#include "upstream.h"
+#include "proxy_client.h"
+
+namespace memxy {
+namespace memtext {
+
+
+// A sample of gets, sets and deletes to the primary set is mirrored to
+// the shadow pool of the topology so that the pool is warmed up and
+// measured before it replaces the primary.  The mirrored requests are sent by a worker
+// thread and their responses are only counted.
+
+// returns true if requests of the key are mirrored; shadow_percent of
+// the keys are sampled by their hash, so that all requests of a key are
+// mirrored or none of them
+bool shadow_sampled(const proxy_client::topology& tp,
+		const char* key, size_t keylen);
+
+// mirrors the get; returns the request to send to the primary set
+// instead of req, which measures the primary and forwards to req
+upstream::shared_request shadow_get(const proxy_client::topology& tp,
+		const char* key, size_t keylen,
+		upstream::shared_request req);
+
+// mirrors the get of a key of a multi-get; returns the time to pass to
+// count_primary_get() when the primary set has responded to the key
+uint64_t shadow_get_key(const proxy_client::topology& tp,
+		const char* key, size_t keylen);
+void count_primary_get(uint64_t start, bool hit);
+
+void shadow_set(const proxy_client::topology& tp,
+		const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime,
+		const char* data, size_t datalen);
+
+void shadow_remove(const proxy_client::topology& tp,
+		const char* key, size_t keylen, uint32_t exptime);
+
+
+}  // namespace memtext
+}  // namespace memxy
+
+#endif /* gate_memtext_shadow.h */
+
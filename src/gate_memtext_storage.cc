@@ -17,37 +17,181 @@
 //
 #include "gate_memtext_impl.h"
 #include "gate_memtext_storage.h"
+#include "gate_memtext_migration.h"
+#include "gate_memtext_shadow.h"
+#include "gate_memtext_tier.h"
+#include "replication.h"
+#include "stats.h"
+
+#ifndef MEMTEXT_STORE_STREAM_THRESHOLD
+#define MEMTEXT_STORE_STREAM_THRESHOLD (64*1024)
+#endif
 
 namespace memxy {
 namespace memtext {
 
 
-int request_set(void* user,
-		memtext_command cmd,
-		memtext_request_storage* r)
+static volatile size_t s_store_streaming = MEMTEXT_STORE_STREAM_THRESHOLD;
+
+void set_store_streaming(size_t bytes)
+{
+	s_store_streaming = bytes;
+}
+
+size_t get_store_streaming()
 {
-	int fd = CAST_USER(user);
+	return s_store_streaming;
+}
 
-	memcached_return err;
+static stats::counter s_streamed_sets("streamed_sets");
 
+
+class store_request : public upstream::request {
+public:
+	store_request(handler* h, reply* r) :
+		m_handler(h->shared_self<handler>()),
+		m_reply(r) { }
+
+	void complete(upstream::status st)
 	{
-		proxy_client::ref mc( proxy_client::get() );
-		err = memcached_set(*mc, r->key, r->key_len,
-				r->data, r->data_len, r->exptime, r->flags);
+		if(st != upstream::STATUS_SUCCESS) {
+			commit_error(m_handler.get(), m_reply, st);
+			return;
+		}
+		m_handler->commit_static(m_reply, "STORED\r\n");
 	}
 
-	if(r->noreply) { return 0; }
+	bool cancelled()
+	{
+		return m_handler->is_closed();
+	}
+
+private:
+	shared_handler m_handler;
+	reply* m_reply;
+};
+
 
-	if(err) {
-		send_error(fd, err);
+int request_set(void* user,
+		memtext_command cmd,
+		memtext_request_storage* r)
+{
+	handler* h = CAST_USER(user);
+
+	proxy_client::shared_topology tp( proxy_client::current_topology() );
+
+	proxy_client::server_set* ss = tp->pool_of(r->key, r->key_len);
+
+	upstream::server* owner = ss->route(r->key, r->key_len);
+	upstream::server* sv = owner;
+	if(owner && ss == tp->primary.get()) {
+		sv = tier_set_owner(*tp, owner, r->key, r->key_len);
+	}
+	if(!sv) {
+		if(!r->noreply) {
+			send_error(h, upstream::STATUS_NO_SERVER);
+		}
 		return 0;
 	}
 
-	send_static(fd, "STORED\r\n");
+	if(r->noreply) {
+		sv->set(r->key, r->key_len, r->flags, r->exptime,
+				r->data, r->data_len, upstream::shared_request());
+	} else {
+		reply* rp = h->hold();
+		try {
+			upstream::shared_request req(new store_request(h, rp));
+			sv->set(r->key, r->key_len, r->flags, r->exptime,
+					r->data, r->data_len, req);
+		} catch (...) {
+			commit_error(h, rp, upstream::STATUS_SERVER_ERROR);
+			throw;
+		}
+	}
+
+	// replicas mirror the primary set; the reply doesn't wait for them
+	if(ss == tp->primary.get()) {
+		if(tp->cold_sets_only) {
+			// the old value must not hide the new one in the cold pool
+			replication::remove(*tp, r->key, r->key_len, 0);
+			tier_remove(*tp, owner, r->key, r->key_len, 0);
+			migration_remove(*tp, owner, r->key, r->key_len, 0);
+		} else {
+			replication::set(*tp, r->key, r->key_len, r->flags, r->exptime,
+					r->data, r->data_len);
+			tier_set(*tp, r->key, r->key_len, r->flags, r->exptime,
+					r->data, r->data_len);
+			migration_set(*tp, owner, r->key, r->key_len, r->flags, r->exptime,
+					r->data, r->data_len);
+		}
+		if(shadow_sampled(*tp, r->key, r->key_len)) {
+			shadow_set(*tp, r->key, r->key_len, r->flags, r->exptime,
+					r->data, r->data_len);
+		}
+	}
 
 	return 0;
 }
 
+upstream::shared_value_stream stream_set(handler* h,
+		const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime, size_t bytes, bool noreply)
+{
+	proxy_client::shared_topology tp( proxy_client::current_topology() );
+
+	proxy_client::server_set* ss = tp->pool_of(key, keylen);
+
+	if(ss == tp->primary.get() && (shadow_sampled(*tp, key, keylen) ||
+				(!tp->cold_sets_only &&
+				 (!tp->replica_queues.empty() || tp->cold)))) {
+		// replicas, the cold pool and the shadow pool need the whole
+		// value; replicas only delete the key if sets go to the cold pool
+		return upstream::shared_value_stream();
+	}
+
+	upstream::server* owner = ss->route(key, keylen);
+	upstream::server* sv = owner;
+	if(owner && ss == tp->primary.get()) {
+		sv = tier_set_owner(*tp, owner, key, keylen);
+	}
+	if(!sv) {
+		// request_set replies the error after the value is received
+		return upstream::shared_value_stream();
+	}
+
+	if(ss == tp->primary.get() && !tp->cold_sets_only &&
+			previous_owner(*tp, owner, key, keylen)) {
+		// the previous owner needs the whole value too
+		return upstream::shared_value_stream();
+	}
+
+	if(ss == tp->primary.get() && tp->cold_sets_only) {
+		replication::remove(*tp, key, keylen, 0);
+		tier_remove(*tp, owner, key, keylen, 0);
+		migration_remove(*tp, owner, key, keylen, 0);
+	}
+
+	s_streamed_sets.incr();
+
+	// the handler holds the stream; don't let the stream hold it
+	mp::function<void ()> drained(mp::bind(&handler::resume,
+				mp::weak_ptr<handler>(h->shared_self<handler>())));
+
+	if(noreply) {
+		return sv->set_stream(key, keylen, flags, exptime, bytes,
+				upstream::shared_request(), drained);
+	}
+
+	reply* rp = h->hold();
+	try {
+		upstream::shared_request req(new store_request(h, rp));
+		return sv->set_stream(key, keylen, flags, exptime, bytes, req, drained);
+	} catch (...) {
+		commit_error(h, rp, upstream::STATUS_SERVER_ERROR);
+		throw;
+	}
+}
+
 
 }  // namespace memtext
 }  // namespace memxy
@@ -19,6 +19,8 @@
 #define GATE_MEMTEXT_STORAGE_H__
 
 #include "memproto/memtext.h"
+#include "upstream.h"
+#include <stdint.h>
 
 namespace memxy {
 namespace memtext {
@@ -28,6 +30,18 @@ int request_set(void* user,
 		memtext_command cmd,
 		memtext_request_storage* r);
 
+class handler;
+
+// starts a set which value is forwarded to the server as it arrives;
+// returns NULL if the set should be parsed and buffered as usual
+upstream::shared_value_stream stream_set(handler* h,
+		const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime, size_t bytes, bool noreply);
+
+// values of sets larger than this are streamed; 0 disables it
+void set_store_streaming(size_t bytes);
+size_t get_store_streaming();
+
 
 }  // namespace memtext
 }  // namespace memxy
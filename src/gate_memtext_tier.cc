@@ -0,0 +1,177 @@
+//
+// memxy::gate_memtext - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "gate_memtext_tier.h"
+#include "gate_memtext_lookup.h"
+#include "replication.h"
+#include "stats.h"
+#include <cclog/cclog.h>
+
+// exptime of the values promoted to the primary set; the cold pool
+// doesn't tell the remaining time, so the copy expires after this and
+// is promoted again if it's still read
+#ifndef MEMTEXT_TIER_PROMOTE_EXPTIME
+#define MEMTEXT_TIER_PROMOTE_EXPTIME 600
+#endif
+
+namespace memxy {
+namespace memtext {
+
+
+static stats::counter s_cold_lookups("tier_cold_lookups");
+static stats::counter s_cold_hits("tier_cold_hits");
+static stats::counter s_cold_errors("tier_cold_errors");
+static stats::counter s_promotions("tier_promotions");
+static stats::counter s_promote_failed("tier_promote_failed");
+
+
+void promote(const proxy_client::topology& tp,
+		const char* key, size_t keylen, uint32_t flags,
+		const char* val, size_t vallen)
+{
+	if(!tp.cold_promote) {
+		return;
+	}
+	upstream::server* sv = tp.primary->route(key, keylen);
+	if(!sv) {
+		return;
+	}
+
+	// noreply; the client doesn't wait for it. add doesn't overwrite
+	// a value which a client has set in the meantime
+	try {
+		sv->add(key, keylen, flags, MEMTEXT_TIER_PROMOTE_EXPTIME,
+				val, vallen, upstream::shared_request());
+		replication::add(tp, key, keylen, flags, MEMTEXT_TIER_PROMOTE_EXPTIME,
+				val, vallen);
+		s_promotions.incr();
+	} catch (std::exception& e) {
+		LOG_WARN("tier promotion failed: ",e.what());
+		s_promote_failed.incr();
+	}
+}
+
+void count_cold_lookups(size_t keys)
+{
+	s_cold_lookups.incr(keys);
+}
+
+void count_cold_result(size_t hits, upstream::status st)
+{
+	if(hits > 0) {
+		s_cold_hits.incr(hits);
+	} else if(st != upstream::STATUS_SUCCESS &&
+			st != upstream::STATUS_NOT_FOUND &&
+			st != upstream::STATUS_CANCELLED) {
+		s_cold_errors.incr();
+	}
+}
+
+
+namespace {
+
+// a miss of the primary set is looked up in the cold pool
+class tier_lookup : public secondary_lookup {
+public:
+	tier_lookup(proxy_client::shared_topology tp) :
+		m_topology(tp) { }
+
+	upstream::server* route(const char* key, size_t keylen)
+	{
+		upstream::server* sv = m_topology->cold->route(key, keylen);
+		if(sv) {
+			count_cold_lookups(1);
+		}
+		return sv;
+	}
+
+	bool copies() const { return m_topology->cold_promote; }
+
+	void found(const char* key, size_t keylen, uint32_t flags,
+			const char* val, size_t vallen)
+	{
+		promote(*m_topology, key, keylen, flags, val, vallen);
+	}
+
+	void done(bool hit, upstream::status st)
+	{
+		count_cold_result(hit ? 1 : 0, st);
+	}
+
+private:
+	proxy_client::shared_topology m_topology;
+};
+
+}  // noname namespace
+
+
+upstream::shared_request tiered_get(proxy_client::shared_topology tp,
+		const char* key, size_t keylen,
+		upstream::shared_request req)
+{
+	shared_secondary_lookup sl(new tier_lookup(tp));
+	return lookup_on_miss(sl, key, keylen, req);
+}
+
+upstream::server* tier_set_owner(const proxy_client::topology& tp,
+		upstream::server* owner, const char* key, size_t keylen)
+{
+	if(!tp.cold || !tp.cold_sets_only) {
+		return owner;
+	}
+	return tp.cold->route(key, keylen);
+}
+
+void tier_set(const proxy_client::topology& tp,
+		const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime,
+		const char* data, size_t datalen)
+{
+	if(!tp.cold || tp.cold_sets_only) {
+		return;
+	}
+	upstream::server* sv = tp.cold->route(key, keylen);
+	if(sv) {
+		// noreply; the client doesn't wait for it
+		sv->set(key, keylen, flags, exptime, data, datalen,
+				upstream::shared_request());
+	}
+}
+
+void tier_remove(const proxy_client::topology& tp, upstream::server* owner,
+		const char* key, size_t keylen, uint32_t exptime)
+{
+	if(!tp.cold) {
+		return;
+	}
+
+	// noreply; the client doesn't wait for it
+	if(tp.cold_sets_only) {
+		owner->remove(key, keylen, exptime, upstream::shared_request());
+		return;
+	}
+
+	upstream::server* sv = tp.cold->route(key, keylen);
+	if(sv) {
+		sv->remove(key, keylen, exptime, upstream::shared_request());
+	}
+}
+
+
+}  // namespace memtext
+}  // namespace memxy
+
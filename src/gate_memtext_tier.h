@@ -0,0 +1,72 @@
+//
+// memxy::gate_memtext - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef GATE_MEMTEXT_TIER_H__
+#define GATE_MEMTEXT_TIER_H__
+
+#include "upstream.h"
+#include "proxy_client.h"
+
+namespace memxy {
+namespace memtext {
+
+
+// A miss of the primary set is looked up in the cold pool of the
+// topology before the client is answered.  A value found there is
+// returned at once and, if the topology promotes them, copied to the
+// primary set without waiting for the result.  Sets go to both tiers,
+// or only to the cold pool while the key is deleted from the primary.
+
+// returns the request to send a get of the primary set instead of req;
+// a miss is looked up in the cold pool
+upstream::shared_request tiered_get(proxy_client::shared_topology tp,
+		const char* key, size_t keylen,
+		upstream::shared_request req);
+
+// copies a value found in the cold pool to the primary set and its
+// replicas where the key doesn't exist, unless promotion is disabled
+void promote(const proxy_client::topology& tp,
+		const char* key, size_t keylen, uint32_t flags,
+		const char* val, size_t vallen);
+
+// counts keys looked up in the cold pool, and hits of a lookup which
+// completed with st
+void count_cold_lookups(size_t keys);
+void count_cold_result(size_t hits, upstream::status st);
+
+// returns the server which a set or delete of the key in the primary
+// set is sent to and answered by; owner is its owner in the primary set
+upstream::server* tier_set_owner(const proxy_client::topology& tp,
+		upstream::server* owner, const char* key, size_t keylen);
+
+// mirrors the set to the cold pool unless sets go only to it
+void tier_set(const proxy_client::topology& tp,
+		const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime,
+		const char* data, size_t datalen);
+
+// deletes the key from the tier which the client doesn't wait for: the
+// cold pool, or owner if sets go only to the cold pool
+void tier_remove(const proxy_client::topology& tp, upstream::server* owner,
+		const char* key, size_t keylen, uint32_t exptime);
+
+
+}  // namespace memtext
+}  // namespace memxy
+
+#endif /* gate_memtext_tier.h */
+
@@ -17,12 +17,14 @@
 //
 #include "wavy_core.h"
 #include "proxy_client.h"
+#include "replication.h"
 #include "gate_memtext.h"
 #include "gate_control.h"
 #include <cclog/cclog.h>
 #include <cclog/cclog_tty.h>
 #include <cclog/cclog_ostream.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <getopt.h>
 #include <fstream>
 
@@ -30,6 +32,28 @@ static const char* s_progname;
 static unsigned short s_text_port = 11211;
 static unsigned short s_ctl_port  = 11001;
 static const char* s_init_servers = NULL;
+static size_t s_pipeline_depth = 0;
+static size_t s_pool_size = 0;
+static const char* s_min_ready = NULL;
+static unsigned int s_coalesce_window = 0;
+static size_t s_coalesce_max = 32;
+static bool s_write_coalescing = true;
+static bool s_streaming = true;
+static const char* s_splice_threshold = NULL;
+static const char* s_store_streaming = NULL;
+static bool s_binary = false;
+static const char* s_noreply_queue = NULL;
+static bool s_noreply_drop_oldest = false;
+static const char* s_timeout = NULL;
+static unsigned int s_migration_window = 0;
+static size_t s_max_inflight = 0;
+static size_t s_max_waiting = 0;
+static unsigned int s_eject_failures = 5;
+static unsigned int s_eject_latency = 0;
+static const char* s_hedge_delay = NULL;
+static unsigned int s_hedge_budget = 5;
+static const char* s_replication_queue = NULL;
+static bool s_balance = false;
 
 static const char* s_pidfile = NULL;
 static const char* s_logfile = NULL;
@@ -41,6 +65,36 @@ static void usage(const char* msg)
 	printf("Usage: %s [options]  [initial server list]\n"
 		" -t PORT=11211      : proxy port (text)\n"
 		" -c PORT=11001      : control port\n"
+		" -n NUM=1           : connections to each server\n"
+		" -m NUM=1           : connections to each server required before\n"
+		"                      a new server list is used\n"
+		" -p NUM=64          : upstream pipeline depth\n"
+		" -w USEC=0          : window to coalesce gets into a multi-get\n"
+		" -b NUM=32          : maximum number of keys in a coalesced get\n"
+		" -S                 : write each set and delete to servers without\n"
+		"                      batching it with those of other clients\n"
+		" -k                 : reply multi-get values in the order of keys\n"
+		" -l BYTES=65536     : splice values larger than this (0: disabled)\n"
+		" -s BYTES=65536     : forward values of sets larger than this as they\n"
+		"                      arrive (0: disabled)\n"
+		" -B                 : use binary protocol to talk with servers\n"
+		" -q BYTES=16777216  : noreply writes queued to a server (0: unlimited)\n"
+		" -Q                 : drop the oldest noreply write when the queue is full\n"
+		" -T MSEC=1000       : timeout of upstream requests (0: disabled)\n"
+		" -M MSEC=0          : read misses from the previous server list for this\n"
+		"                      time after the list changes (0: disabled)\n"
+		" -i NUM=0           : requests in flight to each server (0: unlimited)\n"
+		" -I NUM=0           : requests waiting for each server; the rest fail\n"
+		"                      (0: unlimited)\n"
+		" -e NUM=5           : eject a server after consecutive failures (0: never)\n"
+		" -E USEC=0          : eject a server while its 95th percentile response\n"
+		"                      time is over this (0: never)\n"
+		" -H USEC            : send a get to a replica too after this delay\n"
+		"                      (0: 95th percentile response time of the server)\n"
+		" -P PCT=5           : maximum percentage of gets sent to a replica by -H\n"
+		" -R BYTES=16777216  : writes queued to each replica (0: unlimited)\n"
+		" -L                 : send gets to the least loaded of the primary and\n"
+		"                      the replicas\n"
 		" -h                 : print this help message\n"
 		" -o <path.log>      : log file\n"
 		" -d <path.pid>      : daemonize and output pid into the file\n"
@@ -54,7 +108,7 @@ static void parse_argv(int argc, char* argv[])
 {
 	int c;
 	s_progname = argv[0];
-	while((c = getopt(argc, argv, "t:c:o:d:vh")) != -1) {
+	while((c = getopt(argc, argv, "t:c:n:m:p:w:b:Skl:s:Bq:QT:M:i:I:e:E:H:P:R:Lo:d:vh")) != -1) {
 		switch(c) {
 		case 't':
 			s_text_port = atoi(optarg);
@@ -66,6 +120,98 @@ static void parse_argv(int argc, char* argv[])
 			if(s_ctl_port == 0) { usage("-c: invalid port number"); }
 			break;
 
+		case 'n':
+			s_pool_size = atoi(optarg);
+			if(s_pool_size == 0) { usage("-n: invalid number of connections"); }
+			break;
+
+		case 'm':
+			s_min_ready = optarg;
+			break;
+
+		case 'p':
+			s_pipeline_depth = atoi(optarg);
+			if(s_pipeline_depth == 0) { usage("-p: invalid pipeline depth"); }
+			break;
+
+		case 'w':
+			s_coalesce_window = atoi(optarg);
+			break;
+
+		case 'b':
+			s_coalesce_max = atoi(optarg);
+			if(s_coalesce_max == 0) { usage("-b: invalid number of keys"); }
+			break;
+
+		case 'S':
+			s_write_coalescing = false;
+			break;
+
+		case 'k':
+			s_streaming = false;
+			break;
+
+		case 'l':
+			s_splice_threshold = optarg;
+			break;
+
+		case 's':
+			s_store_streaming = optarg;
+			break;
+
+		case 'B':
+			s_binary = true;
+			break;
+
+		case 'q':
+			s_noreply_queue = optarg;
+			break;
+
+		case 'Q':
+			s_noreply_drop_oldest = true;
+			break;
+
+		case 'T':
+			s_timeout = optarg;
+			break;
+
+		case 'M':
+			s_migration_window = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'i':
+			s_max_inflight = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'I':
+			s_max_waiting = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'e':
+			s_eject_failures = atoi(optarg);
+			break;
+
+		case 'E':
+			s_eject_latency = atoi(optarg);
+			break;
+
+		case 'H':
+			s_hedge_delay = optarg;
+			break;
+
+		case 'P':
+			s_hedge_budget = atoi(optarg);
+			if(s_hedge_budget > 100) { usage("-P: invalid percentage"); }
+			break;
+
+		case 'R':
+			s_replication_queue = optarg;
+			break;
+
+		case 'L':
+			s_balance = true;
+			break;
+
 		case 'o':
 			s_logfile = optarg;
 			break;
@@ -123,9 +269,51 @@ int main(int argc, char* argv[])
 	service::init();
 	proxy_client::init();
 
+	if(s_pool_size) {
+		upstream::set_pool_size(s_pool_size);
+	}
+	if(s_min_ready) {
+		proxy_client::set_min_ready(strtoul(s_min_ready, NULL, 10));
+	}
+	proxy_client::set_migration_window(s_migration_window);
+	if(s_pipeline_depth) {
+		upstream::set_pipeline_depth(s_pipeline_depth);
+	}
+	upstream::set_coalesce(s_coalesce_window, s_coalesce_max);
+	upstream::set_write_coalescing(s_write_coalescing);
+	if(s_splice_threshold) {
+		upstream::set_splice_threshold(strtoul(s_splice_threshold, NULL, 10));
+	}
+	if(s_binary) {
+		upstream::set_protocol(upstream::PROTOCOL_BINARY);
+	}
+	if(s_noreply_queue) {
+		upstream::set_noreply_queue_size(strtoul(s_noreply_queue, NULL, 10));
+	}
+	if(s_noreply_drop_oldest) {
+		upstream::set_noreply_overflow(upstream::OVERFLOW_DROP_OLDEST);
+	}
+	if(s_timeout) {
+		upstream::set_timeout(strtoul(s_timeout, NULL, 10));
+	}
+	upstream::set_bulkhead(s_max_inflight, s_max_waiting);
+	upstream::set_ejection(s_eject_failures, s_eject_latency);
+	if(s_replication_queue) {
+		replication::set_queue_size(strtoul(s_replication_queue, NULL, 10));
+	}
+
 	gate_memtext memtext;
 	gate_control control;
 
+	gate_memtext::set_streaming(s_streaming);
+	if(s_store_streaming) {
+		gate_memtext::set_store_streaming(strtoul(s_store_streaming, NULL, 10));
+	}
+	if(s_hedge_delay) {
+		gate_memtext::set_hedge(strtoul(s_hedge_delay, NULL, 10), s_hedge_budget);
+	}
+	gate_memtext::set_balance(s_balance);
+
 	{
 		struct sockaddr_in addr;
 		memset(&addr, 0, sizeof(addr));
@@ -235,6 +235,10 @@ int memproto_dispatch(memproto_parser* ctx)
 					key, keylen,
 					val, vallen);
 		return 1;
+
+	default:
+		/* quiet commands are only sent by the proxy */
+		break;
 	}
 
 	return -cmd;
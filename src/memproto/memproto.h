@@ -61,6 +61,16 @@ typedef enum {
 	MEMPROTO_CMD_GETKQ               = 0x0d,
 	MEMPROTO_CMD_APPEND              = 0x0e,
 	MEMPROTO_CMD_PREPEND             = 0x0f,
+	MEMPROTO_CMD_SETQ                = 0x11,
+	MEMPROTO_CMD_ADDQ                = 0x12,
+	MEMPROTO_CMD_REPLACEQ            = 0x13,
+	MEMPROTO_CMD_DELETEQ             = 0x14,
+	MEMPROTO_CMD_INCREMENTQ          = 0x15,
+	MEMPROTO_CMD_DECREMENTQ          = 0x16,
+	MEMPROTO_CMD_QUITQ               = 0x17,
+	MEMPROTO_CMD_FLUSHQ              = 0x18,
+	MEMPROTO_CMD_APPENDQ             = 0x19,
+	MEMPROTO_CMD_PREPENDQ            = 0x1a,
 } memproto_command;
 
 
@@ -42,6 +42,9 @@ namespace wavy {
 class basic_handler;
 class handler;
 
+class deadline;
+typedef shared_ptr<deadline> shared_deadline;
+
 
 class core {
 public:
@@ -122,6 +125,10 @@ MP_ARGS_BEGIN
 	void submit(F f, MP_ARGS_PARAMS);
 MP_ARGS_END
 
+	// calls the callback of a handler held by basic_handler::hold_events()
+	// again and then reactivates its events
+	void resume_handler(shared_ptr<basic_handler> sh);
+
 
 	typedef function<void (int fd, int err)> connect_callback_t;
 
@@ -150,6 +157,15 @@ MP_ARGS_END
 	void timer_event(const timespec* value, const timespec* interval,
 			timer_callback_t callback);
 
+	// one-shot timer on the timer wheel of the core; starting and
+	// cancelling it cost O(1) regardless of the number of the timers.
+	// the resolution is MP_WAVY_WHEEL_TICK milliseconds
+	shared_deadline deadline_event(unsigned int msec,
+			timer_callback_t callback);
+
+	// returns false if the callback is already called or being called
+	bool cancel_deadline(const shared_deadline& dl);
+
 
 	typedef function<bool (int signo)> signal_callback_t;
 
@@ -180,10 +196,12 @@ public:
 
 	template <typename IMPL>
 	basic_handler(int ident, IMPL* self) :
-		m_ident(ident), m_callback(&static_callback<IMPL>) { }
+		m_ident(ident), m_callback(&static_callback<IMPL>),
+		m_hold(HOLD_NONE) { }
 
 	basic_handler(int ident, callback_t callback) :
-		m_ident(ident), m_callback(callback) { }
+		m_ident(ident), m_callback(callback),
+		m_hold(HOLD_NONE) { }
 
 	virtual ~basic_handler() { }
 
@@ -191,11 +209,33 @@ public:
 
 	bool operator() (const port_event* e);
 
+	// called in the callback; the events of the handler are not
+	// reactivated when the callback returns until core::resume_handler()
+	// is called. the callback is called with NULL event when resumed
+	void hold_events();
+
+	enum hold_state {
+		HOLD_NONE,
+		HOLD_REQUESTED,
+		HOLD_ACTIVE,
+		HOLD_RESUMED
+	};
+
+	// used by the core after the callback returned true. returns
+	// HOLD_NONE to reactivate the events, HOLD_ACTIVE to keep them
+	// inactive or HOLD_RESUMED to call the callback again
+	hold_state settle_hold();
+
+	// used by the core; returns true if the callback must be called again
+	bool resume_hold();
+
 private:
 	int m_ident;
 
 	callback_t m_callback;
 
+	volatile int m_hold;
+
 private:
 	template <typename IMPL>
 	static bool static_callback(basic_handler* self, const port_event* e)
@@ -250,6 +290,48 @@ inline bool basic_handler::operator() (const port_event* e)
 	}
 }
 
+inline void basic_handler::hold_events()
+{
+	// a resume before the hold is kept
+	__sync_bool_compare_and_swap(&m_hold, HOLD_NONE, HOLD_REQUESTED);
+}
+
+inline basic_handler::hold_state basic_handler::settle_hold()
+{
+	while(true) {
+		switch(m_hold) {
+		case HOLD_NONE:
+			return HOLD_NONE;
+		case HOLD_REQUESTED:
+			if(__sync_bool_compare_and_swap(&m_hold, HOLD_REQUESTED, HOLD_ACTIVE)) {
+				return HOLD_ACTIVE;
+			}
+			break;
+		default:  // HOLD_RESUMED
+			if(__sync_bool_compare_and_swap(&m_hold, HOLD_RESUMED, HOLD_NONE)) {
+				return HOLD_RESUMED;
+			}
+			break;
+		}
+	}
+}
+
+inline bool basic_handler::resume_hold()
+{
+	while(true) {
+		int st = m_hold;
+		if(st == HOLD_RESUMED) {
+			return false;
+		} else if(st == HOLD_ACTIVE) {
+			if(__sync_bool_compare_and_swap(&m_hold, HOLD_ACTIVE, HOLD_NONE)) {
+				return true;
+			}
+		} else if(__sync_bool_compare_and_swap(&m_hold, st, HOLD_RESUMED)) {
+			return false;
+		}
+	}
+}
+
 
 struct core::xfer {
 public:
@@ -264,6 +346,9 @@ public:
 
 	void push_sendfile(int infd, uint64_t off, size_t len);
 
+	// moves len bytes from the pipe infd; the pipe must hold them
+	void push_splice(int infd, size_t len);
+
 	void push_finalize(finalize_t fin, void* user);
 
 	template <typename T>
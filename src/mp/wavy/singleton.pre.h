@@ -30,6 +30,7 @@ struct singleton {
 
 	typedef wavy::basic_handler basic_handler;
 	typedef wavy::handler handler;
+	typedef wavy::shared_deadline shared_deadline;
 
 	static void init();
 
@@ -107,6 +108,8 @@ MP_ARGS_BEGIN
 	static void submit(F f, MP_ARGS_PARAMS);
 MP_ARGS_END
 
+	static void resume_handler(shared_ptr<basic_handler> sh);
+
 
 	typedef core::connect_callback_t connect_callback_t;
 
@@ -135,6 +138,11 @@ MP_ARGS_END
 	static void timer_event(const timespec* value, const timespec* interval,
 			timer_callback_t callback);
 
+	static shared_deadline deadline_event(unsigned int msec,
+			timer_callback_t callback);
+
+	static bool cancel_deadline(const shared_deadline& dl);
+
 
 	typedef core::signal_callback_t signal_callback_t;
 
@@ -277,6 +285,10 @@ inline void singleton<Instance>::submit(F f, MP_ARGS_PARAMS)
 	{ s_core->submit<F, MP_ARGS_TYPES>(f, MP_ARGS_FUNC); }
 MP_ARGS_END
 
+template <typename Instance>
+inline void singleton<Instance>::resume_handler(shared_ptr<basic_handler> sh)
+	{ s_core->resume_handler(sh); }
+
 
 template <typename Instance>
 inline void singleton<Instance>::connect_thread(
@@ -317,6 +329,15 @@ inline void singleton<Instance>::timer_event(
 		timer_callback_t callback)
 	{ s_core->timer_event(value, interval, callback); }
 
+template <typename Instance>
+inline shared_deadline singleton<Instance>::deadline_event(
+		unsigned int msec, timer_callback_t callback)
+	{ return s_core->deadline_event(msec, callback); }
+
+template <typename Instance>
+inline bool singleton<Instance>::cancel_deadline(const shared_deadline& dl)
+	{ return s_core->cancel_deadline(dl); }
+
 
 template <typename Instance>
 inline void singleton<Instance>::signal_thread(
@@ -38,6 +38,7 @@ coreimpl::coreimpl() :
 	m_off(0),
 	m_num(0),
 	m_pollable(true),
+	m_wheel(NULL),
 	m_end_flag(false)
 {
 	struct rlimit rbuf;
@@ -204,6 +205,52 @@ void coreimpl::submit_impl(task_t& f)
 }
 
 
+void coreimpl::resume_handler(shared_handler sh)
+{
+	if(sh->resume_hold()) {
+		task_t f(bind(&coreimpl::resume_event, this, sh));
+		submit_impl(f);
+	}
+}
+
+bool coreimpl::settle_hold(const shared_handler& sh)
+{
+	switch(sh->settle_hold()) {
+	case basic_handler::HOLD_NONE:
+		return true;
+	case basic_handler::HOLD_RESUMED: {
+			task_t f(bind(&coreimpl::resume_event, this, sh));
+			submit_impl(f);
+		}
+		return false;
+	default:
+		return false;
+	}
+}
+
+void coreimpl::resume_event(shared_handler sh)
+{
+	int ident = sh->ident();
+
+	bool cont;
+	try {
+		cont = (*sh)(NULL);
+	} catch (...) {
+		cont = false;
+	}
+
+	if(!cont) {
+		m_port.remove_fd(ident, EVPORT_READ);
+		reset_handler(ident);
+		return;
+	}
+
+	if(settle_hold(sh)) {
+		m_port.reactivate_fd(ident, EVPORT_READ);
+	}
+}
+
+
 shared_ptr<basic_handler> coreimpl::add_handler_impl(shared_ptr<basic_handler> sh)
 {
 	int fd = sh->ident();
@@ -319,7 +366,9 @@ void coreimpl::operator() ()
 				goto retry;
 			}
 
-			m_port.shot_reactivate(e);
+			if(settle_hold(m_state[ident])) {
+				m_port.shot_reactivate(e);
+			}
 		}
 
 	}  // while(true)
@@ -393,7 +442,9 @@ void coreimpl::step_next()
 			return;
 		}
 
-		m_port.shot_reactivate(e);
+		if(settle_hold(m_state[ident])) {
+			m_port.shot_reactivate(e);
+		}
 	}
 }
 
@@ -429,6 +480,9 @@ void core::submit_impl(task_t f)
 core::shared_handler core::add_handler_impl(shared_handler newh)
 	{ return ANON_impl->add_handler_impl(newh); }
 
+void core::resume_handler(shared_ptr<basic_handler> sh)
+	{ ANON_impl->resume_handler(sh); }
+
 void core::step_next()
 	{ ANON_impl->step_next(); }
 
@@ -137,38 +137,41 @@ public:
 		basic_handler(ident, this),
 		m_done(false), m_callback(callback) { }
 
-	bool operator() (const port_event* e)
+	~connect_handler()
 	{
-		int fd = ident();
+		// the descriptor is closed after it is removed from the port
+		::close(ident());
+	}
 
+	bool operator() (const port_event* e)
+	{
 		if(!__sync_bool_compare_and_swap(&m_done, false, true)) {
-			::close(fd);
 			return false;
 		}
 
+		int fd = -1;
 		int err = 0;
 
 		int value = 0;
 		int len = sizeof(value);
 
-		if(::getsockopt(fd, SOL_SOCKET, SO_ERROR,
+		if(::getsockopt(ident(), SOL_SOCKET, SO_ERROR,
 				&value, (socklen_t*)&len) < 0) {
-			goto errno_error;
+			err = errno;
+			goto out;
 		}
 
 		if(value != 0) {
 			err = value;
-			goto specific_error;
+			goto out;
 		}
 
-		goto out;
-
-	errno_error:
-		err = errno;
-
-	specific_error:
-		::close(fd);
-		fd = -1;
+		// pass a duplicated descriptor so that the callback can
+		// register it while this handler is still registered.
+		fd = ::dup(ident());
+		if(fd < 0) {
+			err = errno;
+		}
 
 	out:
 		m_callback(fd, err);
@@ -194,6 +197,11 @@ public:
 	connect_timeout_handler(int ident, shared_ptr<connect_handler> sh) :
 		basic_handler(ident, this), m_sh(sh) { }
 
+	~connect_timeout_handler()
+	{
+		::close(ident());
+	}
+
 	bool operator() (const port_event* e)
 	{
 		m_sh->timeout();
@@ -233,6 +241,10 @@ void core::connect_event(
 		goto out;
 	}
 
+	if(::fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+		goto errno_error;
+	}
+
 	if(::connect(fd, addr, addrlen) >= 0) {
 		// connect success
 		goto out;
@@ -242,12 +254,22 @@ void core::connect_event(
 		goto errno_error;
 	}
 
+	// connect completion is notified as writability
 	try {
-		sh = add_handler<connect_handler>(fd, callback);
+		sh.reset(new connect_handler(fd, callback));
+		ANON_impl->set_handler(sh);
 	} catch (...) {
 		goto errno_error;
 	}
 
+	if(ANON_impl->port_set().add_fd(fd, EVPORT_WRITE) < 0) {
+		// the handler owns the descriptor
+		err = errno;
+		ANON_impl->reset_handler(fd);
+		fd = -1;
+		goto out;
+	}
+
 	// timeout
 	try {
 		struct timespec spec;
@@ -31,6 +31,7 @@ struct port_event : port::event { };
 
 
 class out;
+class timer_wheel;
 
 namespace {
 
@@ -76,6 +77,15 @@ public:
 
 	void submit_impl(task_t& f);
 
+	void resume_handler(shared_handler sh);
+
+	// returns true if the events of the handler must be reactivated
+	inline bool settle_hold(const shared_handler& sh);
+	void resume_event(shared_handler sh);
+
+	// starts the timer wheel on the first call
+	timer_wheel* wheel(core* c);
+
 
 	//class connect_thread;
 
@@ -111,6 +121,11 @@ private:
 	shared_ptr<out> m_out;
 	friend class wavy::core;
 
+private:
+	timer_wheel* volatile m_wheel;
+	shared_ptr<timer_wheel> m_wheel_owner;
+	pthread_mutex m_wheel_mutex;
+
 private:
 	typedef std::vector<pthread_thread*> workers_t;
 	workers_t m_workers;
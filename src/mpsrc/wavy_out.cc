@@ -48,11 +48,13 @@ public:
 	static size_t sizeof_mem();
 	static size_t sizeof_iovec(size_t veclen);
 	static size_t sizeof_sendfile();
+	static size_t sizeof_splice();
 	static size_t sizeof_finalize();
 
 	static char* fill_mem(char* from, const void* buf, size_t size);
 	static char* fill_iovec(char* from, const struct iovec* vec, size_t veclen);
 	static char* fill_sendfile(char* from, int infd, uint64_t off, size_t len);
+	static char* fill_splice(char* from, int infd, size_t len);
 	static char* fill_finalize(char* from, finalize_t fin, void* user);
 
 	static bool execute(int fd, char* head, char** tail);
@@ -94,7 +96,7 @@ typedef unsigned int xfer_type;
 static const xfer_type XF_IOVEC    = 0;
 static const xfer_type XF_SENDFILE = 1;
 static const xfer_type XF_FINALIZE = 3;
-//static const xfer_type             = 5;
+static const xfer_type XF_SPLICE   = 5;
 //static const xfer_type             = 7;
 
 struct xfer_sendfile {
@@ -103,6 +105,11 @@ struct xfer_sendfile {
 	size_t len;
 };
 
+struct xfer_splice {
+	int infd;
+	size_t len;
+};
+
 struct xfer_finalize {
 	void (*finalize)(void*);
 	void* user;
@@ -124,6 +131,11 @@ inline size_t xferimpl::sizeof_sendfile()
 	return sizeof(xfer_type) + sizeof(xfer_sendfile);
 }
 
+inline size_t xferimpl::sizeof_splice()
+{
+	return sizeof(xfer_type) + sizeof(xfer_splice);
+}
+
 inline size_t xferimpl::sizeof_finalize()
 {
 	return sizeof(xfer_type) + sizeof(xfer_finalize);
@@ -166,6 +178,18 @@ inline char* xferimpl::fill_sendfile(char* from, int infd, uint64_t off, size_t
 	return from;
 }
 
+inline char* xferimpl::fill_splice(char* from, int infd, size_t len)
+{
+	*(xfer_type*)from = XF_SPLICE;
+	from += sizeof(xfer_type);
+
+	((xfer_splice*)from)->infd = infd;
+	((xfer_splice*)from)->len = len;
+	from += sizeof(xfer_splice);
+
+	return from;
+}
+
 inline char* xferimpl::fill_finalize(char* from, finalize_t fin, void* user)
 {
 	*(xfer_type*)from = XF_FINALIZE;
@@ -230,6 +254,14 @@ void core::xfer::push_sendfile(int infd, uint64_t off, size_t len)
 	m_free -= sz;
 }
 
+void core::xfer::push_splice(int infd, size_t len)
+{
+	size_t sz = xferimpl::sizeof_splice();
+	if(m_free < sz) { reserve(sz); }
+	m_tail = xferimpl::fill_splice(m_tail, infd, len);
+	m_free -= sz;
+}
+
 void core::xfer::push_finalize(finalize_t fin, void* user)
 {
 	size_t sz = xferimpl::sizeof_finalize();
@@ -269,6 +301,10 @@ void core::xfer::reset()
 			p += xferimpl::sizeof_sendfile();
 			break;
 
+		case XF_SPLICE:
+			p += xferimpl::sizeof_splice();
+			break;
+
 		case XF_FINALIZE: {
 			xfer_finalize* x = (xfer_finalize*)(p + sizeof(xfer_type));
 			if(x->finalize) try {
@@ -342,6 +378,34 @@ bool xferimpl::execute(int fd, char* head, char** tail)
 			p += sizeof_sendfile();
 			break; }
 
+		case XF_SPLICE: {
+			xfer_splice* x = (xfer_splice*)(p + sizeof(xfer_type));
+#ifdef __linux__
+			ssize_t wl = ::splice(x->infd, NULL, fd, NULL, x->len,
+					SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+			if(wl <= 0) {
+				MP_WAVY_XFER_CONSUMED;
+				if(wl < 0 && (errno == EAGAIN || errno == EINTR)) {
+					return true;
+				} else {
+					return false;
+				}
+			}
+
+			if(static_cast<size_t>(wl) < x->len) {
+				x->len -= wl;
+				MP_WAVY_XFER_CONSUMED;
+				return true;
+			}
+#else
+			// not supported
+			MP_WAVY_XFER_CONSUMED;
+			return false;
+#endif
+
+			p += sizeof_splice();
+			break; }
+
 		case XF_FINALIZE: {
 			xfer_finalize* x = (xfer_finalize*)(p + sizeof(xfer_type));
 			if(x->finalize) try {
@@ -150,6 +150,12 @@ public:
 		return exp & 0x7fffffff;
 	}
 
+	// releases the timerfd returned by create_timer()
+	static int close_timer(int ident)
+	{
+		return ::close(ident);
+	}
+
 
 	struct signal {
 	public:
@@ -226,6 +232,16 @@ public:
 		return epoll_ctl(m_ep, EPOLL_CTL_DEL, e.ident(), NULL);
 	}
 
+	// reactivates a fd added by add_fd() without its event
+	int reactivate_fd(int fd, short events)
+	{
+		struct epoll_event ev;
+		::memset(&ev, 0, sizeof(ev));  // FIXME valgrind
+		ev.events = events | EPOLLONESHOT;
+		ev.data.u64 = ((uint64_t)fd) | ((uint64_t)ev.events << 32);
+		return epoll_ctl(m_ep, EPOLL_CTL_MOD, fd, &ev);
+	}
+
 
 	int remove_fd(int fd, short events)
 	{
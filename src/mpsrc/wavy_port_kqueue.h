@@ -139,6 +139,13 @@ public:
 		return e.kev.data;
 	}
 
+	// the ident is an index into m_xvec, not a fd; shot_remove()
+	// releases it
+	static int close_timer(int ident)
+	{
+		return 0;
+	}
+
 
 	struct signal {
 	public:
@@ -234,6 +241,12 @@ public:
 		}
 	}
 
+	// reactivates a fd added by add_fd() without its event
+	int reactivate_fd(int fd, short events)
+	{
+		return add_fd(fd, events);
+	}
+
 
 	int remove_fd(int fd, short events)
 	{
@@ -61,6 +61,11 @@ public:
 		basic_handler(ident, this),
 		m_periodic(periodic), m_callback(callback) { }
 
+	~timer_handler()
+	{
+		port::close_timer(ident());
+	}
+
 	bool operator() (const port_event* e)
 	{
 		port::get_timer(*e);
@@ -99,7 +104,7 @@ void core::timer_event(const timespec* value, const timespec* interval,
 	}
 
 	shared_handler sh;
-	if(interval && interval->tv_sec == 0 && interval->tv_nsec == 0) {
+	if(interval && (interval->tv_sec != 0 || interval->tv_nsec != 0)) {
 		sh = shared_handler(new timer_handler(ident, callback, true));
 	} else {
 		sh = shared_handler(new timer_handler(ident, callback, false));
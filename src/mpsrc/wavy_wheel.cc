@@ -0,0 +1,255 @@
+//
+// mp::wavy::wheel
+//
+// Copyright (C) 2008-2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+
+#include "wavy_core.h"
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+#ifndef MP_WAVY_WHEEL_TICK
+#define MP_WAVY_WHEEL_TICK 1  // msec
+#endif
+
+// 4 levels of 256 slots cover 2^32 ticks
+#define MP_WAVY_WHEEL_BITS   8
+#define MP_WAVY_WHEEL_SLOTS  (1 << MP_WAVY_WHEEL_BITS)
+#define MP_WAVY_WHEEL_MASK   (MP_WAVY_WHEEL_SLOTS - 1)
+#define MP_WAVY_WHEEL_LEVELS 4
+
+namespace mp {
+namespace wavy {
+
+
+struct deadline_link {
+	deadline_link() : prev(this), next(this) { }
+	deadline_link* prev;
+	deadline_link* next;
+};
+
+class deadline : public deadline_link {
+public:
+	deadline(core::timer_callback_t callback) :
+		expire(0), callback(callback)
+	{
+		prev = next = NULL;
+	}
+
+	bool linked() const { return next != NULL; }
+
+	uint64_t expire;  // in ticks
+	core::timer_callback_t callback;
+
+	// keeps the deadline while it's in the wheel
+	shared_deadline self;
+
+private:
+	deadline();
+	deadline(const deadline&);
+};
+
+
+// Hierarchical timing wheel. A deadline is put into the slot of the
+// lowest level which covers its distance from the current tick; slots
+// of the upper levels are moved down when the lower level wraps around.
+class timer_wheel {
+public:
+	timer_wheel();
+
+	shared_deadline add(unsigned int msec, core::timer_callback_t callback);
+
+	bool cancel(const shared_deadline& dl);
+
+	// called every MP_WAVY_WHEEL_TICK milliseconds
+	void tick();
+
+private:
+	static uint64_t now();
+
+	void insert(deadline* dl);
+	void cascade(size_t level);
+
+	static void unlink(deadline_link* l)
+	{
+		l->prev->next = l->next;
+		l->next->prev = l->prev;
+		l->prev = l->next = NULL;
+	}
+
+private:
+	pthread_mutex m_mutex;
+	uint64_t m_now;
+	deadline_link m_slots[MP_WAVY_WHEEL_LEVELS][MP_WAVY_WHEEL_SLOTS];
+
+private:
+	timer_wheel(const timer_wheel&);
+};
+
+
+timer_wheel::timer_wheel() : m_now(now()) { }
+
+uint64_t timer_wheel::now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / MP_WAVY_WHEEL_TICK;
+}
+
+shared_deadline timer_wheel::add(unsigned int msec,
+		core::timer_callback_t callback)
+{
+	shared_deadline dl(new deadline(callback));
+
+	uint64_t ticks = (msec + MP_WAVY_WHEEL_TICK - 1) / MP_WAVY_WHEEL_TICK;
+	if(ticks == 0) { ticks = 1; }
+
+	pthread_scoped_lock lk(m_mutex);
+	// expires after ticks passed even if tick() is running behind
+	dl->expire = std::max(now(), m_now) + ticks;
+	dl->self = dl;
+	insert(dl.get());
+	return dl;
+}
+
+bool timer_wheel::cancel(const shared_deadline& dl)
+{
+	shared_deadline self;  // released after unlocking m_mutex
+	pthread_scoped_lock lk(m_mutex);
+	if(!dl->linked()) {
+		return false;
+	}
+	unlink(dl.get());
+	self.swap(dl->self);
+	return true;
+}
+
+// m_mutex must be locked
+void timer_wheel::insert(deadline* dl)
+{
+	const uint64_t max = ((uint64_t)1 << (MP_WAVY_WHEEL_BITS*MP_WAVY_WHEEL_LEVELS)) - 1;
+	if(dl->expire - m_now > max) {
+		dl->expire = m_now + max;
+	}
+	const uint64_t delta = dl->expire - m_now;
+
+	size_t level = 0;
+	while(level+1 < MP_WAVY_WHEEL_LEVELS &&
+			delta >> (MP_WAVY_WHEEL_BITS*(level+1)) != 0) {
+		++level;
+	}
+
+	deadline_link& head(m_slots[level]
+			[(dl->expire >> (MP_WAVY_WHEEL_BITS*level)) & MP_WAVY_WHEEL_MASK]);
+	dl->prev = head.prev;
+	dl->next = &head;
+	head.prev->next = dl;
+	head.prev = dl;
+}
+
+// moves the deadlines in the current slot of the level to lower levels;
+// m_mutex must be locked
+void timer_wheel::cascade(size_t level)
+{
+	const size_t slot = (m_now >> (MP_WAVY_WHEEL_BITS*level)) & MP_WAVY_WHEEL_MASK;
+	if(slot == 0 && level+1 < MP_WAVY_WHEEL_LEVELS) {
+		cascade(level+1);
+	}
+
+	deadline_link& head(m_slots[level][slot]);
+	while(head.next != &head) {
+		deadline* dl = static_cast<deadline*>(head.next);
+		unlink(dl);
+		insert(dl);
+	}
+}
+
+void timer_wheel::tick()
+{
+	std::vector<shared_deadline> expired;
+	{
+		pthread_scoped_lock lk(m_mutex);
+		const uint64_t target = now();
+		while(m_now < target) {
+			++m_now;
+			if((m_now & MP_WAVY_WHEEL_MASK) == 0) {
+				cascade(1);
+			}
+
+			deadline_link& head(m_slots[0][m_now & MP_WAVY_WHEEL_MASK]);
+			while(head.next != &head) {
+				deadline* dl = static_cast<deadline*>(head.next);
+				unlink(dl);
+				expired.push_back(shared_deadline());
+				expired.back().swap(dl->self);
+			}
+		}
+	}
+
+	for(std::vector<shared_deadline>::iterator it(expired.begin()),
+			it_end(expired.end()); it != it_end; ++it) {
+		try {
+			(*it)->callback();
+		} catch (...) { }
+	}
+}
+
+
+namespace {
+
+timer_wheel* coreimpl::wheel(core* c)
+{
+	if(m_wheel) {
+		return m_wheel;
+	}
+
+	pthread_scoped_lock lk(m_wheel_mutex);
+	if(!m_wheel) {
+		shared_ptr<timer_wheel> w(new timer_wheel());
+
+		struct timespec interval;
+		interval.tv_sec  = MP_WAVY_WHEEL_TICK / 1000;
+		interval.tv_nsec = MP_WAVY_WHEEL_TICK % 1000 * 1000000;
+		c->timer_event(&interval, &interval, bind(&timer_wheel::tick, w));
+
+		m_wheel_owner = w;
+		__sync_synchronize();
+		m_wheel = w.get();
+	}
+	return m_wheel;
+}
+
+}  // noname namespace
+
+
+shared_deadline core::deadline_event(unsigned int msec,
+		timer_callback_t callback)
+{
+	return ANON_impl->wheel(this)->add(msec, callback);
+}
+
+bool core::cancel_deadline(const shared_deadline& dl)
+{
+	if(!dl) {
+		return false;
+	}
+	return ANON_impl->wheel(this)->cancel(dl);
+}
+
+
+}  // namespace wavy
+}  // namespace mp
+
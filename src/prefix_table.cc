@@ -0,0 +1,109 @@
+//
+// memxy::prefix_table - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "prefix_table.h"
+#include <algorithm>
+#include <map>
+
+namespace memxy {
+
+
+prefix_table::prefix_table() :
+	m_nodes(1), m_labels(1)
+{
+	m_nodes[0].child = 0;
+	m_nodes[0].num = 0;
+	m_nodes[0].value = -1;
+}
+
+prefix_table::~prefix_table() { }
+
+void prefix_table::add(const std::string& prefix, int value)
+{
+	m_entries.push_back(std::make_pair(prefix, value));
+}
+
+void prefix_table::build()
+{
+	std::map<std::string, int> unique;
+	for(entries_t::const_iterator it(m_entries.begin()), it_end(m_entries.end());
+			it != it_end; ++it) {
+		unique[it->first] = it->second;
+	}
+	const entries_t sorted(unique.begin(), unique.end());
+
+	m_nodes.resize(1);
+	m_labels.resize(1);
+	build_node(0, 0, sorted.begin(), sorted.end());
+}
+
+// [begin, end) are sorted prefixes which start with the path to node n
+void prefix_table::build_node(size_t n, size_t depth,
+		entries_t::const_iterator begin, entries_t::const_iterator end)
+{
+	m_nodes[n].value = -1;
+	if(begin != end && begin->first.size() == depth) {
+		m_nodes[n].value = begin->second;
+		++begin;
+	}
+
+	// children are allocated together before any of them is built
+	const size_t first = m_nodes.size();
+	size_t num = 0;
+	for(entries_t::const_iterator it(begin); it != end; ++it) {
+		if(it == begin || (unsigned char)it->first[depth] != m_labels.back()) {
+			m_nodes.push_back(node());
+			m_labels.push_back((unsigned char)it->first[depth]);
+			++num;
+		}
+	}
+	m_nodes[n].child = first;
+	m_nodes[n].num = num;
+
+	entries_t::const_iterator gb(begin);
+	for(size_t i=0; i < num; ++i) {
+		entries_t::const_iterator ge(gb);
+		while(ge != end && (unsigned char)ge->first[depth] == m_labels[first+i]) {
+			++ge;
+		}
+		build_node(first + i, depth + 1, gb, ge);
+		gb = ge;
+	}
+}
+
+int prefix_table::find(const char* key, size_t keylen) const
+{
+	const node* n = &m_nodes[0];
+	int value = n->value;
+	for(size_t i=0; i < keylen && n->num != 0; ++i) {
+		const unsigned char* lb = &m_labels[n->child];
+		const unsigned char* le = lb + n->num;
+		const unsigned char* p = std::lower_bound(lb, le, (unsigned char)key[i]);
+		if(p == le || *p != (unsigned char)key[i]) {
+			break;
+		}
+		n = &m_nodes[n->child + (p - lb)];
+		if(n->value >= 0) {
+			value = n->value;
+		}
+	}
+	return value;
+}
+
+
+}  // namespace memxy
+
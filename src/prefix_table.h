@@ -0,0 +1,70 @@
+//
+// memxy::prefix_table - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef MEMXY_PREFIX_TABLE_H__
+#define MEMXY_PREFIX_TABLE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace memxy {
+
+
+// Maps the longest matching prefix of a key to a value.  The prefixes
+// are built into a trie whose nodes are stored in one array; children of
+// a node are contiguous and sorted by their label, so a lookup walks the
+// key once without allocation.
+class prefix_table {
+public:
+	prefix_table();
+	~prefix_table();
+
+	// the value of a prefix added twice is the last one
+	void add(const std::string& prefix, int value);
+
+	// must be called after all prefixes are added
+	void build();
+
+	// returns the value of the longest prefix of the key, or -1
+	int find(const char* key, size_t keylen) const;
+
+private:
+	struct node {
+		uint32_t child;  // index of the first child
+		uint32_t num;    // number of children
+		int value;       // -1 if no prefix ends here
+	};
+
+	typedef std::vector<std::pair<std::string, int> > entries_t;
+
+	void build_node(size_t n, size_t depth,
+			entries_t::const_iterator begin, entries_t::const_iterator end);
+
+	entries_t m_entries;
+
+	std::vector<node> m_nodes;  // [0] is the root
+	std::vector<unsigned char> m_labels;  // label of the edge to m_nodes[i]
+};
+
+
+}  // namespace memxy
+
+#endif /* prefix_table.h */
+
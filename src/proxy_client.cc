@@ -16,14 +16,149 @@
 //    limitations under the License.
 //
 #include "proxy_client.h"
+#include "replication.h"
+#include "wavy_core.h"
+#include "stats.h"
+#include <cclog/cclog.h>
 #include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <netdb.h>
+#include <stdexcept>
+#include <string>
+
+#ifndef PROXY_CLIENT_DEFAULT_PORT
+#define PROXY_CLIENT_DEFAULT_PORT "11211"
+#endif
+
+// a migration window ends when less than this percentage of the
+// fallbacks in a sample hit
+#ifndef PROXY_CLIENT_MIGRATION_MIN_HIT_PERCENT
+#define PROXY_CLIENT_MIGRATION_MIN_HIT_PERCENT 1
+#endif
+
+#ifndef PROXY_CLIENT_MIGRATION_SAMPLE
+#define PROXY_CLIENT_MIGRATION_SAMPLE 1000
+#endif
 
 namespace memxy {
 namespace proxy_client {
 
 
+server_set::server_set() { }
+
+server_set::~server_set()
+{
+	for(std::vector<upstream::shared_server>::iterator it(m_servers.begin()),
+			it_end(m_servers.end()); it != it_end; ++it) {
+		(*it)->retire();
+	}
+}
+
+void server_set::push_back(upstream::shared_server sv,
+		const std::string& name, unsigned int weight)
+{
+	m_servers.push_back(sv);
+	m_dist.add(name, weight);
+}
+
+void server_set::build()
+{
+	m_dist.build();
+}
+
+static bool is_available(void* user, size_t index)
+{
+	server_set* ss = static_cast<server_set*>(user);
+	return ss->at(index)->is_available();
+}
+
+upstream::server* server_set::route(const char* key, size_t keylen) const
+{
+	if(m_servers.empty()) {
+		return NULL;
+	}
+	upstream::server* sv = m_servers[m_dist.find(key, keylen)].get();
+	if(sv->is_available()) {
+		return sv;
+	}
+	// fail over while the server is ejected
+	return m_servers[m_dist.find_available(key, keylen,
+			&is_available, const_cast<server_set*>(this))].get();
+}
+
+
+namespace {
+
+struct address {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	std::string name;  // host:port
+	unsigned int weight;
+};
+
+typedef std::vector<address> address_list;
+
+// host[:port[:weight]] separated by ',' or ' '
+void parse_server_list(const char* server_list, address_list* result)
+{
+	const char* p = server_list;
+	while(true) {
+		p += strspn(p, ", ");
+		if(*p == '\0') { break; }
+
+		size_t len = strcspn(p, ", ");
+		std::string host(p, len);
+		p += len;
+
+		std::string port(PROXY_CLIENT_DEFAULT_PORT);
+		unsigned int weight = 1;
+		std::string::size_type colon = host.find(':');
+		if(colon != std::string::npos) {
+			port = host.substr(colon+1);
+			host.erase(colon);
+			std::string::size_type wcolon = port.find(':');
+			if(wcolon != std::string::npos) {
+				weight = atoi(port.c_str() + wcolon + 1);
+				port.erase(wcolon);
+			}
+		}
+
+		if(host.empty() || port.empty() || weight == 0) {
+			throw std::runtime_error("invalid server list");
+		}
+
+		struct addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		struct addrinfo* res = NULL;
+		int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+		if(err != 0) {
+			throw std::runtime_error(std::string("can't resolve ")
+					+ host + ": " + gai_strerror(err));
+		}
+
+		address a;
+		memcpy(&a.addr, res->ai_addr, res->ai_addrlen);
+		a.addrlen = res->ai_addrlen;
+		a.name = host + ":" + port;
+		a.weight = weight;
+		freeaddrinfo(res);
+
+		result->push_back(a);
+	}
+
+	if(result->empty()) {
+		throw std::runtime_error("invalid server list");
+	}
+}
+
+}  // noname namespace
+
+
 typedef std::vector<exclusive_t*> thread_list_t;
 typedef mp::exclusive<thread_list_t> exclusive_thread_list_t;
 typedef exclusive_thread_list_t::ref thread_list_ref;
@@ -32,19 +167,35 @@ static exclusive_thread_list_t* s_thread_list = NULL;
 
 static __thread exclusive_t* tls = NULL;
 
+// the topology given to the threads; guarded by s_thread_list
+static shared_topology s_topology;
+
 
 void thread_init_func(void*)
 {
-	memcached_st* mc = memcached_create(NULL);
-	tls = new exclusive_t(mc);
-
 	thread_list_ref ls(*s_thread_list);
+	tls = new exclusive_t(s_topology);
 	ls->push_back(tls);
 }
 
 void init()
 {
 	s_thread_list = new exclusive_thread_list_t();
+
+	topology* tp = new topology();
+	s_topology.reset(tp);
+	tp->primary.reset(new server_set());
+}
+
+// s_thread_list must be locked
+static void publish(thread_list_ref& ls, topology* tp)
+{
+	s_topology.reset(tp);
+	for(thread_list_t::iterator it(ls->begin()), it_end(ls->end());
+			it != it_end; ++it) {
+		ref r(**it);
+		*r = s_topology;
+	}
 }
 
 void destroy()
@@ -52,48 +203,344 @@ void destroy()
 	thread_list_ref ls(*s_thread_list);
 	for(thread_list_t::iterator it(ls->begin()), it_end(ls->end());
 			it != it_end; ++it) {
-		ref r(**it);
-		memcached_free(*r);
 		delete *it;
 	}
 	delete s_thread_list;
 	s_thread_list = NULL;
+	s_topology.reset();
+}
+
+static volatile size_t s_min_ready = 1;
+
+void set_min_ready(size_t num)
+{
+	s_min_ready = num;
+}
+
+static volatile unsigned int s_migration_window = 0;
+
+void set_migration_window(unsigned int msec)
+{
+	s_migration_window = msec;
+}
+
+static stats::counter s_migration_windows("migration_windows");
+static stats::gauge s_migration_active("migration_active");
+
+
+void migration::record(bool hit)
+{
+	if(hit) {
+		__sync_add_and_fetch(&m_hits, 1);
+	}
+	if(__sync_add_and_fetch(&m_tries, 1) % PROXY_CLIENT_MIGRATION_SAMPLE != 0) {
+		return;
+	}
+
+	// approximate; hits of the next sample may be counted here
+	unsigned int hits = __sync_fetch_and_and(&m_hits, 0);
+	if(hits * 100 < PROXY_CLIENT_MIGRATION_MIN_HIT_PERCENT *
+			PROXY_CLIENT_MIGRATION_SAMPLE) {
+		LOG_INFO("migration window ends: ",hits," hits in the last ",
+				PROXY_CLIENT_MIGRATION_SAMPLE," fallbacks");
+		// called from a response; the old servers must not be retired here
+		try {
+			core::submit(&migration::end, shared_from_this());
+		} catch (std::exception& e) {
+			LOG_WARN("can't end the migration window: ",e.what());
+		}
+	}
+}
+
+void migration::end()
+{
+	thread_list_ref ls(*s_thread_list);
+	m_ended = true;
+	if(s_topology->migrating.get() != this) {
+		return;  // replaced by a newer list
+	}
+
+	LOG_INFO("migration window ended");
+
+	topology* tp = new topology(*s_topology);
+	tp->migrating.reset();
+	s_migration_active.set(0);
+	publish(ls, tp);
+}
+
+// incremented by set_servers(); guarded by s_thread_list
+static uint64_t s_generation = 0;
+
+static void activate(shared_server_set ss, uint64_t generation)
+{
+	thread_list_ref ls(*s_thread_list);
+	if(generation != s_generation) {
+		return;  // replaced by a newer list
+	}
+
+	LOG_INFO("server list is ready");
+
+	topology* tp = new topology(*s_topology);
+	tp->primary = ss;
+
+	// only the list just before this one is read during the window
+	tp->migrating.reset();
+	const unsigned int window = s_migration_window;
+	if(window > 0 && s_topology->primary->size() > 0) {
+		tp->migrating.reset(new migration(s_topology->primary));
+		s_migration_windows.incr();
+		try {
+			core::deadline_event(window,
+					mp::bind(&migration::end, tp->migrating));
+		} catch (std::exception& e) {
+			LOG_WARN("migration timer failed: ",e.what());
+		}
+	}
+	s_migration_active.set(tp->migrating ? 1 : 0);
+
+	publish(ls, tp);
+}
+
+namespace {
+
+// activates a new server list once all servers are connected
+class warmup {
+public:
+	warmup(shared_server_set ss, uint64_t generation) :
+		m_ss(ss), m_generation(generation), m_pending(ss->size()) { }
+
+	void server_ready()
+	{
+		if(__sync_sub_and_fetch(&m_pending, 1) == 0) {
+			activate(m_ss, m_generation);
+		}
+	}
+
+private:
+	shared_server_set m_ss;
+	uint64_t m_generation;
+	volatile size_t m_pending;
+};
+
+}  // noname namespace
+
+// all threads share the servers and multiplex requests
+// onto their connections
+static shared_server_set create_server_set(const address_list& addrs)
+{
+	shared_server_set ss(new server_set());
+	for(address_list::const_iterator ad(addrs.begin()), ad_end(addrs.end());
+			ad != ad_end; ++ad) {
+		ss->push_back(upstream::shared_server(new upstream::server(
+						(struct sockaddr*)&ad->addr, ad->addrlen)),
+				ad->name, ad->weight);
+	}
+	ss->build();
+	return ss;
 }
 
 void set_servers(const char* server_list)
 {
-	memcached_server_st* servers;
+	address_list addrs;
+	parse_server_list(server_list, &addrs);
+
+	shared_server_set ss(create_server_set(addrs));
+
+	uint64_t generation;
+	bool active_empty;
 	{
-		char* server_list_dup = ::strdup(server_list);
-		if(!server_list_dup) {
-			throw std::bad_alloc();
+		thread_list_ref ls(*s_thread_list);
+		generation = ++s_generation;
+		active_empty = s_topology->primary->size() == 0;
+	}
+
+	// the new list is used after the connections are established
+	// instead of letting the first requests open them
+	mp::function<void ()> ready;
+	if(active_empty) {
+		// nothing to keep serving while the connections are opened
+		activate(ss, generation);
+	} else {
+		mp::shared_ptr<warmup> w(new warmup(ss, generation));
+		ready = mp::bind(&warmup::server_ready, w);
+	}
+
+	for(size_t i=0; i < ss->size(); ++i) {
+		ss->at(i)->preconnect(s_min_ready, ready);
+	}
+}
+
+void set_replicas(const char* server_lists)
+{
+	std::vector<shared_server_set> replicas;
+	std::vector<replication::shared_queue> queues;
+
+	std::string lists(server_lists);
+	std::string::size_type pos = 0;
+	while(pos < lists.size()) {
+		std::string::size_type end = lists.find(';', pos);
+		if(end == std::string::npos) { end = lists.size(); }
+		std::string list(lists, pos, end - pos);
+		pos = end + 1;
+
+		if(list.find_first_not_of(", ") == std::string::npos) {
+			continue;
 		}
-	
-		servers = memcached_servers_parse(server_list_dup);
-		::free(server_list_dup);
-	
-		if(servers == NULL) {
-			throw std::runtime_error("invalid server list");
+
+		address_list addrs;
+		parse_server_list(list.c_str(), &addrs);
+		replicas.push_back(create_server_set(addrs));
+		queues.push_back(replication::shared_queue(
+					new replication::queue(replicas.back())));
+	}
+
+	// replicas are used at once; requests to them are the minority
+	for(std::vector<shared_server_set>::iterator it(replicas.begin()),
+			it_end(replicas.end()); it != it_end; ++it) {
+		for(size_t i=0; i < (*it)->size(); ++i) {
+			(*it)->at(i)->preconnect(0, mp::function<void ()>());
 		}
 	}
 
 	thread_list_ref ls(*s_thread_list);
-	for(thread_list_t::iterator it(ls->begin()), it_end(ls->end());
-			it != it_end; ++it) {
+	topology* tp = new topology(*s_topology);
+	tp->replicas.swap(replicas);
+	tp->replica_queues.swap(queues);
+	publish(ls, tp);
+}
+
+// s_thread_list must be locked; routes to removed pools are dropped
+static void build_routes(topology* tp)
+{
+	prefix_table table;
+	std::vector<shared_server_set> sets;
+	std::map<std::string, int> index;
 
-		memcached_st* mc = memcached_create(NULL);
-		if(!mc) {
-			throw std::bad_alloc();
+	typedef std::vector<std::pair<std::string, std::string> > routes_t;
+	for(routes_t::iterator it(tp->routes.begin()); it != tp->routes.end(); ) {
+		std::map<std::string, shared_server_set>::const_iterator
+			pl(tp->pools.find(it->second));
+		if(pl == tp->pools.end()) {
+			LOG_WARN("route ",it->first," is removed with pool ",it->second);
+			it = tp->routes.erase(it);
+			continue;
 		}
 
-		if(memcached_server_push(mc, servers) != MEMCACHED_SUCCESS) {
-			throw std::bad_alloc();
+		std::map<std::string, int>::iterator ix(index.find(it->second));
+		if(ix == index.end()) {
+			ix = index.insert(std::make_pair(it->second, (int)sets.size())).first;
+			sets.push_back(pl->second);
 		}
+		table.add(it->first, ix->second);
+		++it;
+	}
+	table.build();
 
-		ref r(**it);
-		memcached_free(*r);
-		*r = mc;
+	tp->route_table = table;
+	tp->route_sets.swap(sets);
+}
+
+void set_pool(const char* name, const char* server_list)
+{
+	shared_server_set ss;
+	if(strspn(server_list, ", ") != strlen(server_list)) {
+		address_list addrs;
+		parse_server_list(server_list, &addrs);
+		ss = create_server_set(addrs);
+
+		// used at once like replicas
+		for(size_t i=0; i < ss->size(); ++i) {
+			ss->at(i)->preconnect(0, mp::function<void ()>());
+		}
 	}
+
+	thread_list_ref ls(*s_thread_list);
+	topology* tp = new topology(*s_topology);
+	if(ss) {
+		tp->pools[name] = ss;
+	} else {
+		tp->pools.erase(name);
+	}
+	build_routes(tp);
+	publish(ls, tp);
+}
+
+void set_shadow(unsigned int percent, const char* server_list)
+{
+	if(percent > 100) {
+		throw std::runtime_error("invalid shadow percentage");
+	}
+
+	shared_server_set ss;
+	if(percent > 0 && strspn(server_list, ", ") != strlen(server_list)) {
+		address_list addrs;
+		parse_server_list(server_list, &addrs);
+		ss = create_server_set(addrs);
+
+		for(size_t i=0; i < ss->size(); ++i) {
+			ss->at(i)->preconnect(0, mp::function<void ()>());
+		}
+	}
+
+	thread_list_ref ls(*s_thread_list);
+	topology* tp = new topology(*s_topology);
+	tp->shadow = ss;
+	tp->shadow_percent = ss ? percent : 0;
+	publish(ls, tp);
+}
+
+void set_tier(bool promote, bool sets_only, const char* server_list)
+{
+	shared_server_set ss;
+	if(strspn(server_list, ", ") != strlen(server_list)) {
+		address_list addrs;
+		parse_server_list(server_list, &addrs);
+		ss = create_server_set(addrs);
+
+		for(size_t i=0; i < ss->size(); ++i) {
+			ss->at(i)->preconnect(0, mp::function<void ()>());
+		}
+	}
+
+	thread_list_ref ls(*s_thread_list);
+	topology* tp = new topology(*s_topology);
+	tp->cold = ss;
+	tp->cold_promote = ss && promote;
+	tp->cold_sets_only = ss && sets_only;
+	publish(ls, tp);
+}
+
+void set_routes(const char* routes)
+{
+	std::vector<std::pair<std::string, std::string> > parsed;
+
+	const char* p = routes;
+	while(true) {
+		p += strspn(p, " ");
+		if(*p == '\0') { break; }
+
+		size_t len = strcspn(p, " ");
+		std::string route(p, len);
+		p += len;
+
+		std::string::size_type eq = route.rfind('=');
+		if(eq == std::string::npos || eq == 0 || eq + 1 == route.size()) {
+			throw std::runtime_error("invalid route: " + route);
+		}
+		parsed.push_back(std::make_pair(route.substr(0, eq), route.substr(eq+1)));
+	}
+
+	thread_list_ref ls(*s_thread_list);
+	for(size_t i=0; i < parsed.size(); ++i) {
+		if(s_topology->pools.count(parsed[i].second) == 0) {
+			throw std::runtime_error("unknown pool: " + parsed[i].second);
+		}
+	}
+
+	topology* tp = new topology(*s_topology);
+	tp->routes.swap(parsed);
+	build_routes(tp);
+	publish(ls, tp);
 }
 
 exclusive_t& get()
@@ -101,6 +548,51 @@ exclusive_t& get()
 	return *tls;
 }
 
+shared_server_set current()
+{
+	ref r(*tls);
+	return (*r)->primary;
+}
+
+shared_topology current_topology()
+{
+	ref r(*tls);
+	return *r;
+}
+
+static void dump_set(const server_set* ss, const std::string& name,
+		std::string* out)
+{
+	if(!ss) {
+		return;
+	}
+	for(size_t i=0; i < ss->size(); ++i) {
+		ss->at(i)->dump_stats(name + ":", out);
+	}
+}
+
+void dump_stats(std::string* out)
+{
+	shared_topology tp(current_topology());
+
+	dump_set(tp->primary.get(), "primary", out);
+	for(size_t i=0; i < tp->replicas.size(); ++i) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "replica%lu", (unsigned long)i);
+		dump_set(tp->replicas[i].get(), buf, out);
+	}
+	for(std::map<std::string, shared_server_set>::const_iterator
+			it(tp->pools.begin()), it_end(tp->pools.end());
+			it != it_end; ++it) {
+		dump_set(it->second.get(), "pool:" + it->first, out);
+	}
+	dump_set(tp->shadow.get(), "shadow", out);
+	dump_set(tp->cold.get(), "cold", out);
+	if(tp->migrating && tp->migrating->active()) {
+		dump_set(tp->migrating->previous(), "previous", out);
+	}
+}
+
 
 }  // namespace proxy_client
 }  // namespace memxy
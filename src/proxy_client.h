@@ -18,15 +18,136 @@
 #ifndef MEMXY_PROXY_CLIENT_H__
 #define MEMXY_PROXY_CLIENT_H__
 
+#include "upstream.h"
+#include "distribution.h"
+#include "prefix_table.h"
 #include <mp/exclusive.h>
+#include <mp/memory.h>
+#include <map>
+#include <string>
+#include <utility>
 #include <vector>
-#include <libmemcached/memcached.h>
 
 namespace memxy {
+namespace replication {
+class queue;
+}
 namespace proxy_client {
 
 
-typedef mp::exclusive<memcached_st*> exclusive_t;
+class server_set {
+public:
+	server_set();
+	~server_set();
+
+	// name and weight place the server in the key distribution
+	void push_back(upstream::shared_server sv,
+			const std::string& name, unsigned int weight);
+
+	// must be called after all servers are added
+	void build();
+
+	// returns NULL if no server is set
+	upstream::server* route(const char* key, size_t keylen) const;
+
+	size_t size() const { return m_servers.size(); }
+
+	upstream::server* at(size_t i) const { return m_servers[i].get(); }
+
+private:
+	std::vector<upstream::shared_server> m_servers;
+	distribution m_dist;
+
+private:
+	server_set(const server_set&);
+};
+
+typedef mp::shared_ptr<server_set> shared_server_set;
+
+
+// After the server list is replaced, a miss on the new owner of a key
+// falls back to its owner in the previous list until the window expires
+// or the fallbacks stop hitting.
+class migration : public mp::enable_shared_from_this<migration> {
+public:
+	explicit migration(shared_server_set previous) :
+		m_previous(previous), m_ended(false), m_tries(0), m_hits(0) { }
+
+	bool active() const { return !m_ended; }
+
+	server_set* previous() const { return m_previous.get(); }
+
+	// counts the result of a fallback; ends the window when few of
+	// them hit
+	void record(bool hit);
+
+	// removes the window from the topology
+	void end();
+
+private:
+	shared_server_set m_previous;
+	volatile bool m_ended;
+	volatile unsigned int m_tries;
+	volatile unsigned int m_hits;
+
+private:
+	migration();
+	migration(const migration&);
+};
+
+typedef mp::shared_ptr<migration> shared_migration;
+
+
+// all server sets in use; replaced as a whole when one of them changes
+struct topology {
+	topology() : shadow_percent(0),
+		cold_promote(false), cold_sets_only(false) { }
+
+	shared_server_set primary;
+
+	// sets which hold copies of the primary's keys
+	std::vector<shared_server_set> replicas;
+
+	// writes mirrored to each of the replicas
+	std::vector<mp::shared_ptr<replication::queue> > replica_queues;
+
+	// named pools which keys are routed to by their prefix
+	std::map<std::string, shared_server_set> pools;
+
+	// prefix and pool name of each route
+	std::vector<std::pair<std::string, std::string> > routes;
+
+	// the longest prefix of a key -> index of route_sets
+	prefix_table route_table;
+	std::vector<shared_server_set> route_sets;
+
+	// pool which a sample of requests to the primary set is mirrored to;
+	// NULL if mirroring is disabled
+	shared_server_set shadow;
+	unsigned int shadow_percent;
+
+	// NULL unless the primary set has just replaced another
+	shared_migration migrating;
+
+	// pool which misses of the primary set are looked up in; NULL if
+	// tiering is disabled
+	shared_server_set cold;
+	bool cold_promote;    // hits in the cold pool are copied to the primary
+	bool cold_sets_only;  // sets go to the cold pool and delete the key
+	                      // from the primary set instead of mirroring
+
+	// returns the primary set unless the key is routed to a pool
+	server_set* pool_of(const char* key, size_t keylen) const
+	{
+		int i = route_table.find(key, keylen);
+		return i < 0 ? primary.get() : route_sets[i].get();
+	}
+};
+
+typedef mp::shared_ptr<const topology> shared_topology;
+
+
+typedef mp::exclusive<shared_topology> exclusive_t;
 typedef exclusive_t::ref ref;
 
 void thread_init_func(void* null);
@@ -34,10 +155,46 @@ void thread_init_func(void* null);
 void init();
 void destroy();
 
+// the new list is used after min_ready connections to each server
+// are established or tried
 void set_servers(const char* server_list);
 
+void set_min_ready(size_t num);
+
+// misses fall back to the previous server list for this time after it's
+// replaced; 0 disables the fallback
+void set_migration_window(unsigned int msec);
+
+// server lists separated by ';'; an empty string removes the replicas
+void set_replicas(const char* server_lists);
+
+// adds or replaces the named pool; an empty list removes the pool and
+// the routes to it
+void set_pool(const char* name, const char* server_list);
+
+// mirrors gets, sets and deletes of percent of the keys in the primary
+// set to the servers; 0 or an empty list disables mirroring
+void set_shadow(unsigned int percent, const char* server_list);
+
+// a miss of the primary set is looked up in the servers; sets go to both,
+// or only to the servers if sets_only; an empty list disables tiering
+void set_tier(bool promote, bool sets_only, const char* server_list);
+
+// "<prefix>=<pool>" separated by ' '; keys which match none of the
+// prefixes go to the primary set; an empty string removes all routes
+void set_routes(const char* routes);
+
 exclusive_t& get();
 
+// returns the primary server set of this thread
+shared_server_set current();
+
+shared_topology current_topology();
+
+// appends the stats of each server in use, named after its set: primary,
+// replica<N>, pool:<name>, shadow, cold or previous
+void dump_stats(std::string* out);
+
 
 }  // namespace proxy_client
 }  // namespace memxy
@@ -0,0 +1,285 @@
+//
+// memxy::replication - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "replication.h"
+#include "wavy_core.h"
+#include "stats.h"
+#include <cclog/cclog.h>
+#include <exception>
+
+// 0 is unlimited
+#ifndef REPLICATION_QUEUE_SIZE
+#define REPLICATION_QUEUE_SIZE (16*1024*1024)
+#endif
+
+// writes sent by a worker thread at once
+#ifndef REPLICATION_BATCH_SIZE
+#define REPLICATION_BATCH_SIZE 64
+#endif
+
+namespace memxy {
+namespace replication {
+
+
+static volatile size_t s_queue_limit = REPLICATION_QUEUE_SIZE;
+
+void set_queue_size(size_t bytes)
+{
+	s_queue_limit = bytes;
+}
+
+static stats::counter s_queued("replication_queued");
+static stats::counter s_sent("replication_sent");
+static stats::counter s_dropped("replication_dropped");
+static stats::counter s_failed("replication_failed");
+static stats::gauge s_queue_bytes("replication_queue_bytes");
+
+
+namespace {
+
+class write_request : public upstream::request {
+public:
+	write_request() { }
+
+	void complete(upstream::status st)
+	{
+		// a deleted key wasn't there or an added one already was
+		if(st != upstream::STATUS_SUCCESS &&
+				st != upstream::STATUS_NOT_FOUND &&
+				st != upstream::STATUS_NOT_STORED) {
+			s_failed.incr();
+		}
+	}
+};
+
+}  // noname namespace
+
+
+queue::queue(proxy_client::shared_server_set ss) :
+	m_bytes(0),
+	m_flushing(false),
+	m_ss(ss),
+	m_req(new write_request()) { }
+
+queue::~queue()
+{
+	s_queue_bytes.decr(m_bytes);
+}
+
+static inline size_t size_of(const std::string& key, const std::string& data)
+{
+	return key.size() + data.size() + sizeof(std::string) * 2;
+}
+
+void queue::set(const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime,
+		const char* data, size_t datalen)
+{
+	store(WRITE_SET, key, keylen, flags, exptime, data, datalen);
+}
+
+void queue::add(const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime,
+		const char* data, size_t datalen)
+{
+	store(WRITE_ADD, key, keylen, flags, exptime, data, datalen);
+}
+
+void queue::store(command cmd, const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime,
+		const char* data, size_t datalen)
+{
+	// the client is answered by the primary; a failure only drops the
+	// write to the replica
+	try {
+		write w;
+		w.cmd = cmd;
+		w.flags = flags;
+		w.exptime = exptime;
+		w.key.assign(key, keylen);
+		w.data.assign(data, datalen);
+		enqueue(w);
+	} catch (...) {
+		s_dropped.incr();
+	}
+}
+
+void queue::remove(const char* key, size_t keylen,
+		uint32_t exptime)
+{
+	try {
+		write w;
+		w.cmd = WRITE_REMOVE;
+		w.flags = 0;
+		w.exptime = exptime;
+		w.key.assign(key, keylen);
+		enqueue(w);
+	} catch (...) {
+		s_dropped.incr();
+	}
+}
+
+// takes the strings of w
+void queue::enqueue(write& w)
+{
+	const size_t size = size_of(w.key, w.data);
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+
+		const size_t limit = s_queue_limit;
+		if(limit != 0 && m_bytes + size > limit) {
+			s_dropped.incr();
+			return;
+		}
+
+		m_writes.push_back(write());
+		write& q = m_writes.back();
+		q.cmd = w.cmd;
+		q.flags = w.flags;
+		q.exptime = w.exptime;
+		q.key.swap(w.key);
+		q.data.swap(w.data);
+
+		m_bytes += size;
+		s_queue_bytes.incr(size);
+		s_queued.incr();
+
+		if(m_flushing) {
+			return;
+		}
+		m_flushing = true;
+	}
+	schedule();
+}
+
+// m_flushing must be set
+void queue::schedule()
+{
+	try {
+		core::submit(&queue::flush, shared_from_this());
+	} catch (std::exception& e) {
+		// the writes stay in the queue and the next write retries
+		LOG_WARN("replication flush failed: ",e.what());
+		mp::pthread_scoped_lock lk(m_mutex);
+		m_flushing = false;
+	}
+}
+
+void queue::flush()
+{
+	std::deque<write> batch;
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		for(size_t i=0; i < REPLICATION_BATCH_SIZE && !m_writes.empty(); ++i) {
+			write& q = m_writes.front();
+			batch.push_back(write());
+			write& w = batch.back();
+			w.cmd = q.cmd;
+			w.flags = q.flags;
+			w.exptime = q.exptime;
+			w.key.swap(q.key);
+			w.data.swap(q.data);
+
+			const size_t size = size_of(w.key, w.data);
+			m_bytes -= size;
+			s_queue_bytes.decr(size);
+			m_writes.pop_front();
+		}
+	}
+
+	// the writes to a server are sent together as a pipeline
+	for(std::deque<write>::iterator it(batch.begin()), it_end(batch.end());
+			it != it_end; ++it) {
+		upstream::server* sv = m_ss->route(it->key.data(), it->key.size());
+		if(!sv) {
+			s_failed.incr();
+			continue;
+		}
+		try {
+			switch(it->cmd) {
+			case WRITE_SET:
+				sv->set(it->key.data(), it->key.size(),
+						it->flags, it->exptime,
+						it->data.data(), it->data.size(), m_req);
+				break;
+			case WRITE_ADD:
+				sv->add(it->key.data(), it->key.size(),
+						it->flags, it->exptime,
+						it->data.data(), it->data.size(), m_req);
+				break;
+			case WRITE_REMOVE:
+				sv->remove(it->key.data(), it->key.size(),
+						it->exptime, m_req);
+				break;
+			}
+			s_sent.incr();
+		} catch (std::exception& e) {
+			LOG_WARN("replication failed: ",e.what());
+			s_failed.incr();
+		} catch (...) {
+			LOG_WARN("replication failed: unknown error");
+			s_failed.incr();
+		}
+	}
+
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		if(m_writes.empty()) {
+			m_flushing = false;
+			return;
+		}
+	}
+	schedule();
+}
+
+
+void set(const proxy_client::topology& tp,
+		const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime,
+		const char* data, size_t datalen)
+{
+	for(std::vector<shared_queue>::const_iterator it(tp.replica_queues.begin()),
+			it_end(tp.replica_queues.end()); it != it_end; ++it) {
+		(*it)->set(key, keylen, flags, exptime, data, datalen);
+	}
+}
+
+void add(const proxy_client::topology& tp,
+		const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime,
+		const char* data, size_t datalen)
+{
+	for(std::vector<shared_queue>::const_iterator it(tp.replica_queues.begin()),
+			it_end(tp.replica_queues.end()); it != it_end; ++it) {
+		(*it)->add(key, keylen, flags, exptime, data, datalen);
+	}
+}
+
+void remove(const proxy_client::topology& tp,
+		const char* key, size_t keylen,
+		uint32_t exptime)
+{
+	for(std::vector<shared_queue>::const_iterator it(tp.replica_queues.begin()),
+			it_end(tp.replica_queues.end()); it != it_end; ++it) {
+		(*it)->remove(key, keylen, exptime);
+	}
+}
+
+
+}  // namespace replication
+}  // namespace memxy
+
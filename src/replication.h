@@ -0,0 +1,114 @@
+//
+// memxy::replication - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef MEMXY_REPLICATION_H__
+#define MEMXY_REPLICATION_H__
+
+#include "upstream.h"
+#include "proxy_client.h"
+#include <mp/memory.h>
+#include <mp/pthread.h>
+#include <deque>
+#include <string>
+
+namespace memxy {
+namespace replication {
+
+
+// Writes to the primary set are mirrored to a replica set through this
+// queue.  The client is answered by the primary alone; the queue is
+// flushed by a worker thread in batches and a write is dropped when the
+// queue is full.
+class queue : public mp::enable_shared_from_this<queue> {
+public:
+	explicit queue(proxy_client::shared_server_set ss);
+	~queue();
+
+	void set(const char* key, size_t keylen,
+			uint32_t flags, uint32_t exptime,
+			const char* data, size_t datalen);
+
+	// stores the value only where the key doesn't exist
+	void add(const char* key, size_t keylen,
+			uint32_t flags, uint32_t exptime,
+			const char* data, size_t datalen);
+
+	void remove(const char* key, size_t keylen,
+			uint32_t exptime);
+
+private:
+	enum command { WRITE_SET, WRITE_ADD, WRITE_REMOVE };
+
+	struct write {
+		command cmd;
+		uint32_t flags;
+		uint32_t exptime;
+		std::string key;
+		std::string data;
+	};
+
+	void store(command cmd, const char* key, size_t keylen,
+			uint32_t flags, uint32_t exptime,
+			const char* data, size_t datalen);
+	void enqueue(write& w);
+	void schedule();
+	void flush();
+
+private:
+	mp::pthread_mutex m_mutex;
+	std::deque<write> m_writes;
+	size_t m_bytes;
+	bool m_flushing;
+
+	proxy_client::shared_server_set m_ss;
+
+	// shared by all writes; counts failures
+	upstream::shared_request m_req;
+
+private:
+	queue();
+	queue(const queue&);
+};
+
+typedef mp::shared_ptr<queue> shared_queue;
+
+
+// queues the write to each replica set of the topology
+void set(const proxy_client::topology& tp,
+		const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime,
+		const char* data, size_t datalen);
+
+void add(const proxy_client::topology& tp,
+		const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime,
+		const char* data, size_t datalen);
+
+void remove(const proxy_client::topology& tp,
+		const char* key, size_t keylen,
+		uint32_t exptime);
+
+// writes waiting to be sent to a replica set are limited to this size;
+// 0 is unlimited
+void set_queue_size(size_t bytes);
+
+
+}  // namespace replication
+}  // namespace memxy
+
+#endif /* replication.h */
+
@@ -0,0 +1,54 @@
+//
+// memxy::stats - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#include "stats.h"
+#include <stdio.h>
+
+namespace memxy {
+namespace stats {
+
+
+// zero-initialized before the counters are constructed
+static counter* s_head;
+static counter** s_tail = &s_head;
+
+counter::counter(const char* name) :
+	m_name(name),
+	m_value(0),
+	m_next(NULL)
+{
+	*s_tail = this;
+	s_tail = &m_next;
+}
+
+void dump(std::string* out)
+{
+	char buf[32];
+	for(counter* c = s_head; c; c = c->m_next) {
+		snprintf(buf, sizeof(buf), " %" PRIu64 "\r\n", c->value());
+		out->append("STAT ");
+		out->append(c->m_name);
+		out->append(buf);
+	}
+}
+
+
+}  // namespace stats
+}  // namespace memxy
+
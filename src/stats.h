@@ -0,0 +1,65 @@
+//
+// memxy::stats - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef MEMXY_STATS_H__
+#define MEMXY_STATS_H__
+
+#include <stdint.h>
+#include <string>
+
+namespace memxy {
+namespace stats {
+
+
+// A counter is defined as a static object and registered by name
+// before main() runs; incr() and decr() are lock-free.
+class counter {
+public:
+	explicit counter(const char* name);
+
+	void incr(uint64_t n = 1) { __sync_add_and_fetch(&m_value, n); }
+	void decr(uint64_t n = 1) { __sync_sub_and_fetch(&m_value, n); }
+	void set(uint64_t n) { m_value = n; }
+
+	uint64_t value() const { return m_value; }
+	const char* name() const { return m_name; }
+
+private:
+	const char* m_name;
+	volatile uint64_t m_value;
+	counter* m_next;
+
+	friend void dump(std::string* out);
+
+private:
+	counter();
+	counter(const counter&);
+};
+
+// a counter which goes up and down
+typedef counter gauge;
+
+
+// appends "STAT <name> <value>\r\n" of all counters
+void dump(std::string* out);
+
+
+}  // namespace stats
+}  // namespace memxy
+
+#endif /* stats.h */
+
@@ -0,0 +1,193 @@
+//
+// memxy::binary_response test - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "binary_response.h"
+#include "memproto/memproto.h"
+#include "test/test.h"
+#include <stdexcept>
+#include <string>
+#include <string.h>
+#include <stdio.h>
+#include <arpa/inet.h>
+
+using namespace memxy;
+
+// builds a response as a server sends it
+static std::string response(uint8_t opcode, uint16_t status, uint32_t opaque,
+		uint64_t cas, const std::string& ext,
+		const std::string& key, const std::string& val)
+{
+	char h[MEMPROTO_HEADER_SIZE];
+	memset(h, 0, sizeof(h));
+	h[0] = (char)MEMPROTO_RESPONSE;
+	h[1] = (char)opcode;
+	uint16_t keylen = htons((uint16_t)key.size());
+	memcpy(h+2, &keylen, 2);
+	h[4] = (char)ext.size();
+	uint16_t st = htons(status);
+	memcpy(h+6, &st, 2);
+	uint32_t bodylen = htonl((uint32_t)(ext.size() + key.size() + val.size()));
+	memcpy(h+8, &bodylen, 4);
+	memcpy(h+12, &opaque, 4);
+	uint32_t cas_hi = htonl((uint32_t)(cas >> 32));
+	uint32_t cas_lo = htonl((uint32_t)cas);
+	memcpy(h+16, &cas_hi, 4);
+	memcpy(h+20, &cas_lo, 4);
+	return std::string(h, sizeof(h)) + ext + key + val;
+}
+
+static std::string be32(uint32_t v)
+{
+	v = htonl(v);
+	return std::string((const char*)&v, 4);
+}
+
+static bool throws(const std::string& data)
+{
+	binary_response res;
+	try {
+		parse_binary_response(data.data(), data.size(), &res);
+	} catch (std::runtime_error&) {
+		return true;
+	}
+	return false;
+}
+
+static void test_getk()
+{
+	const std::string data = response(MEMPROTO_CMD_GETK, MEMPROTO_RES_NO_ERROR,
+			0x01020304, 0x1122334455667788ULL, be32(0xdeadbeef), "key", "value");
+
+	binary_response res;
+	TEST_CHECK(parse_binary_response(data.data(), data.size(), &res) == data.size());
+	TEST_CHECK(res.opcode == MEMPROTO_CMD_GETK);
+	TEST_CHECK(res.status == MEMPROTO_RES_NO_ERROR);
+	TEST_CHECK(res.opaque == 0x01020304);
+	TEST_CHECK(res.cas == 0x1122334455667788ULL);
+	TEST_CHECK(res.flags == 0xdeadbeef);
+	TEST_CHECK(std::string(res.key, res.keylen) == "key");
+	TEST_CHECK(std::string(res.val, res.vallen) == "value");
+}
+
+static void test_no_body()
+{
+	const std::string data = response(MEMPROTO_CMD_NOOP, MEMPROTO_RES_NO_ERROR,
+			7, 0, "", "", "");
+
+	binary_response res;
+	TEST_CHECK(parse_binary_response(data.data(), data.size(), &res) ==
+			MEMPROTO_HEADER_SIZE);
+	TEST_CHECK(res.opcode == MEMPROTO_CMD_NOOP);
+	TEST_CHECK(res.opaque == 7);
+	TEST_CHECK(res.flags == 0);
+	TEST_CHECK(res.keylen == 0);
+	TEST_CHECK(res.vallen == 0);
+}
+
+// an error response carries a message as the value
+static void test_error()
+{
+	const std::string data = response(MEMPROTO_CMD_SETQ, MEMPROTO_RES_ITEM_NOT_STORED,
+			9, 0, "", "", "Not stored");
+
+	binary_response res;
+	TEST_CHECK(parse_binary_response(data.data(), data.size(), &res) == data.size());
+	TEST_CHECK(res.opcode == MEMPROTO_CMD_SETQ);
+	TEST_CHECK(res.status == MEMPROTO_RES_ITEM_NOT_STORED);
+	TEST_CHECK(std::string(res.val, res.vallen) == "Not stored");
+}
+
+// every prefix of a response requires more data
+static void test_partial()
+{
+	const std::string data = response(MEMPROTO_CMD_GETK, MEMPROTO_RES_NO_ERROR,
+			1, 2, be32(3), "key", std::string(1000, 'v'));
+
+	binary_response res;
+	for(size_t n=0; n < data.size(); ++n) {
+		TEST_CHECK(parse_binary_response(data.data(), n, &res) == 0);
+	}
+	TEST_CHECK(parse_binary_response(data.data(), data.size(), &res) == data.size());
+	TEST_CHECK(res.vallen == 1000);
+}
+
+// pipelined responses are consumed one at a time
+static void test_pipelined()
+{
+	std::string data;
+	for(uint32_t i=0; i < 100; ++i) {
+		char key[16];
+		snprintf(key, sizeof(key), "k%u", i);
+		data += response(MEMPROTO_CMD_GETKQ, MEMPROTO_RES_NO_ERROR,
+				i, i, be32(i), key, std::string(i, 'v'));
+	}
+	data += response(MEMPROTO_CMD_NOOP, MEMPROTO_RES_NO_ERROR, 100, 0, "", "", "");
+
+	size_t off = 0;
+	for(uint32_t i=0; i <= 100; ++i) {
+		binary_response res;
+		size_t n = parse_binary_response(data.data() + off, data.size() - off, &res);
+		TEST_CHECK(n > 0);
+		TEST_CHECK(res.opaque == i);
+		if(i < 100) {
+			char key[16];
+			snprintf(key, sizeof(key), "k%u", i);
+			TEST_CHECK(res.opcode == MEMPROTO_CMD_GETKQ);
+			TEST_CHECK(res.flags == i);
+			TEST_CHECK(std::string(res.key, res.keylen) == key);
+			TEST_CHECK(res.vallen == i);
+		} else {
+			TEST_CHECK(res.opcode == MEMPROTO_CMD_NOOP);
+		}
+		off += n;
+	}
+	TEST_CHECK(off == data.size());
+}
+
+static void test_invalid()
+{
+	std::string data = response(MEMPROTO_CMD_GETK, MEMPROTO_RES_NO_ERROR,
+			1, 0, be32(0), "key", "value");
+
+	// a request magic
+	std::string magic = data;
+	magic[0] = (char)MEMPROTO_REQUEST;
+	TEST_CHECK(throws(magic));
+	TEST_CHECK(throws(magic.substr(0, MEMPROTO_HEADER_SIZE)));
+
+	// the key and extras do not fit in the body
+	std::string length = data;
+	uint32_t bodylen = htonl(4 + 3 - 1);
+	memcpy(&length[8], &bodylen, 4);
+	TEST_CHECK(throws(length));
+	TEST_CHECK(throws(length.substr(0, MEMPROTO_HEADER_SIZE)));
+
+	TEST_CHECK(!throws(data));
+	TEST_CHECK(!throws(data.substr(0, MEMPROTO_HEADER_SIZE - 1)));
+}
+
+int main(void)
+{
+	test_getk();
+	test_no_body();
+	test_error();
+	test_partial();
+	test_pipelined();
+	test_invalid();
+	return 0;
+}
+
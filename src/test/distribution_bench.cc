@@ -0,0 +1,233 @@
+//
+// memxy::distribution benchmark - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#define __STDC_LIMIT_MACROS
+#include "distribution.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+// Measures distribution::find() of the strategy selected by DISTRIBUTION;
+// "make bench" builds one program per strategy.  The ketama program also
+// times the same ring searched with std::lower_bound on a sorted array to
+// compare it with the Eytzinger layout.  Each program then counts the keys
+// which change their server when one is appended to the list or the one
+// in the middle is removed.
+
+#ifndef BENCH_KEYS
+#define BENCH_KEYS (1 << 20)
+#endif
+
+#ifndef BENCH_ROUNDS
+#define BENCH_ROUNDS 5
+#endif
+
+#ifndef DISTRIBUTION_KETAMA_POINTS
+#define DISTRIBUTION_KETAMA_POINTS 160
+#endif
+
+using namespace memxy;
+
+static uint64_t now_nsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// same as distribution.cc
+static uint64_t hash_fnv1a64(const char* key, size_t keylen)
+{
+	uint64_t value = 14695981039346656037ULL;
+	for(size_t i=0; i < keylen; ++i) {
+		value ^= (uint8_t)key[i];
+		value *= 1099511628211ULL;
+	}
+	return value;
+}
+
+static inline uint64_t mix64(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static const char* strategy()
+{
+#if DISTRIBUTION == DISTRIBUTION_KETAMA
+	return "ketama";
+#elif DISTRIBUTION == DISTRIBUTION_JUMP
+	return "jump";
+#elif DISTRIBUTION == DISTRIBUTION_RENDEZVOUS
+	return "rendezvous";
+#else
+	return "modulo";
+#endif
+}
+
+// the ring of distribution::build() as a sorted array
+class sorted_ring {
+public:
+	sorted_ring(const std::vector<std::string>& names)
+	{
+		std::vector<uint64_t> sorted;
+		for(size_t s=0; s < names.size(); ++s) {
+			const uint64_t seed = hash_fnv1a64(names[s].data(), names[s].size());
+			for(size_t i=0; i < DISTRIBUTION_KETAMA_POINTS; ++i) {
+				uint32_t point = (uint32_t)(mix64(seed + i) >> 32);
+				sorted.push_back(((uint64_t)point << 32) | s);
+			}
+		}
+		std::sort(sorted.begin(), sorted.end());
+		for(size_t i=0; i < sorted.size(); ++i) {
+			m_points.push_back((uint32_t)(sorted[i] >> 32));
+			m_owners.push_back((uint32_t)sorted[i]);
+		}
+	}
+
+	size_t find(const char* key, size_t keylen) const
+	{
+		const uint32_t h = (uint32_t)(mix64(hash_fnv1a64(key, keylen)) >> 32);
+		std::vector<uint32_t>::const_iterator it =
+			std::lower_bound(m_points.begin(), m_points.end(), h);
+		if(it == m_points.end()) {
+			it = m_points.begin();
+		}
+		return m_owners[it - m_points.begin()];
+	}
+
+private:
+	std::vector<uint32_t> m_points;
+	std::vector<uint32_t> m_owners;
+};
+
+static std::string server_name(size_t s)
+{
+	char buf[64];
+	snprintf(buf, sizeof(buf), "10.0.%lu.%lu:11211",
+			(unsigned long)(s / 256), (unsigned long)(s % 256));
+	return buf;
+}
+
+// returns the name of the server of each key
+static std::vector<std::string> owners(const std::vector<std::string>& names,
+		const std::vector<std::string>& keys)
+{
+	distribution d;
+	for(size_t s=0; s < names.size(); ++s) {
+		d.add(names[s], 1);
+	}
+	d.build();
+
+	std::vector<std::string> result(keys.size());
+	for(size_t i=0; i < keys.size(); ++i) {
+		result[i] = names[d.find(keys[i].data(), keys[i].size())];
+	}
+	return result;
+}
+
+// returns the percentage of keys whose server differs
+static double moved(const std::vector<std::string>& before,
+		const std::vector<std::string>& after)
+{
+	size_t num = 0;
+	for(size_t i=0; i < before.size(); ++i) {
+		if(before[i] != after[i]) { ++num; }
+	}
+	return 100.0 * num / before.size();
+}
+
+// returns the best nanoseconds per lookup of the rounds
+template <typename Finder>
+static double measure(const Finder& f, const std::vector<std::string>& keys,
+		std::vector<size_t>* result)
+{
+	uint64_t best = UINT64_MAX;
+	for(int r=0; r < BENCH_ROUNDS; ++r) {
+		const uint64_t start = now_nsec();
+		for(size_t i=0; i < keys.size(); ++i) {
+			(*result)[i] = f.find(keys[i].data(), keys[i].size());
+		}
+		best = std::min(best, now_nsec() - start);
+	}
+	return (double)best / keys.size();
+}
+
+int main(void)
+{
+	std::vector<std::string> keys(BENCH_KEYS);
+	for(size_t i=0; i < keys.size(); ++i) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "key:%08lx", (unsigned long)mix64(i));
+		keys[i] = buf;
+	}
+
+	const size_t sizes[] = {4, 16, 64, 256};
+	for(size_t n=0; n < sizeof(sizes)/sizeof(sizes[0]); ++n) {
+		std::vector<std::string> names;
+		distribution d;
+		for(size_t s=0; s < sizes[n]; ++s) {
+			names.push_back(server_name(s));
+			d.add(names.back(), 1);
+		}
+		d.build();
+
+		std::vector<size_t> result(keys.size());
+		printf("%-10s servers %-4lu find %6.1f ns",
+				strategy(), (unsigned long)sizes[n],
+				measure(d, keys, &result));
+
+#if DISTRIBUTION == DISTRIBUTION_KETAMA
+		sorted_ring ring(names);
+		std::vector<size_t> expect(keys.size());
+		printf("  sorted array %6.1f ns", measure(ring, keys, &expect));
+		if(expect != result) {
+			printf("  MISMATCH");
+		}
+#endif
+		printf("\n");
+	}
+
+	// the same key is moved by any strategy at least with the probability
+	// of 1/(servers after appending) and 1/(servers before removing)
+	for(size_t n=0; n < sizeof(sizes)/sizeof(sizes[0]); ++n) {
+		std::vector<std::string> names;
+		for(size_t s=0; s < sizes[n]; ++s) {
+			names.push_back(server_name(s));
+		}
+		const std::vector<std::string> before = owners(names, keys);
+
+		std::vector<std::string> appended(names);
+		appended.push_back(server_name(sizes[n]));
+
+		std::vector<std::string> removed(names);
+		removed.erase(removed.begin() + sizes[n] / 2);
+
+		printf("%-10s servers %-4lu moved append %5.1f%% (ideal %5.1f%%)"
+				"  remove %5.1f%% (ideal %5.1f%%)\n",
+				strategy(), (unsigned long)sizes[n],
+				moved(before, owners(appended, keys)), 100.0 / (sizes[n] + 1),
+				moved(before, owners(removed, keys)), 100.0 / sizes[n]);
+	}
+
+	return 0;
+}
+
@@ -0,0 +1,194 @@
+//
+// memxy::distribution test - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "distribution.h"
+#include "test/test.h"
+#include <string>
+#include <vector>
+#include <stdio.h>
+
+// built once per strategy by "make check"; the modulo strategy is not
+// consistent, so it skips test_append()
+
+using namespace memxy;
+
+static const size_t KEYS = 100000;
+
+static std::string key_of(size_t i)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "key:%lu", (unsigned long)i);
+	return buf;
+}
+
+static std::string name_of(size_t s)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "10.0.0.%lu:11211", (unsigned long)s);
+	return buf;
+}
+
+static size_t find(const distribution& d, size_t i)
+{
+	const std::string k(key_of(i));
+	return d.find(k.data(), k.size());
+}
+
+// builds servers [0, num) except the skipped one; index maps the
+// positions back to the server numbers
+static void build(distribution* d, size_t num, size_t skip,
+		std::vector<size_t>* index, unsigned int heavy_weight = 1)
+{
+	for(size_t s=0; s < num; ++s) {
+		if(s != skip) {
+			d->add(name_of(s), s == 0 ? heavy_weight : 1);
+			index->push_back(s);
+		}
+	}
+	d->build();
+}
+
+static void test_balance()
+{
+	distribution d;
+	std::vector<size_t> index;
+	build(&d, 8, (size_t)-1, &index);
+	TEST_CHECK(d.size() == 8);
+
+	std::vector<size_t> count(8);
+	for(size_t i=0; i < KEYS; ++i) {
+		const size_t s = find(d, i);
+		TEST_CHECK(s < 8);
+		TEST_CHECK(find(d, i) == s);
+		++count[s];
+	}
+	for(size_t s=0; s < 8; ++s) {
+		TEST_CHECK(count[s] > KEYS / 8 * 3 / 4);
+		TEST_CHECK(count[s] < KEYS / 8 * 5 / 4);
+	}
+}
+
+#if DISTRIBUTION != DISTRIBUTION_MODULO
+// keys either stay or move to the appended server
+static void test_append()
+{
+	distribution before, after;
+	std::vector<size_t> bi, ai;
+	build(&before, 8, (size_t)-1, &bi);
+	build(&after, 9, (size_t)-1, &ai);
+
+	size_t moved = 0;
+	for(size_t i=0; i < KEYS; ++i) {
+		const size_t b = find(before, i);
+		const size_t a = find(after, i);
+		if(a != b) {
+			TEST_CHECK(a == 8);
+			++moved;
+		}
+	}
+	TEST_CHECK(moved > KEYS / 9 / 2);
+	TEST_CHECK(moved < KEYS / 9 * 2);
+}
+#endif
+
+#if DISTRIBUTION == DISTRIBUTION_KETAMA || DISTRIBUTION == DISTRIBUTION_RENDEZVOUS
+static void test_weight()
+{
+	distribution d;
+	std::vector<size_t> index;
+	build(&d, 4, (size_t)-1, &index, 3);
+
+	size_t heavy = 0;
+	for(size_t i=0; i < KEYS; ++i) {
+		if(find(d, i) == 0) {
+			++heavy;
+		}
+	}
+	// 3 of 6 shares
+	TEST_CHECK(heavy > KEYS / 2 * 85 / 100);
+	TEST_CHECK(heavy < KEYS / 2 * 115 / 100);
+}
+
+static bool all_but(void* user, size_t index)
+{
+	return index != *static_cast<size_t*>(user);
+}
+
+// a server is identified by its name; removing one moves only its keys,
+// and they go to the server which find_available() picked
+static void test_remove()
+{
+	distribution all, removed;
+	std::vector<size_t> ai, ri;
+	size_t down = 3;
+	build(&all, 8, (size_t)-1, &ai);
+	build(&removed, 8, down, &ri);
+
+	for(size_t i=0; i < KEYS; ++i) {
+		const std::string k(key_of(i));
+		const size_t a = all.find(k.data(), k.size());
+		const size_t r = ri[removed.find(k.data(), k.size())];
+		if(a != down) {
+			TEST_CHECK(r == a);
+		}
+		TEST_CHECK(all.find_available(k.data(), k.size(), &all_but, &down) == r);
+	}
+}
+#endif
+
+static bool none(void* user, size_t index)
+{
+	return false;
+}
+
+static bool odd(void* user, size_t index)
+{
+	return index % 2 == 1;
+}
+
+static void test_find_available()
+{
+	distribution d;
+	std::vector<size_t> index;
+	build(&d, 8, (size_t)-1, &index);
+
+	for(size_t i=0; i < KEYS; i += 7) {
+		const std::string k(key_of(i));
+		const size_t s = d.find(k.data(), k.size());
+		const size_t a = d.find_available(k.data(), k.size(), &odd, NULL);
+		TEST_CHECK(a % 2 == 1);
+		if(s % 2 == 1) {
+			TEST_CHECK(a == s);
+		}
+		TEST_CHECK(d.find_available(k.data(), k.size(), &none, NULL) == s);
+	}
+}
+
+int main(void)
+{
+	test_balance();
+#if DISTRIBUTION != DISTRIBUTION_MODULO
+	test_append();
+#endif
+#if DISTRIBUTION == DISTRIBUTION_KETAMA || DISTRIBUTION == DISTRIBUTION_RENDEZVOUS
+	test_weight();
+	test_remove();
+#endif
+	test_find_available();
+	return 0;
+}
+
@@ -0,0 +1,159 @@
+//
+// memxy::prefix_table test - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "prefix_table.h"
+#include "test/test.h"
+#include <string>
+#include <utility>
+#include <vector>
+#include <string.h>
+
+using namespace memxy;
+
+static int find(const prefix_table& t, const char* key)
+{
+	return t.find(key, strlen(key));
+}
+
+static void test_empty()
+{
+	prefix_table t;
+	t.build();
+	TEST_CHECK(find(t, "") == -1);
+	TEST_CHECK(find(t, "abc") == -1);
+}
+
+static void test_longest_match()
+{
+	prefix_table t;
+	t.add("a", 1);
+	t.add("abc", 3);
+	t.add("ab", 2);
+	t.add("b", 4);
+	t.build();
+
+	TEST_CHECK(find(t, "") == -1);
+	TEST_CHECK(find(t, "a") == 1);
+	TEST_CHECK(find(t, "ax") == 1);
+	TEST_CHECK(find(t, "ab") == 2);
+	TEST_CHECK(find(t, "abx") == 2);
+	TEST_CHECK(find(t, "abc") == 3);
+	TEST_CHECK(find(t, "abcd") == 3);
+	TEST_CHECK(find(t, "b") == 4);
+	TEST_CHECK(find(t, "ba") == 4);
+	TEST_CHECK(find(t, "c") == -1);
+
+	// only keylen bytes are looked at
+	TEST_CHECK(t.find("abc", 1) == 1);
+}
+
+static void test_root_and_duplicates()
+{
+	prefix_table t;
+	t.add("", 0);
+	t.add("x", 5);
+	t.add("x", 6);
+	t.build();
+
+	TEST_CHECK(find(t, "") == 0);
+	TEST_CHECK(find(t, "zzz") == 0);
+	TEST_CHECK(find(t, "x") == 6);
+	TEST_CHECK(find(t, "xy") == 6);
+}
+
+static void test_high_bytes()
+{
+	// labels are compared as unsigned bytes
+	prefix_table t;
+	t.add("\x7f", 1);
+	t.add("\x80" "a", 2);
+	t.add("\xff", 3);
+	t.add("a\xff", 4);
+	t.build();
+
+	TEST_CHECK(find(t, "\x7f" "z") == 1);
+	TEST_CHECK(find(t, "\x80" "a") == 2);
+	TEST_CHECK(find(t, "\x80" "b") == -1);
+	TEST_CHECK(find(t, "\xff\xff") == 3);
+	TEST_CHECK(find(t, "a\xff") == 4);
+	TEST_CHECK(find(t, "a\xfe") == -1);
+}
+
+static void test_rebuild()
+{
+	prefix_table t;
+	t.add("a", 1);
+	t.build();
+	t.add("ab", 2);
+	t.build();
+	TEST_CHECK(find(t, "a") == 1);
+	TEST_CHECK(find(t, "abc") == 2);
+}
+
+// compares with a linear scan of the prefixes
+static void test_random()
+{
+	const char alphabet[] = "ab\x80\xff";
+	unsigned int seed = 1;
+	for(int round=0; round < 50; ++round) {
+		std::vector<std::pair<std::string, int> > prefixes;
+		prefix_table t;
+		const int num = rand_r(&seed) % 40;
+		for(int i=0; i < num; ++i) {
+			std::string p;
+			const int len = rand_r(&seed) % 5;
+			for(int j=0; j < len; ++j) {
+				p += alphabet[rand_r(&seed) % 4];
+			}
+			prefixes.push_back(std::make_pair(p, i));
+			t.add(p, i);
+		}
+		t.build();
+
+		for(int k=0; k < 200; ++k) {
+			std::string key;
+			const int len = rand_r(&seed) % 7;
+			for(int j=0; j < len; ++j) {
+				key += alphabet[rand_r(&seed) % 4];
+			}
+
+			int expect = -1;
+			size_t longest = 0;
+			for(size_t i=0; i < prefixes.size(); ++i) {
+				const std::string& p(prefixes[i].first);
+				if(key.compare(0, p.size(), p) == 0 &&
+						(expect < 0 || p.size() >= longest)) {
+					expect = prefixes[i].second;
+					longest = p.size();
+				}
+			}
+			TEST_CHECK(t.find(key.data(), key.size()) == expect);
+		}
+	}
+}
+
+int main(void)
+{
+	test_empty();
+	test_longest_match();
+	test_root_and_duplicates();
+	test_high_bytes();
+	test_rebuild();
+	test_random();
+	return 0;
+}
+
@@ -0,0 +1,140 @@
+//
+// mp::wavy::wheel test
+//
+// Copyright (C) 2008-2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "mp/wavy/core.h"
+#include "test/test.h"
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace mp::wavy;
+
+// a deadline fires later than this only if the machine is very busy
+static const uint64_t SLACK_MSEC = 500;
+
+static uint64_t now_msec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct firing {
+	firing() : count(0), at(0) { }
+	volatile int count;
+	volatile uint64_t at;
+};
+
+static void fired(firing* f)
+{
+	f->at = now_msec();
+	__sync_add_and_fetch(&f->count, 1);
+}
+
+// waits until the firings are counted or the timeout passes
+static void wait_for(const std::vector<firing>& fs, uint64_t timeout_msec)
+{
+	const uint64_t until = now_msec() + timeout_msec;
+	while(now_msec() < until) {
+		bool done = true;
+		for(size_t i=0; i < fs.size(); ++i) {
+			if(fs[i].count == 0) { done = false; }
+		}
+		if(done) { return; }
+		usleep(1000);
+	}
+}
+
+// deadlines on each level of the wheel fire once, in order and on time
+static void test_expire(core* c)
+{
+	const unsigned int msecs[] = {0, 1, 5, 50, 255, 256, 300, 700};
+	const size_t num = sizeof(msecs) / sizeof(msecs[0]);
+	std::vector<firing> fs(num);
+
+	const uint64_t start = now_msec();
+	for(size_t i=0; i < num; ++i) {
+		c->deadline_event(msecs[i], mp::bind(&fired, &fs[i]));
+	}
+	wait_for(fs, 700 + SLACK_MSEC * 2);
+
+	for(size_t i=0; i < num; ++i) {
+		TEST_CHECK(fs[i].count == 1);
+		TEST_CHECK(fs[i].at >= start + msecs[i]);
+		TEST_CHECK(fs[i].at <= start + msecs[i] + SLACK_MSEC);
+		if(i > 0 && msecs[i] > msecs[i-1] + 1) {
+			TEST_CHECK(fs[i].at >= fs[i-1].at);
+		}
+	}
+}
+
+static void test_cancel(core* c)
+{
+	std::vector<firing> fs(2);
+	shared_deadline cancelled = c->deadline_event(50, mp::bind(&fired, &fs[0]));
+	shared_deadline kept = c->deadline_event(10, mp::bind(&fired, &fs[1]));
+
+	TEST_CHECK(c->cancel_deadline(cancelled));
+	TEST_CHECK(!c->cancel_deadline(cancelled));  // twice
+
+	usleep(150 * 1000);
+	TEST_CHECK(fs[0].count == 0);
+	TEST_CHECK(fs[1].count == 1);
+	TEST_CHECK(!c->cancel_deadline(kept));  // already fired
+	TEST_CHECK(!c->cancel_deadline(shared_deadline()));
+}
+
+// many deadlines added from several threads fire exactly once
+static void add_many(core* c, std::vector<firing>* fs, size_t begin, size_t end)
+{
+	for(size_t i=begin; i < end; ++i) {
+		c->deadline_event(i % 200, mp::bind(&fired, &(*fs)[i]));
+	}
+}
+
+static void test_many(core* c)
+{
+	std::vector<firing> fs(20000);
+	for(size_t t=0; t < 4; ++t) {
+		c->submit(&add_many, c, &fs, t * 5000, (t+1) * 5000);
+	}
+	wait_for(fs, 200 + SLACK_MSEC * 4);
+
+	for(size_t i=0; i < fs.size(); ++i) {
+		TEST_CHECK(fs[i].count == 1);
+	}
+	usleep(50 * 1000);
+	for(size_t i=0; i < fs.size(); ++i) {
+		TEST_CHECK(fs[i].count == 1);
+	}
+}
+
+int main(void)
+{
+	core c;
+	c.add_thread(4);
+
+	test_expire(&c);
+	test_cancel(&c);
+	test_many(&c);
+
+	c.end();
+	c.join();
+	return 0;
+}
+
@@ -0,0 +1,2838 @@
+//
+// memxy::upstream - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#define __STDC_LIMIT_MACROS
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#include "upstream.h"
+#include "wavy_core.h"
+#include "exception.h"
+#include "stats.h"
+#include "binary_response.h"
+#include "memproto/memproto.h"
+#include <cclog/cclog.h>
+#include <mp/stream_buffer.h>
+#include <stdexcept>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+
+#ifndef UPSTREAM_INITIAL_ALLOCATION_SIZE
+#define UPSTREAM_INITIAL_ALLOCATION_SIZE (32*1024)
+#endif
+
+#ifndef UPSTREAM_RESERVE_SIZE
+#define UPSTREAM_RESERVE_SIZE (4*1024)
+#endif
+
+#ifndef UPSTREAM_CONNECT_TIMEOUT
+#define UPSTREAM_CONNECT_TIMEOUT 1000
+#endif
+
+#ifndef UPSTREAM_LINE_MAX
+#define UPSTREAM_LINE_MAX 1024
+#endif
+
+// largest value accepted in a VALUE line; the largest item size of
+// memcached (-I) is 1GB
+#ifndef UPSTREAM_VALUE_MAX
+#define UPSTREAM_VALUE_MAX (1024*1024*1024)
+#endif
+
+#ifndef UPSTREAM_POOL_SIZE
+#define UPSTREAM_POOL_SIZE 1
+#endif
+
+#ifndef UPSTREAM_STREAM_CONNECTIONS
+#define UPSTREAM_STREAM_CONNECTIONS 2
+#endif
+
+#if UPSTREAM_STREAM_CONNECTIONS < 1
+#error UPSTREAM_STREAM_CONNECTIONS must be positive
+#endif
+
+#ifndef UPSTREAM_STREAM_QUEUE_SIZE
+#define UPSTREAM_STREAM_QUEUE_SIZE (256*1024)
+#endif
+
+#ifndef UPSTREAM_PIPELINE_DEPTH
+#define UPSTREAM_PIPELINE_DEPTH 64
+#endif
+
+#ifndef UPSTREAM_COALESCE_WINDOW
+#define UPSTREAM_COALESCE_WINDOW 0
+#endif
+
+#ifndef UPSTREAM_COALESCE_MAX
+#define UPSTREAM_COALESCE_MAX 32
+#endif
+
+#ifndef UPSTREAM_WRITE_COALESCING
+#define UPSTREAM_WRITE_COALESCING true
+#endif
+
+#ifndef UPSTREAM_WRITEV_MAX
+#define UPSTREAM_WRITEV_MAX 64
+#endif
+
+#ifndef UPSTREAM_NOREPLY_QUEUE_SIZE
+#define UPSTREAM_NOREPLY_QUEUE_SIZE (16*1024*1024)
+#endif
+
+#ifndef UPSTREAM_SPLICE_THRESHOLD
+#ifdef __linux__
+#define UPSTREAM_SPLICE_THRESHOLD (64*1024)
+#else
+#define UPSTREAM_SPLICE_THRESHOLD 0
+#endif
+#endif
+
+#ifndef UPSTREAM_TIMEOUT
+#define UPSTREAM_TIMEOUT 1000  // msec
+#endif
+
+#ifndef UPSTREAM_MAX_INFLIGHT
+#define UPSTREAM_MAX_INFLIGHT 0
+#endif
+
+#ifndef UPSTREAM_MAX_WAITING
+#define UPSTREAM_MAX_WAITING 0
+#endif
+
+#ifndef UPSTREAM_EJECT_FAILURES
+#define UPSTREAM_EJECT_FAILURES 5
+#endif
+
+#ifndef UPSTREAM_EJECT_BACKOFF
+#define UPSTREAM_EJECT_BACKOFF 1000  // msec
+#endif
+
+#ifndef UPSTREAM_EJECT_BACKOFF_MAX
+#define UPSTREAM_EJECT_BACKOFF_MAX 60000  // msec
+#endif
+
+#ifndef UPSTREAM_LATENCY_INITIAL
+#define UPSTREAM_LATENCY_INITIAL 1000  // usec
+#endif
+
+#ifndef UPSTREAM_LATENCY_RATE
+#define UPSTREAM_LATENCY_RATE 0.02
+#endif
+
+// weight of a new sample in the moving average of the response time
+#ifndef UPSTREAM_LATENCY_EWMA_WEIGHT
+#define UPSTREAM_LATENCY_EWMA_WEIGHT 0.1
+#endif
+
+// the moving average halves every this many usec without a response, so
+// that a server which has looked slow is tried again
+#ifndef UPSTREAM_LATENCY_HALF_LIFE
+#define UPSTREAM_LATENCY_HALF_LIFE 1000000
+#endif
+
+namespace memxy {
+namespace upstream {
+
+
+static volatile size_t s_pipeline_depth = UPSTREAM_PIPELINE_DEPTH;
+
+void set_pipeline_depth(size_t depth)
+{
+	if(depth == 0) { depth = 1; }
+	s_pipeline_depth = depth;
+}
+
+size_t get_pipeline_depth()
+{
+	return s_pipeline_depth;
+}
+
+static volatile size_t s_pool_size = UPSTREAM_POOL_SIZE;
+
+void set_pool_size(size_t num)
+{
+	if(num == 0) { num = 1; }
+	s_pool_size = num;
+}
+
+size_t get_pool_size()
+{
+	return s_pool_size;
+}
+
+static volatile size_t s_splice_threshold = UPSTREAM_SPLICE_THRESHOLD;
+
+void set_splice_threshold(size_t bytes)
+{
+#ifdef __linux__
+	s_splice_threshold = bytes;
+#endif
+}
+
+static volatile unsigned int s_coalesce_window = UPSTREAM_COALESCE_WINDOW;
+static volatile size_t s_coalesce_max = UPSTREAM_COALESCE_MAX;
+
+void set_coalesce(unsigned int window_usec, size_t max_keys)
+{
+	if(max_keys < 2) { window_usec = 0; }
+	s_coalesce_max = max_keys;
+	s_coalesce_window = window_usec;
+}
+
+static volatile bool s_write_coalescing = UPSTREAM_WRITE_COALESCING;
+
+void set_write_coalescing(bool enable)
+{
+	s_write_coalescing = enable;
+}
+
+static stats::counter s_writes("upstream_writes");
+static stats::counter s_commands_written("upstream_commands_written");
+
+static stats::counter s_cancelled("upstream_cancelled");
+static stats::counter s_discarded_values("upstream_discarded_values");
+
+static volatile size_t s_noreply_limit = UPSTREAM_NOREPLY_QUEUE_SIZE;
+static volatile overflow s_noreply_overflow = OVERFLOW_DROP_NEWEST;
+
+void set_noreply_queue_size(size_t bytes)
+{
+	s_noreply_limit = bytes;
+}
+
+void set_noreply_overflow(overflow policy)
+{
+	s_noreply_overflow = policy;
+}
+
+static stats::counter s_noreply_queued("upstream_noreply_queued");
+static stats::counter s_noreply_dropped("upstream_noreply_dropped");
+static stats::counter s_noreply_failed("upstream_noreply_failed");
+static stats::gauge s_noreply_queue_bytes("upstream_noreply_queue_bytes");
+
+static volatile unsigned int s_timeout = UPSTREAM_TIMEOUT;
+
+void set_timeout(unsigned int msec)
+{
+	s_timeout = msec;
+}
+
+static stats::counter s_timeouts("upstream_timeouts");
+
+static stats::counter s_value_streams("upstream_value_streams");
+static stats::counter s_value_streams_aborted("upstream_value_streams_aborted");
+static stats::counter s_value_streams_paused("upstream_value_streams_paused");
+
+static volatile size_t s_max_inflight = UPSTREAM_MAX_INFLIGHT;
+static volatile size_t s_max_waiting = UPSTREAM_MAX_WAITING;
+
+static stats::gauge s_inflight("upstream_inflight");
+static stats::gauge s_waiting("upstream_waiting");
+static stats::gauge s_inflight_limit("upstream_inflight_limit");
+static stats::gauge s_waiting_limit("upstream_waiting_limit");
+static stats::counter s_rejected("upstream_rejected");
+
+void set_bulkhead(size_t max_inflight, size_t max_waiting)
+{
+	s_max_inflight = max_inflight;
+	s_max_waiting = max_waiting;
+	s_inflight_limit.set(max_inflight);
+	s_waiting_limit.set(max_waiting);
+}
+
+static volatile unsigned int s_eject_failures = UPSTREAM_EJECT_FAILURES;
+static volatile unsigned int s_eject_latency = 0;
+
+void set_ejection(unsigned int failures, unsigned int latency_usec)
+{
+	s_eject_failures = failures;
+	s_eject_latency = latency_usec;
+}
+
+static stats::counter s_ejections("upstream_ejections");
+static stats::counter s_readmissions("upstream_readmissions");
+static stats::gauge s_ejected("upstream_ejected");
+
+static volatile protocol s_protocol = PROTOCOL_TEXT;
+
+void set_protocol(protocol proto)
+{
+	s_protocol = proto;
+}
+
+
+static uint64_t monotonic_usec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// returns the moving average of the response time after idle usec
+// without a response
+static double decay_latency(double avg, uint64_t idle)
+{
+	const uint64_t halves = idle / UPSTREAM_LATENCY_HALF_LIFE;
+	if(halves == 0) {
+		return avg;
+	}
+	avg = ldexp(avg, -(int)std::min(halves, (uint64_t)64));
+	return avg < 1.0 ? 1.0 : avg;
+}
+
+static inline void put_be16(char* p, uint16_t v)
+{
+	v = htons(v);
+	memcpy(p, &v, 2);
+}
+
+static inline void put_be32(char* p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, 4);
+}
+
+// writes a request header of the binary protocol;
+// the opaque is returned as is by the server
+static char* put_header(char* p, uint8_t opcode,
+		size_t keylen, uint8_t extlen, size_t bodylen, uint32_t opaque)
+{
+	memset(p, 0, MEMPROTO_HEADER_SIZE);
+	p[0] = (char)MEMPROTO_REQUEST;
+	p[1] = (char)opcode;
+	put_be16(p+2, (uint16_t)keylen);
+	p[4] = (char)extlen;
+	put_be32(p+8, (uint32_t)bodylen);
+	memcpy(p+12, &opaque, 4);
+	return p + MEMPROTO_HEADER_SIZE;
+}
+
+
+// Forwards the response to req unless the deadline expires before it
+// starts. The command stays queued or in flight after the timeout and
+// its response is discarded.
+class timed_request : public request,
+		public mp::enable_shared_from_this<timed_request> {
+public:
+	timed_request(shared_server sv, shared_request req) :
+		m_server(sv), m_req(req), m_state(PENDING) { }
+
+	// the response may already be received
+	void start(unsigned int msec)
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		if(m_state == PENDING) {
+			m_deadline = core::deadline_event(msec,
+					mp::bind(&timed_request::expire, shared_from_this()));
+		}
+	}
+
+	void value(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* val, size_t vallen,
+			chunk* ck)
+	{
+		if(respond()) {
+			m_req->value(key, keylen, flags, cas, val, vallen, ck);
+		}
+	}
+
+	bool accept_splice(const char* key, size_t keylen)
+	{
+		return respond() && m_req->accept_splice(key, keylen);
+	}
+
+	void value_splice(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* head, size_t headlen, chunk* ck,
+			int pipefd, size_t pipelen)
+	{
+		m_req->value_splice(key, keylen, flags, cas,
+				head, headlen, ck, pipefd, pipelen);
+	}
+
+	void complete(status st)
+	{
+		if(respond()) {
+			m_req->complete(st);
+		}
+	}
+
+	bool cancelled()
+	{
+		shared_request req;
+		{
+			mp::pthread_scoped_lock lk(m_mutex);
+			if(m_state == EXPIRED) {
+				return true;
+			}
+			req = m_req;
+		}
+		return req->cancelled();
+	}
+
+private:
+	// returns false if the deadline has expired
+	bool respond()
+	{
+		if(m_state == RESPONDING) {
+			return true;
+		}
+		core::shared_deadline dl;
+		{
+			mp::pthread_scoped_lock lk(m_mutex);
+			if(m_state == EXPIRED) {
+				return false;
+			}
+			m_state = RESPONDING;
+			dl.swap(m_deadline);
+		}
+		core::cancel_deadline(dl);
+		return true;
+	}
+
+	void expire()
+	{
+		// release the client's resources now
+		shared_request req;
+		{
+			mp::pthread_scoped_lock lk(m_mutex);
+			if(m_state != PENDING) {
+				return;
+			}
+			m_state = EXPIRED;
+			req.swap(m_req);
+		}
+		s_timeouts.incr();
+		{
+			mp::pthread_scoped_lock lk(m_server->m_mutex);
+			m_server->record_result(true);
+		}
+
+		req->complete(STATUS_TIMEOUT);
+	}
+
+	shared_server m_server;
+	shared_request m_req;
+	core::shared_deadline m_deadline;
+
+	mp::pthread_mutex m_mutex;
+	enum {
+		PENDING,
+		RESPONDING,
+		EXPIRED,
+	};
+	volatile int m_state;
+};
+
+// Replaces the request with a timed_request. The timer is started
+// after the command is queued, so that it never fires for a command
+// which failed to be queued.
+class timeout_scope {
+public:
+	timeout_scope(server* sv, shared_request* req) : m_msec(s_timeout)
+	{
+		if(*req && m_msec > 0) {
+			m_req.reset(new timed_request(sv->shared_from_this(), *req));
+			*req = m_req;
+		}
+	}
+
+	void start()
+	{
+		if(m_req) { m_req->start(m_msec); }
+	}
+
+private:
+	unsigned int m_msec;
+	mp::shared_ptr<timed_request> m_req;
+
+private:
+	timeout_scope();
+	timeout_scope(const timeout_scope&);
+};
+
+
+// Holds the commands of a channel which have it in entry::after until it
+// is opened by server::open_fence().
+struct stream_fence {
+	explicit stream_fence(size_t ch) : channel(ch), opened(false) { }
+	const size_t channel;  // the queue the commands wait in
+	bool opened;           // guarded by server::m_mutex
+};
+
+
+// Holds a stream channel checked out by server::set_stream() until the
+// set is answered or failed, and the commands of the key queued after it.
+class stream_request : public request {
+public:
+	stream_request(shared_server sv, size_t ch,
+			mp::shared_ptr<stream_fence> stored, shared_request req) :
+		m_server(sv), m_channel(ch), m_stored(stored), m_req(req),
+		m_returned(false) { }
+
+	~stream_request()
+	{
+		if(!m_returned) {
+			m_server->return_stream(m_channel);
+			m_server->open_fence(m_stored);
+		}
+	}
+
+	void complete(status st)
+	{
+		m_returned = true;
+		m_server->return_stream(m_channel);
+		m_server->open_fence(m_stored);
+		if(m_req) {
+			m_req->complete(st);
+		}
+	}
+
+	bool cancelled()
+	{
+		return m_req && m_req->cancelled();
+	}
+
+private:
+	shared_server m_server;
+	size_t m_channel;
+	mp::shared_ptr<stream_fence> m_stored;
+	shared_request m_req;
+	bool m_returned;
+
+private:
+	stream_request();
+	stream_request(const stream_request&);
+};
+
+
+// Opens the fence of a streamed set when the probe queued before it to
+// the channel of the key is answered or failed; the commands sent to the
+// channel earlier are done by then.
+class fence_request : public request {
+public:
+	fence_request(shared_server sv, mp::shared_ptr<stream_fence> f) :
+		m_server(sv), m_fence(f), m_opened(false) { }
+
+	~fence_request()
+	{
+		if(!m_opened) {
+			m_server->open_fence(m_fence);
+		}
+	}
+
+	void complete(status st)
+	{
+		m_opened = true;
+		m_server->open_fence(m_fence);
+	}
+
+private:
+	shared_server m_server;
+	mp::shared_ptr<stream_fence> m_fence;
+	bool m_opened;
+
+private:
+	fence_request();
+	fence_request(const fence_request&);
+};
+
+
+// merges single-key gets of several clients into one multi-get
+// and fans the values out to them
+class get_batch : public request {
+public:
+	get_batch() : m_pos(0) { }
+
+	void add(const char* key, size_t keylen, shared_request req)
+	{
+		m_waiters.push_back(waiter());
+		waiter& w(m_waiters.back());
+		w.key.assign(key, keylen);
+		w.req = req;
+	}
+
+	size_t size() const { return m_waiters.size(); }
+
+	void keys(std::vector<const char*>* keys, std::vector<size_t>* keylens) const
+	{
+		keys->reserve(m_waiters.size());
+		keylens->reserve(m_waiters.size());
+		for(waiters_t::const_iterator it(m_waiters.begin()),
+				it_end(m_waiters.end()); it != it_end; ++it) {
+			keys->push_back(it->key.data());
+			keylens->push_back(it->key.size());
+		}
+	}
+
+	void value(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* val, size_t vallen,
+			chunk* ck)
+	{
+		waiter* w = find(key, keylen);
+		if(w) {
+			++m_pos;
+			if(!w->req->cancelled()) {
+				w->req->value(key, keylen, flags, cas, val, vallen, ck);
+			}
+		}
+	}
+
+	bool accept_splice(const char* key, size_t keylen)
+	{
+		waiter* w = find(key, keylen);
+		return w && w->req->accept_splice(key, keylen);
+	}
+
+	void value_splice(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* head, size_t headlen, chunk* ck,
+			int pipefd, size_t pipelen)
+	{
+		waiter* w = find(key, keylen);
+		if(!w) {
+			::close(pipefd);
+			return;
+		}
+		++m_pos;
+		w->req->value_splice(key, keylen, flags, cas,
+				head, headlen, ck, pipefd, pipelen);
+	}
+
+	void complete(status st)
+	{
+		for(waiters_t::iterator it(m_waiters.begin()),
+				it_end(m_waiters.end()); it != it_end; ++it) {
+			try {
+				it->req->complete(st);
+			} catch (...) { }
+		}
+	}
+
+	bool cancelled()
+	{
+		for(waiters_t::iterator it(m_waiters.begin()),
+				it_end(m_waiters.end()); it != it_end; ++it) {
+			if(!it->req->cancelled()) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+private:
+	struct waiter {
+		std::string key;
+		shared_request req;
+	};
+
+	// values are returned in the order of the keys;
+	// moves m_pos to the waiter
+	waiter* find(const char* key, size_t keylen)
+	{
+		for(; m_pos < m_waiters.size(); ++m_pos) {
+			waiter& w(m_waiters[m_pos]);
+			if(w.key.size() == keylen && memcmp(w.key.data(), key, keylen) == 0) {
+				return &w;
+			}
+		}
+		return NULL;
+	}
+
+	typedef std::vector<waiter> waiters_t;
+	waiters_t m_waiters;
+	size_t m_pos;
+};
+
+
+class connection : public core::handler {
+public:
+	connection(int fd, shared_server sv, size_t ch);
+	~connection();
+
+public:
+	void read_event();
+
+private:
+	size_t process(const char* data, size_t size);
+	void finish(status st);
+
+	size_t process_binary(const char* data, size_t size);
+	bool find_inflight(uint32_t opaque, shared_request* req);
+	bool finish_binary(uint32_t opaque, status st);
+
+	bool start_splice(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* head, size_t headlen, size_t pipelen);
+	bool splice_body();
+	bool receive_body();
+	void splice_fallback();
+
+	struct splicing;
+
+	class buffer_chunk : public chunk {
+	public:
+		buffer_chunk(mp::stream_buffer* buf) : m_buf(buf) { }
+		mp::stream_buffer::reference* retain() { return m_buf->release(); }
+	private:
+		mp::stream_buffer* m_buf;
+	};
+
+private:
+	shared_server m_server;
+	const size_t m_channel;
+	mp::stream_buffer m_buffer;
+
+	// the entry which response is being received;
+	// accessed only from read_event
+	entry m_current;
+	bool m_has_current;
+
+	// the value which body is being moved to a pipe
+	std::auto_ptr<splicing> m_splice;
+	bool m_expect_trailer;
+
+	// the binary entry which values were received last;
+	// it stays in m_inflight until its last response
+	bool m_has_last;
+	uint32_t m_last_opaque;
+	shared_request m_last_req;
+
+	// guarded by m_server->m_mutex
+	std::deque<entry> m_inflight;
+	size_t m_outstanding;
+
+	// the value being sent after its command; guarded by m_server->m_mutex
+	shared_value_stream m_stream;
+
+	friend class server;
+	friend class value_stream;
+
+private:
+	connection();
+	connection(const connection&);
+};
+
+
+struct connection::splicing {
+	splicing() : body(NULL)
+	{
+		pipefd[0] = -1;
+		pipefd[1] = -1;
+	}
+
+	~splicing()
+	{
+		if(pipefd[0] >= 0) { ::close(pipefd[0]); }
+		if(pipefd[1] >= 0) { ::close(pipefd[1]); }
+		delete body;
+	}
+
+	std::string key;
+	uint32_t flags;
+	uint64_t cas;
+
+	// the part of the value received before splicing started
+	const char* head;
+	size_t headlen;
+	std::auto_ptr<mp::stream_buffer::reference> ref;
+
+	int pipefd[2];
+	size_t pipelen;
+	size_t left;
+
+	// the whole value is received here instead if the pipe got full
+	mp::stream_buffer* body;
+};
+
+
+connection::connection(int fd, shared_server sv, size_t ch) :
+	core::handler(fd),
+	m_server(sv),
+	m_channel(ch),
+	m_buffer(UPSTREAM_INITIAL_ALLOCATION_SIZE),
+	m_has_current(false),
+	m_expect_trailer(false),
+	m_has_last(false),
+	m_last_opaque(0),
+	m_outstanding(0)
+{ }
+
+connection::~connection()
+{
+	std::deque<entry> failed;
+	bool reconnect;
+	bool aborted = false;
+	std::vector<mp::shared_ptr<connection> > resumed;  // released after unlocking
+	{
+		mp::pthread_scoped_lock lk(m_server->m_mutex);
+		if(m_stream) {
+			aborted = m_stream->detach();
+		}
+		failed.swap(m_inflight);
+		m_server->m_inflight -= m_outstanding;
+		s_inflight.decr(m_outstanding);
+		m_outstanding = 0;
+		m_server->resume_starved(&resumed);
+		server::channel& cn(m_server->m_channels[m_channel]);
+		reconnect = !cn.queue.empty() && !cn.connecting;
+		if(reconnect) { cn.connecting = true; }
+		if(!m_server->m_retired && !aborted &&
+				(m_has_current || !failed.empty())) {
+			// closed while waiting for responses
+			m_server->record_result(true);
+		}
+	}
+
+	if(m_has_current && m_current.req) {
+		m_current.req->complete(STATUS_CONNECTION_ERROR);
+	}
+
+	for(std::deque<entry>::iterator it(failed.begin()), it_end(failed.end());
+			it != it_end; ++it) {
+		::free(it->cmd);
+		if(it->req) {
+			it->req->complete(STATUS_CONNECTION_ERROR);
+		} else {
+			s_noreply_failed.incr();
+		}
+	}
+
+	if(reconnect) {
+		m_server->connect(m_channel);
+	}
+}
+
+
+void connection::read_event()
+try {
+	if(m_splice.get() && !splice_body()) {
+		return;
+	}
+
+	m_buffer.reserve_buffer(UPSTREAM_RESERVE_SIZE);
+
+	ssize_t rl = ::read(fd(), m_buffer.buffer(), m_buffer.buffer_capacity());
+	if(rl <= 0) {
+		if(rl == 0) { throw connection_closed_error(); }
+		if(errno == EAGAIN || errno == EINTR) { return; }
+		else { throw connection_broken_error(); }
+	}
+
+	m_buffer.buffer_consumed(rl);
+
+	while(m_buffer.data_size() > 0) {
+		size_t off = m_server->m_binary ?
+			process_binary((const char*)m_buffer.data(), m_buffer.data_size()) :
+			process((const char*)m_buffer.data(), m_buffer.data_size());
+		if(off == 0) {
+			break;
+		}
+		m_buffer.data_used(off);
+
+		if(m_splice.get() && !splice_body()) {
+			break;
+		}
+	}
+
+	// refill the pipeline once for all responses received by this read
+	std::vector<mp::shared_ptr<connection> > resumed;  // released after unlocking
+	mp::pthread_scoped_lock lk(m_server->m_mutex);
+	m_server->send_next(this);
+	m_server->resume_starved(&resumed);
+	lk.unlock();
+
+} catch(connection_error& e) {
+	LOG_DEBUG("upstream: ",e.what());
+	throw;
+} catch (std::exception& e) {
+	LOG_WARN("upstream protocol error: ",e.what());
+	throw;
+} catch (...) {
+	LOG_WARN("upstream protocol error: unknown error");
+	throw;
+}
+
+
+#define LINE_IS(line, linelen, str) \
+	((linelen) == sizeof(str)-1 && memcmp(line, str, sizeof(str)-1) == 0)
+
+#define LINE_STARTS(line, linelen, str) \
+	((linelen) >= sizeof(str)-1 && memcmp(line, str, sizeof(str)-1) == 0)
+
+static bool parse_error_line(const char* line, size_t linelen, status* st)
+{
+	if(LINE_IS(line, linelen, "ERROR")) {
+		*st = STATUS_ERROR;
+	} else if(LINE_STARTS(line, linelen, "CLIENT_ERROR")) {
+		*st = STATUS_CLIENT_ERROR;
+	} else if(LINE_STARTS(line, linelen, "SERVER_ERROR")) {
+		*st = STATUS_SERVER_ERROR;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static const char* parse_token(const char* p, const char* end,
+		const char** tok, size_t* toklen)
+{
+	while(p < end && *p == ' ') { ++p; }
+	*tok = p;
+	while(p < end && *p != ' ') { ++p; }
+	*toklen = p - *tok;
+	return p;
+}
+
+static bool parse_uint64(const char* tok, size_t toklen, uint64_t* result)
+{
+	if(toklen == 0 || toklen > 20) { return false; }
+	uint64_t n = 0;
+	for(size_t i=0; i < toklen; ++i) {
+		if(tok[i] < '0' || '9' < tok[i]) { return false; }
+		n = n*10 + (tok[i] - '0');
+	}
+	*result = n;
+	return true;
+}
+
+// returns the number of consumed bytes, or 0 if more data is required
+size_t connection::process(const char* data, size_t size)
+{
+	if(m_expect_trailer) {
+		// terminates the spliced value
+		if(size < 2) {
+			return 0;
+		}
+		if(data[0] != '\r' || data[1] != '\n') {
+			throw std::runtime_error("invalid VALUE data block");
+		}
+		m_expect_trailer = false;
+		return 2;
+	}
+
+	const char* const endl = (const char*)memchr(data, '\n', size);
+	if(!endl) {
+		if(size > UPSTREAM_LINE_MAX) {
+			throw std::runtime_error("too long response line");
+		}
+		return 0;
+	}
+
+	if(endl == data || endl[-1] != '\r') {
+		throw std::runtime_error("invalid response line");
+	}
+
+	const char* const line = data;
+	const size_t linelen = endl - data - 1;
+	const size_t consumed = linelen + 2;
+
+	if(!m_has_current) {
+		mp::pthread_scoped_lock lk(m_server->m_mutex);
+		if(m_inflight.empty()) {
+			throw std::runtime_error("unexpected response");
+		}
+		m_current = m_inflight.front();
+		m_inflight.pop_front();
+		m_has_current = true;
+	}
+
+	status st;
+
+	if(m_current.retrieval) {
+		if(LINE_STARTS(line, linelen, "VALUE ")) {
+			// VALUE <key> <flags> <bytes> [<cas unique>]
+			const char* const end = line + linelen;
+			const char* key;   size_t keylen;
+			const char* tok;   size_t toklen;
+			uint64_t flags, bytes, cas = 0;
+
+			const char* p = parse_token(line + 6, end, &key, &keylen);
+
+			p = parse_token(p, end, &tok, &toklen);
+			if(!parse_uint64(tok, toklen, &flags)) {
+				throw std::runtime_error("invalid VALUE flags");
+			}
+
+			p = parse_token(p, end, &tok, &toklen);
+			if(!parse_uint64(tok, toklen, &bytes) || bytes > UPSTREAM_VALUE_MAX) {
+				throw std::runtime_error("invalid VALUE bytes");
+			}
+
+			p = parse_token(p, end, &tok, &toklen);
+			if(toklen > 0 && !parse_uint64(tok, toklen, &cas)) {
+				throw std::runtime_error("invalid VALUE cas");
+			}
+
+			if(keylen == 0) {
+				throw std::runtime_error("invalid VALUE key");
+			}
+
+			if(size - consumed < 2 || size - consumed - 2 < bytes) {
+				const size_t headlen = size - consumed;
+				if(headlen < bytes && s_splice_threshold > 0 &&
+						bytes >= s_splice_threshold && m_current.req &&
+						!m_current.req->cancelled() &&
+						m_current.req->accept_splice(key, keylen) &&
+						start_splice(key, keylen, (uint32_t)flags, cas,
+							data + consumed, headlen, bytes - headlen)) {
+					return size;
+				}
+				return 0;
+			}
+
+			const char* const val = data + consumed;
+			if(val[bytes] != '\r' || val[bytes+1] != '\n') {
+				throw std::runtime_error("invalid VALUE data block");
+			}
+
+			if(m_current.req) {
+				if(m_current.req->cancelled()) {
+					s_discarded_values.incr();
+				} else {
+					buffer_chunk ck(&m_buffer);
+					m_current.req->value(key, keylen,
+							(uint32_t)flags, cas, val, bytes, &ck);
+				}
+			}
+
+			return consumed + bytes + 2;
+
+		} else if(LINE_IS(line, linelen, "END")) {
+			st = STATUS_SUCCESS;
+
+		} else if(!parse_error_line(line, linelen, &st)) {
+			throw std::runtime_error("unknown response");
+		}
+
+	} else {
+		if(LINE_IS(line, linelen, "STORED") ||
+				LINE_IS(line, linelen, "DELETED") ||
+				LINE_STARTS(line, linelen, "VERSION ")) {
+			// VERSION answers the probe of a streamed set
+			st = STATUS_SUCCESS;
+		} else if(LINE_IS(line, linelen, "NOT_STORED")) {
+			st = STATUS_NOT_STORED;
+		} else if(LINE_IS(line, linelen, "EXISTS")) {
+			st = STATUS_EXISTS;
+		} else if(LINE_IS(line, linelen, "NOT_FOUND")) {
+			st = STATUS_NOT_FOUND;
+		} else if(!parse_error_line(line, linelen, &st)) {
+			throw std::runtime_error("unknown response");
+		}
+	}
+
+	finish(st);
+	return consumed;
+}
+
+bool connection::start_splice(const char* key, size_t keylen,
+		uint32_t flags, uint64_t cas,
+		const char* head, size_t headlen, size_t pipelen)
+{
+#ifdef __linux__
+	std::auto_ptr<splicing> sp(new splicing());
+
+	if(::pipe(sp->pipefd) < 0) {
+		return false;
+	}
+
+	// socket buffers may not fill pages of the pipe
+	if(::fcntl(sp->pipefd[1], F_SETPIPE_SZ, pipelen*2) < 0) {
+		int sz = ::fcntl(sp->pipefd[1], F_SETPIPE_SZ, pipelen);
+		if(sz < 0 || (size_t)sz < pipelen) {
+			return false;
+		}
+	}
+
+	sp->key.assign(key, keylen);
+	sp->flags = flags;
+	sp->cas = cas;
+	sp->head = head;
+	sp->headlen = headlen;
+	sp->ref.reset(m_buffer.release());
+	sp->pipelen = pipelen;
+	sp->left = pipelen;
+
+	m_splice = sp;
+	return true;
+#else
+	return false;
+#endif
+}
+
+// returns false if more data is required
+bool connection::splice_body()
+{
+	splicing* sp = m_splice.get();
+
+	if(sp->body) {
+		if(!receive_body()) {
+			return false;
+		}
+
+	} else {
+#ifdef __linux__
+		while(sp->left > 0) {
+			ssize_t rl = ::splice(fd(), NULL, sp->pipefd[1], NULL, sp->left,
+					SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+			if(rl <= 0) {
+				if(rl == 0) { throw connection_closed_error(); }
+				if(errno == EINTR) { continue; }
+				if(errno != EAGAIN) { throw connection_broken_error(); }
+
+				int avail = 0;
+				if(::ioctl(fd(), FIONREAD, &avail) < 0 || avail == 0) {
+					return false;
+				}
+
+				// the pipe is full although the socket has data
+				splice_fallback();
+				return splice_body();
+			}
+			sp->left -= rl;
+		}
+#endif
+	}
+
+	std::auto_ptr<splicing> done(m_splice);
+	m_expect_trailer = true;
+
+	if(done->body) {
+		buffer_chunk ck(done->body);
+		m_current.req->value(done->key.data(), done->key.size(),
+				done->flags, done->cas,
+				(const char*)done->body->data(), done->body->data_size(), &ck);
+	} else {
+		::close(done->pipefd[1]);
+		done->pipefd[1] = -1;
+		int pipefd = done->pipefd[0];
+		done->pipefd[0] = -1;
+
+		reference_chunk ck(done->ref.get());
+		m_current.req->value_splice(done->key.data(), done->key.size(),
+				done->flags, done->cas,
+				done->head, done->headlen, &ck,
+				pipefd, done->pipelen);
+	}
+
+	return true;
+}
+
+// moves the value into memory
+void connection::splice_fallback()
+{
+	splicing* sp = m_splice.get();
+	const size_t total = sp->headlen + sp->pipelen;
+
+	std::auto_ptr<mp::stream_buffer> body(new mp::stream_buffer(total + 64));
+	body->reserve_buffer(total);
+
+	memcpy(body->buffer(), sp->head, sp->headlen);
+	body->buffer_consumed(sp->headlen);
+
+	size_t inpipe = sp->pipelen - sp->left;
+	while(inpipe > 0) {
+		ssize_t rl = ::read(sp->pipefd[0], body->buffer(), inpipe);
+		if(rl <= 0) {
+			if(rl < 0 && errno == EINTR) { continue; }
+			throw std::runtime_error("failed to read pipe");
+		}
+		body->buffer_consumed(rl);
+		inpipe -= rl;
+	}
+
+	sp->body = body.release();
+	sp->ref.reset();
+}
+
+// returns false if more data is required
+bool connection::receive_body()
+{
+	splicing* sp = m_splice.get();
+	while(sp->left > 0) {
+		ssize_t rl = ::read(fd(), sp->body->buffer(), sp->left);
+		if(rl <= 0) {
+			if(rl == 0) { throw connection_closed_error(); }
+			if(errno == EINTR) { continue; }
+			if(errno == EAGAIN) { return false; }
+			throw connection_broken_error();
+		}
+		sp->body->buffer_consumed(rl);
+		sp->left -= rl;
+	}
+	return true;
+}
+
+void connection::finish(status st)
+{
+	entry e = m_current;
+	m_current = entry();
+	m_has_current = false;
+
+	{
+		mp::pthread_scoped_lock lk(m_server->m_mutex);
+		--m_outstanding;
+		--m_server->m_inflight;
+		s_inflight.decr();
+		if(e.retrieval) {
+			m_server->record_latency(monotonic_usec() - e.sent);
+		}
+		m_server->record_result(false);
+	}
+
+	if(e.req) {
+		e.req->complete(st);
+	} else if(st != STATUS_SUCCESS) {
+		s_noreply_failed.incr();
+	}
+}
+
+
+static status binary_status(uint16_t code)
+{
+	switch(code) {
+	case MEMPROTO_RES_NO_ERROR:
+		return STATUS_SUCCESS;
+	case MEMPROTO_RES_KEY_NOT_FOUND:
+		return STATUS_NOT_FOUND;
+	case MEMPROTO_RES_KEY_EXISTS:
+		return STATUS_EXISTS;
+	case MEMPROTO_RES_ITEM_NOT_STORED:
+		return STATUS_NOT_STORED;
+	case MEMPROTO_RES_INVALID_ARGUMENTS:
+		return STATUS_CLIENT_ERROR;
+	case MEMPROTO_RES_UNKNOWN_COMMAND:
+		return STATUS_ERROR;
+	default:
+		return STATUS_SERVER_ERROR;
+	}
+}
+
+// returns the number of consumed bytes, or 0 if more data is required
+size_t connection::process_binary(const char* data, size_t size)
+{
+	binary_response res;
+	const size_t consumed = parse_binary_response(data, size, &res);
+	if(consumed == 0) {
+		return 0;
+	}
+
+	if(res.opcode != MEMPROTO_CMD_GETKQ && res.opcode != MEMPROTO_CMD_GETK) {
+		// NOOP terminates a multi-get
+		status st = (res.opcode == MEMPROTO_CMD_NOOP) ?
+			STATUS_SUCCESS : binary_status(res.status);
+		if(!finish_binary(res.opaque, st)) {
+			LOG_DEBUG("upstream: quiet command failed: opcode=",(int)res.opcode,
+					" status=",res.status);
+			s_noreply_failed.incr();
+		}
+		return consumed;
+	}
+
+	shared_request req;
+	if(!find_inflight(res.opaque, &req)) {
+		throw std::runtime_error("unexpected response");
+	}
+
+	if(res.status != MEMPROTO_RES_NO_ERROR || !req) {
+		return consumed;
+	}
+
+	if(req->cancelled()) {
+		s_discarded_values.incr();
+		return consumed;
+	}
+
+	if(res.keylen == 0) {
+		throw std::runtime_error("invalid GETK key");
+	}
+
+	buffer_chunk ck(&m_buffer);
+	req->value(res.key, res.keylen, res.flags, res.cas,
+			res.val, res.vallen, &ck);
+
+	return consumed;
+}
+
+bool connection::find_inflight(uint32_t opaque, shared_request* req)
+{
+	if(m_has_last && m_last_opaque == opaque) {
+		*req = m_last_req;
+		return true;
+	}
+
+	mp::pthread_scoped_lock lk(m_server->m_mutex);
+	for(std::deque<entry>::iterator it(m_inflight.begin()),
+			it_end(m_inflight.end()); it != it_end; ++it) {
+		if(it->opaque == opaque) {
+			*req = it->req;
+			m_has_last = true;
+			m_last_opaque = opaque;
+			m_last_req = it->req;
+			return true;
+		}
+	}
+	return false;
+}
+
+// returns false if no entry waits for the response
+bool connection::finish_binary(uint32_t opaque, status st)
+{
+	if(m_has_last && m_last_opaque == opaque) {
+		m_has_last = false;
+		m_last_req.reset();
+	}
+
+	shared_request req;
+	{
+		mp::pthread_scoped_lock lk(m_server->m_mutex);
+		std::deque<entry>::iterator it(m_inflight.begin());
+		for(; it != m_inflight.end(); ++it) {
+			if(it->opaque == opaque) { break; }
+		}
+		if(it == m_inflight.end()) {
+			return false;
+		}
+		req = it->req;
+		if(it->retrieval) {
+			m_server->record_latency(monotonic_usec() - it->sent);
+		}
+		m_inflight.erase(it);
+		--m_outstanding;
+		--m_server->m_inflight;
+		s_inflight.decr();
+		m_server->record_result(false);
+	}
+
+	if(req) {
+		req->complete(st);
+	}
+	return true;
+}
+
+
+server::server(const sockaddr* addr, socklen_t addrlen) :
+	m_pool(s_pool_size),
+	m_channels(m_pool + UPSTREAM_STREAM_CONNECTIONS),
+	m_noreply_bytes(0),
+	m_inflight(0),
+	m_waiting(0),
+	m_starved(false),
+	m_retired(false),
+	m_ready_min(0),
+	m_ready_up(0),
+	m_ready_tried(0),
+	m_binary(s_protocol == PROTOCOL_BINARY),
+	m_opaque(0),
+	m_latency_q(UPSTREAM_LATENCY_INITIAL),
+	m_latency_p95(UPSTREAM_LATENCY_INITIAL),
+	m_latency_ewma(UPSTREAM_LATENCY_INITIAL),
+	m_latency_avg(UPSTREAM_LATENCY_INITIAL),
+	m_latency_at(monotonic_usec()),
+	m_ejected(false),
+	m_failures(0),
+	m_ejections(0),
+	m_backoff(0),
+	m_probe_after(0),
+	m_next_probe(0),
+	m_addrlen(addrlen)
+{
+	memcpy(&m_addr, addr, addrlen);
+}
+
+server::~server()
+{
+	s_noreply_queue_bytes.decr(m_noreply_bytes);
+	s_inflight.decr(m_inflight);
+	s_waiting.decr(m_waiting);
+	if(m_ejected) {
+		s_ejected.decr();
+	}
+	for(std::vector<channel>::iterator cn(m_channels.begin()),
+			cn_end(m_channels.end()); cn != cn_end; ++cn) {
+		for(std::deque<entry>::iterator it(cn->queue.begin()),
+				it_end(cn->queue.end()); it != it_end; ++it) {
+			::free(it->cmd);
+		}
+	}
+}
+
+// FNV-1a; independent of the hash which routes keys to servers
+size_t server::channel_of(const char* key, size_t keylen) const
+{
+	if(m_pool == 1) {
+		return 0;
+	}
+	uint32_t h = 2166136261U;
+	for(size_t i=0; i < keylen; ++i) {
+		h ^= (uint8_t)key[i];
+		h *= 16777619U;
+	}
+	return h % m_pool;
+}
+
+void server::get(const char* const* keys, const size_t* keylens, size_t num,
+		bool require_cas, shared_request req)
+{
+	const size_t ch = channel_of(keys[0], keylens[0]);
+	timeout_scope tm(this, &req);
+
+	if(num == 1 && !require_cas && req && s_coalesce_window > 0) {
+		get_coalesced(ch, keys[0], keylens[0], req);
+		tm.start();
+		return;
+	}
+
+	entry e;
+	encode_get(keys, keylens, num, require_cas, &e);
+	e.req = req;
+
+	submit(ch, e, keys, keylens, num);
+	tm.start();
+}
+
+uint32_t server::next_opaque()
+{
+	return __sync_add_and_fetch(&m_opaque, 1);
+}
+
+void server::encode_get(const char* const* keys, const size_t* keylens, size_t num,
+		bool require_cas, entry* e)
+{
+	e->retrieval = true;
+
+	if(m_binary) {
+		// GETKQ * num + NOOP; the header always has the cas
+		size_t cmdlen = MEMPROTO_HEADER_SIZE;
+		for(size_t i=0; i < num; ++i) {
+			cmdlen += MEMPROTO_HEADER_SIZE + keylens[i];
+		}
+
+		e->cmd = (char*)::malloc(cmdlen);
+		if(!e->cmd) { throw std::bad_alloc(); }
+		e->opaque = next_opaque();
+
+		char* p = e->cmd;
+		for(size_t i=0; i < num; ++i) {
+			p = put_header(p, MEMPROTO_CMD_GETKQ,
+					keylens[i], 0, keylens[i], e->opaque);
+			memcpy(p, keys[i], keylens[i]);  p += keylens[i];
+		}
+		p = put_header(p, MEMPROTO_CMD_NOOP, 0, 0, 0, e->opaque);
+		e->cmdlen = p - e->cmd;
+		return;
+	}
+
+	// "gets" + (" " + key) * num + "\r\n"
+	size_t cmdlen = 4 + 2;
+	for(size_t i=0; i < num; ++i) {
+		cmdlen += 1 + keylens[i];
+	}
+
+	e->cmd = (char*)::malloc(cmdlen);
+	if(!e->cmd) { throw std::bad_alloc(); }
+
+	char* p = e->cmd;
+	if(require_cas) {
+		memcpy(p, "gets", 4);  p += 4;
+	} else {
+		memcpy(p, "get", 3);   p += 3;
+	}
+	for(size_t i=0; i < num; ++i) {
+		*p = ' ';  ++p;
+		memcpy(p, keys[i], keylens[i]);  p += keylens[i];
+	}
+	p[0] = '\r'; p[1] = '\n'; p += 2;
+	e->cmdlen = p - e->cmd;
+}
+
+// "set "+key+" "+uint32+" "+uint32+" "+uint64+"\r\n"+data+"\r\n"
+//           flags      exptime     bytes
+#define SET_HEADER_SIZE(keylen) \
+		(4 +(keylen)+ 1+  10  + 1 +  10  + 1 +  20  +  2)
+
+void server::set(const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime,
+		const char* data, size_t datalen,
+		shared_request req)
+{
+	store(STORE_SET, key, keylen, flags, exptime, data, datalen, req);
+}
+
+void server::add(const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime,
+		const char* data, size_t datalen,
+		shared_request req)
+{
+	store(STORE_ADD, key, keylen, flags, exptime, data, datalen, req);
+}
+
+void server::store(store_command cmd, const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime,
+		const char* data, size_t datalen,
+		shared_request req)
+{
+	timeout_scope tm(this, &req);
+	entry e;
+	e.req = req;
+
+	if(m_binary) {
+		// SETQ and ADDQ are answered only when they failed
+		const size_t bodylen = 8 + keylen + datalen;
+		e.cmd = (char*)::malloc(MEMPROTO_HEADER_SIZE + bodylen);
+		if(!e.cmd) { throw std::bad_alloc(); }
+		e.quiet = !req;
+		e.opaque = next_opaque();
+
+		uint8_t opcode;
+		if(cmd == STORE_ADD) {
+			opcode = e.quiet ? MEMPROTO_CMD_ADDQ : MEMPROTO_CMD_ADD;
+		} else {
+			opcode = e.quiet ? MEMPROTO_CMD_SETQ : MEMPROTO_CMD_SET;
+		}
+
+		char* p = put_header(e.cmd, opcode,
+				keylen, 8, bodylen, e.opaque);
+		put_be32(p, flags);  put_be32(p+4, exptime);  p += 8;
+		memcpy(p, key, keylen);    p += keylen;
+		memcpy(p, data, datalen);  p += datalen;
+		e.cmdlen = p - e.cmd;
+
+		submit(channel_of(key, keylen), e, &key, &keylen, 1, s_write_coalescing);
+		tm.start();
+		return;
+	}
+
+	e.cmd = (char*)::malloc(SET_HEADER_SIZE(keylen) + datalen + 2 + 1);
+	if(!e.cmd) { throw std::bad_alloc(); }
+
+	char* p = e.cmd;
+	memcpy(p, cmd == STORE_ADD ? "add " : "set ", 4);  p += 4;
+	memcpy(p, key, keylen);  p += keylen;
+	p += sprintf(p, " %" PRIu32 " %" PRIu32 " %lu\r\n", flags, exptime, datalen);
+	memcpy(p, data, datalen);  p += datalen;
+	p[0] = '\r'; p[1] = '\n'; p += 2;
+	e.cmdlen = p - e.cmd;
+
+	submit(channel_of(key, keylen), e, &key, &keylen, 1, s_write_coalescing);
+	tm.start();
+}
+
+shared_value_stream server::set_stream(const char* key, size_t keylen,
+		uint32_t flags, uint32_t exptime, size_t datalen,
+		shared_request req, mp::function<void ()> drained)
+{
+	timeout_scope tm(this, &req);
+	entry e;
+	const size_t ch = checkout_stream();
+	const size_t key_ch = channel_of(key, keylen);
+	mp::shared_ptr<stream_fence> stored(new stream_fence(key_ch));
+	// the response is always awaited to know when the channel is free;
+	// stream_request returns it even if this throws
+	e.req.reset(new stream_request(shared_from_this(), ch, stored, req));
+
+	mp::shared_ptr<stream_fence> opened(new stream_fence(ch));
+	e.after.push_back(opened);
+
+	if(m_binary) {
+		const size_t bodylen = 8 + keylen + datalen;
+		e.cmd = (char*)::malloc(MEMPROTO_HEADER_SIZE + 8 + keylen);
+		if(!e.cmd) { throw std::bad_alloc(); }
+		e.opaque = next_opaque();
+
+		char* p = put_header(e.cmd, MEMPROTO_CMD_SET,
+				keylen, 8, bodylen, e.opaque);
+		put_be32(p, flags);  put_be32(p+4, exptime);  p += 8;
+		memcpy(p, key, keylen);  p += keylen;
+		e.cmdlen = p - e.cmd;
+
+	} else {
+		e.cmd = (char*)::malloc(SET_HEADER_SIZE(keylen) + 1);
+		if(!e.cmd) { throw std::bad_alloc(); }
+
+		char* p = e.cmd;
+		memcpy(p, "set ", 4);    p += 4;
+		memcpy(p, key, keylen);  p += keylen;
+		p += sprintf(p, " %" PRIu32 " %" PRIu32 " %lu\r\n", flags, exptime, datalen);
+		e.cmdlen = p - e.cmd;
+	}
+
+	entry probe;
+	try {
+		e.value.reset(new value_stream(shared_from_this(), ch,
+					m_binary ? "" : "\r\n", drained));
+		probe.req.reset(new fence_request(shared_from_this(), opened));
+		encode_probe(&probe);
+	} catch (...) {
+		::free(e.cmd);
+		throw;
+	}
+
+	shared_value_stream value(e.value);
+	s_value_streams.incr();
+	submit_stream(ch, e, key_ch, probe, key, keylen, stored);
+	tm.start();
+	return value;
+}
+
+// a command which is answered after the commands sent before it to the
+// connection are done
+void server::encode_probe(entry* e)
+{
+	if(m_binary) {
+		e->cmd = (char*)::malloc(MEMPROTO_HEADER_SIZE);
+		if(!e->cmd) { throw std::bad_alloc(); }
+		e->opaque = next_opaque();
+		put_header(e->cmd, MEMPROTO_CMD_NOOP, 0, 0, 0, e->opaque);
+		e->cmdlen = MEMPROTO_HEADER_SIZE;
+		return;
+	}
+
+	e->cmd = (char*)::malloc(9);
+	if(!e->cmd) { throw std::bad_alloc(); }
+	memcpy(e->cmd, "version\r\n", 9);
+	e->cmdlen = 9;
+}
+
+// picks the stream channel with the fewest value streams
+size_t server::checkout_stream()
+{
+	mp::pthread_scoped_lock lk(m_mutex);
+	size_t ch = m_pool;
+	for(size_t i = m_pool + 1; i < m_channels.size(); ++i) {
+		if(m_channels[i].streams < m_channels[ch].streams) {
+			ch = i;
+		}
+	}
+	++m_channels[ch].streams;
+	return ch;
+}
+
+void server::return_stream(size_t ch)
+{
+	mp::pthread_scoped_lock lk(m_mutex);
+	--m_channels[ch].streams;
+}
+
+// "delete "+key+" "+uint32+"\r\n\0"
+//                   exptime
+#define DELETE_CMD_SIZE(keylen) \
+		(7 +(keylen)+ 1+  10  + 3)
+
+void server::remove(const char* key, size_t keylen,
+		uint32_t exptime,
+		shared_request req)
+{
+	if(m_binary && exptime) {
+		// DELETE has no extras in the binary protocol; servers reject
+		// the time of the text command in the same way
+		if(req) { req->complete(STATUS_CLIENT_ERROR); }
+		return;
+	}
+
+	timeout_scope tm(this, &req);
+	entry e;
+	e.req = req;
+
+	if(m_binary) {
+		// DELETEQ is answered only when it failed
+		e.cmd = (char*)::malloc(MEMPROTO_HEADER_SIZE + keylen);
+		if(!e.cmd) { throw std::bad_alloc(); }
+		e.quiet = !req;
+		e.opaque = next_opaque();
+
+		char* p = put_header(e.cmd,
+				e.quiet ? MEMPROTO_CMD_DELETEQ : MEMPROTO_CMD_DELETE,
+				keylen, 0, keylen, e.opaque);
+		memcpy(p, key, keylen);  p += keylen;
+		e.cmdlen = p - e.cmd;
+
+		submit(channel_of(key, keylen), e, &key, &keylen, 1, s_write_coalescing);
+		tm.start();
+		return;
+	}
+
+	e.cmd = (char*)::malloc(DELETE_CMD_SIZE(keylen));
+	if(!e.cmd) { throw std::bad_alloc(); }
+
+	char* p = e.cmd;
+	memcpy(p, "delete ", 7);  p += 7;
+	memcpy(p, key, keylen);   p += keylen;
+	if(exptime) {
+		p += sprintf(p, " %" PRIu32, exptime);
+	}
+	p[0] = '\r'; p[1] = '\n'; p += 2;
+	e.cmdlen = p - e.cmd;
+
+	submit(channel_of(key, keylen), e, &key, &keylen, 1, s_write_coalescing);
+	tm.start();
+}
+
+
+void server::get_coalesced(size_t ch, const char* key, size_t keylen,
+		shared_request req)
+{
+	mp::shared_ptr<connection> c;  // released after unlocking m_mutex
+	bool start_connect = false;
+	bool start_timer = false;
+	uint64_t seq = 0;
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		channel& cn(m_channels[ch]);
+		if(is_overloaded()) {
+			lk.unlock();
+			s_rejected.incr();
+			req->complete(STATUS_OVERLOADED);
+			return;
+		}
+		if(!cn.batch) {
+			cn.batch.reset(new get_batch());
+			seq = ++cn.batch_seq;
+			start_timer = true;
+		}
+		cn.batch->add(key, keylen, req);
+
+		if(cn.batch->size() >= s_coalesce_max) {
+			enqueue_batch(cn);
+			start_connect = dispatch(ch, &c);
+		}
+	}
+
+	if(start_timer) {
+		// the batch is sent on the next tick of the shared timer wheel
+		// after the window; a batch which reaches the size limit first
+		// is not sent again as batch_seq doesn't match
+		const unsigned int window = s_coalesce_window;
+		try {
+			core::deadline_event((window + 999) / 1000,
+					mp::bind(&server::batch_expired, shared_from_this(), ch, seq));
+		} catch (std::exception& e) {
+			LOG_WARN("upstream coalescing timer failed: ",e.what());
+			batch_expired(ch, seq);
+		}
+	}
+
+	if(start_connect) {
+		connect(ch);
+	}
+}
+
+void server::batch_expired(size_t ch, uint64_t seq)
+{
+	mp::shared_ptr<connection> c;
+	bool start_connect = false;
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		channel& cn(m_channels[ch]);
+		if(!cn.batch || cn.batch_seq != seq) {
+			return;  // already sent by reaching the size limit
+		}
+		enqueue_batch(cn);
+		start_connect = dispatch(ch, &c);
+	}
+
+	if(start_connect) {
+		connect(ch);
+	}
+}
+
+// m_mutex must be locked
+void server::enqueue_batch(channel& cn)
+{
+	mp::shared_ptr<get_batch> b;
+	b.swap(cn.batch);
+
+	std::vector<const char*> keys;
+	std::vector<size_t> keylens;
+	b->keys(&keys, &keylens);
+
+	entry e;
+	encode_get(&keys[0], &keylens[0], keys.size(), false, &e);
+	e.req = b;
+
+	try {
+		if(!m_stream_keys.empty()) {
+			hold_streamed(&keys[0], &keylens[0], keys.size(), &e);
+		}
+		cn.queue.push_back(e);
+	} catch (...) {
+		::free(e.cmd);
+		throw;
+	}
+	++m_waiting;
+	s_waiting.incr();
+}
+
+// a deferred command is written by flush_writes() together with the
+// commands which other clients queue to the channel in the meantime;
+// keys are the keys of the command
+void server::submit(size_t ch, entry& e,
+		const char* const* keys, const size_t* keylens, size_t num,
+		bool defer)
+{
+	mp::shared_ptr<connection> c;  // released after unlocking m_mutex
+	bool start_connect = false;
+	bool start_flush = false;
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		channel& cn(m_channels[ch]);
+		bool reserved = false;
+		try {
+			// keep the order of commands sent to this channel
+			if(cn.batch) {
+				enqueue_batch(cn);
+			}
+
+			if(e.req && is_overloaded()) {
+				lk.unlock();
+				::free(e.cmd);
+				if(e.value) { e.value->drop(); }
+				s_rejected.incr();
+				e.req->complete(STATUS_OVERLOADED);
+				return;
+			}
+
+			if(!e.req) {
+				if(!reserve_noreply(e.cmdlen)) {
+					lk.unlock();
+					::free(e.cmd);
+					if(e.value) { e.value->drop(); }
+					s_noreply_dropped.incr();
+					return;
+				}
+				reserved = true;
+			}
+
+			if(!m_stream_keys.empty()) {
+				hold_streamed(keys, keylens, num, &e);
+			}
+			cn.queue.push_back(e);
+
+		} catch (...) {
+			if(reserved) { release_noreply(e.cmdlen); }
+			::free(e.cmd);
+			if(e.value) { e.value->drop(); }
+			throw;
+		}
+
+		if(e.req) {
+			++m_waiting;
+			s_waiting.incr();
+		}
+
+		if(!defer) {
+			start_connect = dispatch(ch, &c);
+		} else if(!cn.flush_scheduled) {
+			cn.flush_scheduled = true;
+			start_flush = true;
+		}
+	}
+
+	if(start_flush) {
+		try {
+			core::submit(&server::flush_writes, shared_from_this(), ch);
+		} catch (std::exception& e) {
+			LOG_WARN("upstream write coalescing failed: ",e.what());
+			flush_writes(ch);
+		}
+	}
+
+	if(start_connect) {
+		connect(ch);
+	}
+}
+
+// queues the probe to the channel of the key and the value stream to
+// its stream channel at once, so that the streams of a key are queued in
+// the order of their fences
+void server::submit_stream(size_t ch, entry& e, size_t key_ch, entry& probe,
+		const char* key, size_t keylen,
+		const mp::shared_ptr<stream_fence>& stored)
+{
+	mp::shared_ptr<connection> kc;  // released after unlocking m_mutex
+	mp::shared_ptr<connection> c;
+	bool start_key_connect = false;
+	bool start_connect = false;
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		channel& kn(m_channels[key_ch]);
+		channel& cn(m_channels[ch]);
+		try {
+			// gets coalesced before the set are sent before the probe
+			if(kn.batch) {
+				enqueue_batch(kn);
+			}
+
+			if(is_overloaded()) {
+				lk.unlock();
+				::free(e.cmd);
+				::free(probe.cmd);
+				e.value->drop();
+				s_rejected.incr();
+				e.req->complete(STATUS_OVERLOADED);
+				return;
+			}
+
+			// the probe waits for the earlier streams of the key
+			if(!m_stream_keys.empty()) {
+				hold_streamed(&key, &keylen, 1, &probe);
+			}
+
+			stream_key sk;
+			sk.key.assign(key, keylen);
+			sk.stored = stored;
+			m_stream_keys.push_back(sk);
+			try {
+				kn.queue.push_back(probe);
+				try {
+					cn.queue.push_back(e);
+				} catch (...) {
+					kn.queue.pop_back();
+					throw;
+				}
+			} catch (...) {
+				m_stream_keys.pop_back();
+				throw;
+			}
+
+		} catch (...) {
+			::free(e.cmd);
+			::free(probe.cmd);
+			e.value->drop();
+			throw;
+		}
+
+		m_waiting += 2;
+		s_waiting.incr(2);
+
+		start_key_connect = dispatch(key_ch, &kc);
+		start_connect = dispatch(ch, &c);
+	}
+
+	if(start_key_connect) {
+		connect(key_ch);
+	}
+	if(start_connect) {
+		connect(ch);
+	}
+}
+
+// m_mutex must be locked; the command waits for the value streams of
+// its keys which are not answered yet
+void server::hold_streamed(const char* const* keys, const size_t* keylens,
+		size_t num, entry* e)
+{
+	for(std::vector<stream_key>::const_iterator it(m_stream_keys.begin()),
+			it_end(m_stream_keys.end()); it != it_end; ++it) {
+		for(size_t i=0; i < num; ++i) {
+			if(it->key.size() == keylens[i] &&
+					memcmp(it->key.data(), keys[i], keylens[i]) == 0) {
+				e->after.push_back(it->stored);
+				break;
+			}
+		}
+	}
+}
+
+// sends the commands which wait for the fence; opening it twice is
+// harmless
+void server::open_fence(const mp::shared_ptr<stream_fence>& f)
+{
+	mp::shared_ptr<connection> c;  // released after unlocking m_mutex
+	bool start_connect = false;
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		if(f->opened) {
+			return;
+		}
+		f->opened = true;
+		for(std::vector<stream_key>::iterator it(m_stream_keys.begin()),
+				it_end(m_stream_keys.end()); it != it_end; ++it) {
+			if(it->stored == f) {
+				m_stream_keys.erase(it);
+				break;
+			}
+		}
+		if(!m_channels[f->channel].queue.empty()) {
+			start_connect = dispatch(f->channel, &c);
+		}
+	}
+
+	if(start_connect) {
+		connect(f->channel);
+	}
+}
+
+void server::flush_writes(size_t ch)
+{
+	mp::shared_ptr<connection> c;
+	bool start_connect = false;
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		m_channels[ch].flush_scheduled = false;
+		start_connect = dispatch(ch, &c);
+	}
+
+	if(start_connect) {
+		connect(ch);
+	}
+}
+
+// m_mutex must be locked; returns false if the noreply write of the size
+// should be dropped
+bool server::reserve_noreply(size_t size)
+{
+	const size_t limit = s_noreply_limit;
+	if(limit > 0) {
+		if(size > limit) {
+			return false;
+		}
+		while(m_noreply_bytes + size > limit) {
+			if(s_noreply_overflow != OVERFLOW_DROP_OLDEST ||
+					!drop_oldest_noreply()) {
+				return false;
+			}
+		}
+	}
+
+	m_noreply_bytes += size;
+	s_noreply_queue_bytes.incr(size);
+	s_noreply_queued.incr();
+	return true;
+}
+
+// m_mutex must be locked
+void server::release_noreply(size_t size)
+{
+	m_noreply_bytes -= size;
+	s_noreply_queue_bytes.decr(size);
+}
+
+// m_mutex must be locked; returns false if no noreply write is queued
+bool server::drop_oldest_noreply()
+{
+	for(std::vector<channel>::iterator cn(m_channels.begin()),
+			cn_end(m_channels.end()); cn != cn_end; ++cn) {
+		for(std::deque<entry>::iterator it(cn->queue.begin()),
+				it_end(cn->queue.end()); it != it_end; ++it) {
+			if(!it->req) {
+				release_noreply(it->cmdlen);
+				::free(it->cmd);
+				if(it->value) { it->value->drop(); }
+				cn->queue.erase(it);
+				s_noreply_dropped.incr();
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// m_mutex must be locked; returns true if a request should be rejected
+// instead of being queued
+bool server::is_overloaded() const
+{
+	const size_t limit = s_max_waiting;
+	return limit > 0 && m_waiting >= limit;
+}
+
+// m_mutex must be locked; returns true if another request can be sent
+bool server::has_room() const
+{
+	const size_t limit = s_max_inflight;
+	return limit == 0 || m_inflight < limit;
+}
+
+// sends the requests which waited for other connections to receive
+// responses; the connections are put to hold to be released after
+// unlocking m_mutex, which must be locked
+void server::resume_starved(std::vector<mp::shared_ptr<connection> >* hold)
+{
+	if(!m_starved || !has_room()) {
+		return;
+	}
+	m_starved = false;
+	for(std::vector<channel>::iterator cn(m_channels.begin()),
+			cn_end(m_channels.end()); cn != cn_end && has_room(); ++cn) {
+		mp::shared_ptr<connection> c(cn->conn.lock());
+		if(c) {
+			hold->push_back(c);
+			send_next(c.get());
+		}
+	}
+}
+
+// m_mutex must be locked; returns true if connect() should be called
+bool server::dispatch(size_t ch, mp::shared_ptr<connection>* c)
+{
+	channel& cn(m_channels[ch]);
+	*c = cn.conn.lock();
+	if(*c) {
+		send_next(c->get());
+	} else if(!cn.connecting) {
+		cn.connecting = true;
+		return true;
+	}
+	return false;
+}
+
+// m_mutex must be locked; returns true if the command waits for a fence
+static bool is_held(entry& e)
+{
+	while(!e.after.empty()) {
+		if(!e.after.back()->opened) {
+			return true;
+		}
+		e.after.pop_back();
+	}
+	return false;
+}
+
+// m_mutex must be locked
+void server::send_next(connection* c)
+{
+	// a stream channel sends the next value after the previous one is
+	// answered, so that closing it to abort a value fails nothing else
+	const size_t depth = c->m_channel < m_pool ? (size_t)s_pipeline_depth : 1;
+	channel& cn(m_channels[c->m_channel]);
+	std::deque<entry>& queue(cn.queue);
+
+	if(c->m_stream) {
+		// the rest of a value must follow its command
+		return;
+	}
+
+	if(queue.empty() || c->m_outstanding >= depth) {
+		if(m_retired && c->m_outstanding == 0) {
+			::shutdown(c->fd(), SHUT_RDWR);
+		}
+		return;
+	}
+
+	if(is_held(queue.front())) {
+		// open_fence() sends it
+		return;
+	}
+
+	if(!has_room()) {
+		m_starved = true;
+		return;
+	}
+
+	// pipeline queued commands into a single writev(2);
+	// responses are matched by connection::process in FIFO order, or by
+	// connection::process_binary with the opaque
+	core::xfer xf;
+	const uint64_t now = monotonic_usec();
+	shared_value_stream value;
+	size_t written = 0;
+	bool held = false;
+	try {
+		do {
+			struct iovec vec[UPSTREAM_WRITEV_MAX];
+			char* cmds[UPSTREAM_WRITEV_MAX];
+			size_t veclen = 0;
+
+			do {
+				entry& e(queue.front());
+				if(e.req && e.req->cancelled()) {
+					drop_cancelled(queue);
+					continue;
+				}
+				if(is_held(e)) {
+					held = true;
+					break;
+				}
+
+				if(!e.quiet) {
+					// quiet commands are not answered unless they failed
+					c->m_inflight.push_back(e);
+					c->m_inflight.back().cmd = NULL;
+					c->m_inflight.back().value.reset();
+					c->m_inflight.back().sent = now;
+					++c->m_outstanding;
+					++m_inflight;
+					s_inflight.incr();
+				}
+
+				vec[veclen].iov_base = e.cmd;
+				vec[veclen].iov_len  = e.cmdlen;
+				cmds[veclen] = e.cmd;
+				++veclen;
+				++written;
+
+				if(!e.req) {
+					release_noreply(e.cmdlen);
+				} else {
+					--m_waiting;
+					s_waiting.decr();
+				}
+				value.swap(e.value);
+				queue.pop_front();
+
+			} while(!value && !queue.empty() && c->m_outstanding < depth &&
+					has_room() && veclen < UPSTREAM_WRITEV_MAX);
+
+			if(veclen == 0) {
+				continue;
+			}
+
+			size_t i = 0;
+			try {
+				xf.push_writev(vec, veclen);
+				for(; i < veclen; ++i) {
+					xf.push_finalize(&::free, cmds[i]);
+				}
+			} catch (...) {
+				for(; i < veclen; ++i) {
+					::free(cmds[i]);
+				}
+				throw;
+			}
+
+		} while(!value && !held && !queue.empty() &&
+				c->m_outstanding < depth && has_room());
+
+		if(!queue.empty() && !has_room()) {
+			m_starved = true;
+		}
+
+		if(written > 0) {
+			core::commit(c->fd(), &xf);
+			s_writes.incr();
+			s_commands_written.incr(written);
+		}
+
+		if(value && value->attach(c->shared_self<connection>())) {
+			c->m_stream = value;
+		}
+
+	} catch (...) {
+		// entries in m_inflight are failed when the connection is closed;
+		// don't throw because the caller's entry is already queued
+		LOG_WARN("upstream send failed");
+		if(value) { value->drop(); }
+		::shutdown(c->fd(), SHUT_RDWR);
+	}
+}
+
+// the client of the request at the front of the queue is gone;
+// m_mutex must be locked
+void server::drop_cancelled(std::deque<entry>& queue)
+{
+	entry& e(queue.front());
+	const bool schedule = m_cancelled.empty();
+	m_cancelled.push_back(e.req);
+
+	::free(e.cmd);
+	if(e.value) { e.value->drop(); }
+	--m_waiting;
+	s_waiting.decr();
+	s_cancelled.incr();
+	queue.pop_front();
+
+	if(schedule) {
+		// the requests are completed without m_mutex
+		core::submit(&server::complete_cancelled, shared_from_this());
+	}
+}
+
+void server::complete_cancelled()
+{
+	std::vector<shared_request> reqs;
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		reqs.swap(m_cancelled);
+	}
+
+	for(std::vector<shared_request>::iterator it(reqs.begin()),
+			it_end(reqs.end()); it != it_end; ++it) {
+		try {
+			(*it)->complete(STATUS_CANCELLED);
+		} catch (...) { }
+	}
+}
+
+void server::preconnect(size_t min_ready, mp::function<void ()> ready)
+{
+	std::vector<size_t> start;
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		m_ready.swap(ready);
+		m_ready_min = std::min(min_ready, m_pool);
+		m_ready_up = 0;
+		m_ready_tried = 0;
+
+		for(size_t ch=0; ch < m_pool; ++ch) {
+			channel& cn(m_channels[ch]);
+			if(cn.conn.lock()) {
+				++m_ready_up;
+				++m_ready_tried;
+			} else if(!cn.connecting) {
+				cn.connecting = true;
+				start.push_back(ch);
+			}
+		}
+	}
+
+	// calls ready if the connections are already up
+	count_ready(0, 0);
+
+	for(std::vector<size_t>::iterator it(start.begin()), it_end(start.end());
+			it != it_end; ++it) {
+		connect(*it);
+	}
+}
+
+// counts the connections tried by preconnect() and
+// calls the callback once enough of them are tried
+void server::count_ready(size_t up, size_t tried)
+{
+	mp::function<void ()> ready;
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		if(!m_ready) {
+			return;
+		}
+		m_ready_up += up;
+		m_ready_tried += tried;
+		if(m_ready_up < m_ready_min && m_ready_tried < m_pool) {
+			return;
+		}
+		ready.swap(m_ready);
+	}
+	ready();
+}
+
+void server::retire()
+{
+	std::vector<mp::shared_ptr<connection> > conns;
+	mp::pthread_scoped_lock lk(m_mutex);
+	m_retired = true;
+	m_ready = 0;
+	for(std::vector<channel>::iterator cn(m_channels.begin()),
+			cn_end(m_channels.end()); cn != cn_end; ++cn) {
+		mp::shared_ptr<connection> c(cn->conn.lock());
+		if(c) {
+			conns.push_back(c);
+			send_next(c.get());
+		}
+	}
+	lk.unlock();
+}
+
+
+void server::connect(size_t ch)
+{
+	using namespace mp::placeholders;
+	try {
+		core::connect_event(m_addr.ss_family, SOCK_STREAM, 0,
+				(struct sockaddr*)&m_addr, m_addrlen,
+				UPSTREAM_CONNECT_TIMEOUT,
+				mp::bind(&server::connected, shared_from_this(), ch, _1, _2));
+	} catch (std::exception& e) {
+		LOG_WARN("upstream connect failed: ",e.what());
+		fail_queue(ch, STATUS_CONNECTION_ERROR);
+	}
+}
+
+void server::connected(size_t ch, int fd, int err)
+{
+	if(fd < 0) {
+		LOG_WARN("upstream connect failed: ",strerror(err));
+		fail_queue(ch, STATUS_CONNECTION_ERROR);
+		return;
+	}
+
+#ifndef NO_TCP_NODELAY
+	int on = 1;
+	::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));  // ignore error
+#endif
+
+	mp::shared_ptr<connection> c;
+	try {
+		c = core::add_handler<connection>(fd, shared_from_this(), ch);
+	} catch (std::exception& e) {
+		LOG_WARN("upstream connect failed: ",e.what());
+		fail_queue(ch, STATUS_CONNECTION_ERROR);
+		return;
+	}
+
+	LOG_DEBUG("upstream connected fd=",fd);
+
+	mp::pthread_scoped_lock lk(m_mutex);
+	channel& cn(m_channels[ch]);
+	cn.conn = c;
+	cn.connecting = false;
+	send_next(c.get());
+	lk.unlock();
+
+	count_ready(1, 1);
+}
+
+void server::fail_queue(size_t ch, status st)
+{
+	std::deque<entry> failed;
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		channel& cn(m_channels[ch]);
+		failed.swap(cn.queue);
+		cn.connecting = false;
+		record_result(true);
+		for(std::deque<entry>::iterator it(failed.begin()), it_end(failed.end());
+				it != it_end; ++it) {
+			if(!it->req) {
+				release_noreply(it->cmdlen);
+			} else {
+				--m_waiting;
+				s_waiting.decr();
+			}
+		}
+	}
+
+	for(std::deque<entry>::iterator it(failed.begin()), it_end(failed.end());
+			it != it_end; ++it) {
+		::free(it->cmd);
+		if(it->value) { it->value->drop(); }
+		if(it->req) {
+			it->req->complete(st);
+		} else {
+			s_noreply_dropped.incr();
+		}
+	}
+
+	count_ready(0, 1);
+}
+
+// stochastic approximation of the quantile: the estimate goes up 19 times
+// more than it goes down, so it settles where 5% of samples exceed it.
+// the moving average follows recent samples for load() and decays while
+// there are none;
+// m_mutex must be locked
+void server::record_latency(uint64_t usec)
+{
+	const double rate = UPSTREAM_LATENCY_RATE;
+	if((double)usec > m_latency_q) {
+		m_latency_q *= 1.0 + rate * 0.95;
+	} else {
+		m_latency_q *= 1.0 - rate * 0.05;
+	}
+	if(m_latency_q < 1.0) {
+		m_latency_q = 1.0;
+	}
+	m_latency_p95 = (unsigned int)m_latency_q;
+
+	const uint64_t now = monotonic_usec();
+	m_latency_ewma = decay_latency(m_latency_ewma, now - m_latency_at);
+	m_latency_at = now;
+
+	m_latency_ewma += ((double)usec - m_latency_ewma)
+		* UPSTREAM_LATENCY_EWMA_WEIGHT;
+	if(m_latency_ewma < 1.0) {
+		m_latency_ewma = 1.0;
+	}
+	m_latency_avg = (unsigned int)m_latency_ewma;
+}
+
+uint64_t server::load() const
+{
+	const uint64_t avg = (uint64_t)decay_latency(m_latency_avg,
+			monotonic_usec() - m_latency_at);
+	return (uint64_t)(m_inflight + m_waiting + 1) * avg;
+}
+
+// returns true if a request can be sent to probe the ejected server;
+// probes are sent once per back-off until one of them succeeds
+bool server::probe()
+{
+	mp::pthread_scoped_lock lk(m_mutex);
+	if(!m_ejected) {
+		return true;
+	}
+	const uint64_t now = monotonic_usec() / 1000;
+	if(now < m_next_probe) {
+		return false;
+	}
+	m_next_probe = now + m_backoff;
+	return true;
+}
+
+// a request is answered, or failed by a connection failure or timeout;
+// m_mutex must be locked
+void server::record_result(bool failed)
+{
+	const unsigned int latency = s_eject_latency;
+	if(latency > 0 && m_latency_p95 > latency) {
+		failed = true;  // too slow
+	}
+
+	if(!m_ejected) {
+		if(!failed) {
+			m_failures = 0;
+			return;
+		}
+		++m_failures;
+		const unsigned int limit = s_eject_failures;
+		if(limit > 0 && m_failures >= limit) {
+			eject(monotonic_usec() / 1000);
+		}
+		return;
+	}
+
+	// results of the requests sent before the ejection are ignored
+	const uint64_t now = monotonic_usec() / 1000;
+	if(now < m_probe_after) {
+		return;
+	}
+
+	if(failed) {
+		eject(now);
+		return;
+	}
+
+	LOG_WARN("upstream ",address()," is readmitted");
+	m_ejected = false;
+	m_failures = 0;
+	m_ejections = 0;
+	s_readmissions.incr();
+	s_ejected.decr();
+}
+
+// ejects the server, or extends the ejection if the probe failed;
+// m_mutex must be locked
+void server::eject(uint64_t now)
+{
+	unsigned int backoff = UPSTREAM_EJECT_BACKOFF;
+	for(unsigned int i=0; i < m_ejections &&
+			backoff < UPSTREAM_EJECT_BACKOFF_MAX; ++i) {
+		backoff *= 2;
+	}
+	backoff = std::min(backoff, (unsigned int)UPSTREAM_EJECT_BACKOFF_MAX);
+	++m_ejections;
+
+	m_backoff = backoff;
+	m_probe_after = now + backoff;
+	m_next_probe = m_probe_after;
+
+	// the estimate is stale once requests stop
+	m_latency_q = UPSTREAM_LATENCY_INITIAL;
+	m_latency_p95 = UPSTREAM_LATENCY_INITIAL;
+	m_latency_ewma = UPSTREAM_LATENCY_INITIAL;
+	m_latency_avg = UPSTREAM_LATENCY_INITIAL;
+
+	if(!m_ejected) {
+		m_ejected = true;
+		s_ejections.incr();
+		s_ejected.incr();
+		LOG_WARN("upstream ",address()," is ejected for ",backoff," msec after ",
+				m_failures," failures");
+	} else {
+		LOG_WARN("upstream ",address()," failed to be probed; ejected for ",
+				backoff," msec");
+	}
+}
+
+// a part of the value passed to the socket; the stream counts it as
+// queued until it is written or discarded
+struct value_stream::part {
+	part() : len(0) { }
+
+	~part()
+	{
+		if(stream) { stream->written(len); }
+	}
+
+	shared_value_stream stream;
+	size_t len;
+	std::auto_ptr<mp::stream_buffer::reference> ref;
+	std::string pending;
+};
+
+value_stream::value_stream(shared_server sv, size_t ch, const char* trailer,
+		mp::function<void ()> drained) :
+	m_server(sv),
+	m_channel(ch),
+	m_trailer(trailer),
+	m_fd(-1),
+	m_closed(false),
+	m_dropped(false),
+	m_queued(0),
+	m_blocked(false),
+	m_drained(drained)
+{ }
+
+value_stream::~value_stream() { }
+
+// m_mutex must be locked; data is valid while pt is alive
+void value_stream::send(std::auto_ptr<part> pt, const char* data, size_t len)
+{
+	pt->stream = shared_from_this();
+	pt->len = len;
+	core::write(m_fd, data, len, &mp::object_delete<part>, pt.get());
+	pt.release();
+}
+
+void value_stream::written(size_t len)
+{
+	{
+		mp::pthread_scoped_lock lk(m_queue_mutex);
+		m_queued -= len;
+		if(!m_blocked || m_queued > UPSTREAM_STREAM_QUEUE_SIZE / 2) {
+			return;
+		}
+		m_blocked = false;
+	}
+	if(m_drained) { m_drained(); }
+}
+
+// m_mutex must be locked; returns true if the client is paused, in which
+// case m_drained must be called after unlocking
+bool value_stream::unblock()
+{
+	mp::pthread_scoped_lock lk(m_queue_mutex);
+	const bool blocked = m_blocked;
+	m_blocked = false;
+	return blocked;
+}
+
+bool value_stream::write(const char* data, size_t len,
+		std::auto_ptr<mp::stream_buffer::reference> ref)
+{
+	mp::pthread_scoped_lock lk(m_mutex);
+	if(m_dropped || len == 0) {
+		return true;
+	}
+
+	{
+		// counted before a part which is written immediately uncounts it
+		mp::pthread_scoped_lock qlk(m_queue_mutex);
+		m_queued += len;
+	}
+
+	if(m_fd < 0) {
+		m_pending.append(data, len);
+	} else {
+		std::auto_ptr<part> pt(new part());
+		pt->ref = ref;
+		send(pt, data, len);
+	}
+
+	mp::pthread_scoped_lock qlk(m_queue_mutex);
+	if(m_queued < UPSTREAM_STREAM_QUEUE_SIZE) {
+		return true;
+	}
+	m_blocked = true;
+	s_value_streams_paused.incr();
+	return false;
+}
+
+void value_stream::close()
+{
+	mp::shared_ptr<connection> c;  // released after unlocking
+	bool resume = false;
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		if(m_dropped || m_closed) {
+			return;
+		}
+		m_closed = true;
+		resume = unblock();
+		if(m_fd >= 0) {
+			if(*m_trailer) {
+				core::write(m_fd, m_trailer, strlen(m_trailer));
+			}
+			c = m_conn.lock();
+		}
+		// otherwise attach() sends the trailer after the value
+	}
+
+	if(resume && m_drained) { m_drained(); }
+
+	if(c) {
+		// the connection may send the following commands
+		mp::pthread_scoped_lock lk(m_server->m_mutex);
+		if(c->m_stream.get() == this) {
+			c->m_stream.reset();
+			m_server->send_next(c.get());
+		}
+	}
+}
+
+void value_stream::abort()
+{
+	mp::shared_ptr<connection> c;
+	bool resume = false;
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		if(m_dropped || m_closed) {
+			return;
+		}
+		m_dropped = true;
+		resume = unblock();
+		std::string().swap(m_pending);
+		if(m_fd >= 0) {
+			m_fd = -1;
+			c = m_conn.lock();
+		}
+	}
+	s_value_streams_aborted.incr();
+
+	if(resume && m_drained) { m_drained(); }
+
+	if(c) {
+		// the server is waiting for the rest of the value; the
+		// connection carries nothing else
+		::shutdown(c->fd(), SHUT_RDWR);
+		return;
+	}
+
+	// the command is not sent yet
+	entry removed;
+	{
+		mp::pthread_scoped_lock lk(m_server->m_mutex);
+		std::deque<entry>& queue(m_server->m_channels[m_channel].queue);
+		for(std::deque<entry>::iterator it(queue.begin()), it_end(queue.end());
+				it != it_end; ++it) {
+			if(it->value.get() == this) {
+				removed = *it;
+				queue.erase(it);
+				--m_server->m_waiting;
+				s_waiting.decr();
+				break;
+			}
+		}
+	}
+
+	::free(removed.cmd);
+	if(removed.req) {
+		removed.req->complete(STATUS_CONNECTION_ERROR);
+	}
+}
+
+// m_server->m_mutex must be locked
+bool value_stream::attach(const mp::shared_ptr<connection>& c)
+{
+	mp::pthread_scoped_lock lk(m_mutex);
+	if(m_dropped) {
+		// aborted after the command was taken from the queue; nothing
+		// is sent to the connection until it is closed
+		::shutdown(c->fd(), SHUT_RDWR);
+		return true;
+	}
+	m_fd = c->fd();
+	m_conn = c;
+	if(!m_pending.empty()) {
+		std::auto_ptr<part> pt(new part());
+		pt->pending.swap(m_pending);
+		const char* const data = pt->pending.data();
+		const size_t len = pt->pending.size();
+		send(pt, data, len);
+	}
+	if(m_closed && *m_trailer) {
+		core::write(m_fd, m_trailer, strlen(m_trailer));
+	}
+	return !m_closed;
+}
+
+// the command is discarded without being sent
+void value_stream::drop()
+{
+	bool resume = false;
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		m_dropped = true;
+		m_fd = -1;
+		std::string().swap(m_pending);
+		resume = unblock();
+	}
+	if(resume && m_drained) { m_drained(); }
+}
+
+// m_server->m_mutex must be locked; the connection is closed
+bool value_stream::detach()
+{
+	bool resume = false;
+	bool aborted;
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		aborted = m_dropped;
+		m_dropped = true;
+		m_fd = -1;
+		resume = unblock();
+	}
+	if(resume && m_drained) { m_drained(); }
+	return aborted;
+}
+
+
+bool server::is_same(const server* other) const
+{
+	return m_addrlen == other->m_addrlen &&
+		memcmp(&m_addr, &other->m_addr, m_addrlen) == 0;
+}
+
+void server::dump_stats(const std::string& prefix, std::string* out) const
+{
+	const std::string name(prefix + address());
+	char buf[64];
+	snprintf(buf, sizeof(buf), ":inflight %lu\r\n", (unsigned long)m_inflight);
+	out->append("STAT ");
+	out->append(name);
+	out->append(buf);
+	snprintf(buf, sizeof(buf), ":waiting %lu\r\n", (unsigned long)m_waiting);
+	out->append("STAT ");
+	out->append(name);
+	out->append(buf);
+}
+
+std::string server::address() const
+{
+	char host[INET6_ADDRSTRLEN] = "?";
+	unsigned short port = 0;
+	if(m_addr.ss_family == AF_INET) {
+		const sockaddr_in* sin = (const sockaddr_in*)&m_addr;
+		::inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host));
+		port = ntohs(sin->sin_port);
+	} else if(m_addr.ss_family == AF_INET6) {
+		const sockaddr_in6* sin6 = (const sockaddr_in6*)&m_addr;
+		::inet_ntop(AF_INET6, &sin6->sin6_addr, host, sizeof(host));
+		port = ntohs(sin6->sin6_port);
+	}
+	char buf[INET6_ADDRSTRLEN + 8];
+	snprintf(buf, sizeof(buf), "%s:%u", host, port);
+	return buf;
+}
+
+
+}  // namespace upstream
+}  // namespace memxy
@@ -0,0 +1,511 @@
+//
+// memxy::upstream - memcached proxy
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef MEMXY_UPSTREAM_H__
+#define MEMXY_UPSTREAM_H__
+
+#include <mp/functional.h>
+#include <mp/memory.h>
+#include <mp/pthread.h>
+#include <mp/stream_buffer.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace memxy {
+namespace upstream {
+
+
+enum status {
+	STATUS_SUCCESS,           // END, STORED or DELETED
+	STATUS_NOT_STORED,
+	STATUS_EXISTS,
+	STATUS_NOT_FOUND,
+	STATUS_ERROR,
+	STATUS_CLIENT_ERROR,
+	STATUS_SERVER_ERROR,
+	STATUS_CONNECTION_ERROR,
+	STATUS_NO_SERVER,
+	STATUS_TIMEOUT,
+	STATUS_OVERLOADED,        // rejected by the bulkhead of the server
+	STATUS_CANCELLED,         // dropped before it was sent; see cancelled()
+};
+
+
+// the receive buffer which holds a value
+class chunk {
+public:
+	// returns a reference which keeps the value valid until it's deleted;
+	// lets the value be forwarded without copying
+	virtual mp::stream_buffer::reference* retain() = 0;
+
+protected:
+	chunk() { }
+	~chunk() { }
+
+private:
+	chunk(const chunk&);
+};
+
+// chunk of a reference which is owned by the caller
+class reference_chunk : public chunk {
+public:
+	reference_chunk(const mp::stream_buffer::reference* ref) : m_ref(ref) { }
+
+	mp::stream_buffer::reference* retain()
+		{ return new mp::stream_buffer::reference(*m_ref); }
+
+private:
+	const mp::stream_buffer::reference* m_ref;
+};
+
+
+class request {
+public:
+	request() { }
+	virtual ~request() { }
+
+	// called for each VALUE of a retrieval command;
+	// val is valid only while this function is called unless
+	// ck->retain() is used
+	virtual void value(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* val, size_t vallen,
+			chunk* ck) { }
+
+	// returns true if a large value of the key can be received by
+	// value_splice() instead of value()
+	virtual bool accept_splice(const char* key, size_t keylen)
+		{ return false; }
+
+	// the value is headlen bytes of head followed by pipelen bytes left
+	// in the pipe; the request owns pipefd and must close(2) it
+	virtual void value_splice(const char* key, size_t keylen,
+			uint32_t flags, uint64_t cas,
+			const char* head, size_t headlen, chunk* ck,
+			int pipefd, size_t pipelen)
+		{ ::close(pipefd); }
+
+	// called once when the response is received or the command failed
+	virtual void complete(status st) = 0;
+
+	// returns true if nobody waits for the response any more; the command
+	// is dropped without being sent, and values received for it are not
+	// passed to value()
+	virtual bool cancelled() { return false; }
+
+private:
+	request(const request&);
+};
+
+typedef mp::shared_ptr<request> shared_request;
+
+
+class value_stream;
+struct stream_fence;
+
+
+struct entry {
+	entry() : retrieval(false), quiet(false), opaque(0), cmd(NULL), cmdlen(0),
+		sent(0) { }
+
+	bool retrieval;
+	bool quiet;      // no response is returned unless it fails
+	uint32_t opaque; // matches binary responses to the entry
+	char* cmd;       // malloc(3)ed command, freed after it is sent
+	size_t cmdlen;
+	uint64_t sent;   // monotonic time in usec when it was written
+	shared_request req;
+
+	// the value follows cmd as it arrives; nothing else is sent to the
+	// connection until it ends
+	mp::shared_ptr<value_stream> value;
+
+	// the command and the ones after it stay in the queue until these
+	// are opened
+	std::vector<mp::shared_ptr<stream_fence> > after;
+};
+
+
+enum protocol {
+	PROTOCOL_TEXT,
+	PROTOCOL_BINARY,
+};
+
+
+class connection;
+class get_batch;
+class timed_request;
+class stream_request;
+class fence_request;
+
+// A server has a pool of connections which are shared by all worker
+// threads.  Each key is assigned to one of them so that commands of the
+// key are never reordered.  Requests are pipelined onto a connection and
+// the responses are matched in order, or by the opaque of the binary
+// protocol.  A streamed set goes to a connection of its own instead, so
+// it is fenced on the connection of the key: it is sent after a probe
+// queued there is answered, and commands of the key queued after it wait
+// until it is answered.
+class server : public mp::enable_shared_from_this<server> {
+public:
+	server(const sockaddr* addr, socklen_t addrlen);
+	~server();
+
+	// index of the connection which commands of the key are sent to;
+	// all keys of a multi-get must be on the same channel
+	size_t channel_of(const char* key, size_t keylen) const;
+
+	void get(const char* const* keys, const size_t* keylens, size_t num,
+			bool require_cas, shared_request req);
+
+	void set(const char* key, size_t keylen,
+			uint32_t flags, uint32_t exptime,
+			const char* data, size_t datalen,
+			shared_request req);
+
+	// stores the value only if the key doesn't exist; the request
+	// completes with STATUS_NOT_STORED otherwise
+	void add(const char* key, size_t keylen,
+			uint32_t flags, uint32_t exptime,
+			const char* data, size_t datalen,
+			shared_request req);
+
+	// a set whose value of datalen bytes is written to the returned
+	// stream as it arrives instead of being buffered. it is sent to one
+	// of the stream connections so that a slow client never delays
+	// commands of other keys; drained is called when the client can
+	// send again after value_stream::write() returned false
+	mp::shared_ptr<value_stream> set_stream(const char* key, size_t keylen,
+			uint32_t flags, uint32_t exptime, size_t datalen,
+			shared_request req, mp::function<void ()> drained);
+
+	void remove(const char* key, size_t keylen,
+			uint32_t exptime,
+			shared_request req);
+
+	// opens all connections of the pool; ready is called once when
+	// min_ready of them are connected or all of them are tried
+	void preconnect(size_t min_ready, mp::function<void ()> ready);
+
+	// closes the connections once they get idle
+	void retire();
+
+	// estimated 95th percentile of the response time of retrievals
+	unsigned int latency_p95() const { return m_latency_p95; }
+
+	// expected cost of one more request: requests sent or waiting to be
+	// sent, times the moving average of the response time of retrievals;
+	// lower is better. The average decays while no response arrives.
+	uint64_t load() const;
+
+	// true if both servers connect to the same address
+	bool is_same(const server* other) const;
+
+	// appends "STAT <prefix><address>:<name> <value>\r\n" of the requests
+	// sent to the server and waiting for it
+	void dump_stats(const std::string& prefix, std::string* out) const;
+
+	// false while the server is ejected for failures; after the back-off
+	// it returns true now and then to let a request probe the server
+	bool is_available() { return !m_ejected || probe(); }
+
+private:
+	struct channel;
+
+	void get_coalesced(size_t ch, const char* key, size_t keylen,
+			shared_request req);
+	void batch_expired(size_t ch, uint64_t seq);
+	void enqueue_batch(channel& cn);
+
+	enum store_command { STORE_SET, STORE_ADD };
+	void store(store_command cmd, const char* key, size_t keylen,
+			uint32_t flags, uint32_t exptime,
+			const char* data, size_t datalen,
+			shared_request req);
+
+	void encode_get(const char* const* keys, const size_t* keylens, size_t num,
+			bool require_cas, entry* e);
+	void encode_probe(entry* e);
+	uint32_t next_opaque();
+
+	void submit(size_t ch, entry& e,
+			const char* const* keys, const size_t* keylens, size_t num,
+			bool defer = false);
+	void submit_stream(size_t ch, entry& e, size_t key_ch, entry& probe,
+			const char* key, size_t keylen,
+			const mp::shared_ptr<stream_fence>& stored);
+	void hold_streamed(const char* const* keys, const size_t* keylens,
+			size_t num, entry* e);
+	void open_fence(const mp::shared_ptr<stream_fence>& f);
+	size_t checkout_stream();
+	void return_stream(size_t ch);
+	void flush_writes(size_t ch);
+	void drop_cancelled(std::deque<entry>& queue);
+	void complete_cancelled();
+	bool reserve_noreply(size_t size);
+	void release_noreply(size_t size);
+	bool drop_oldest_noreply();
+	bool dispatch(size_t ch, mp::shared_ptr<connection>* c);
+	void send_next(connection* c);
+
+	void connect(size_t ch);
+	void connected(size_t ch, int fd, int err);
+	void count_ready(size_t up, size_t tried);
+
+	void fail_queue(size_t ch, status st);
+
+	bool is_overloaded() const;
+	bool has_room() const;
+	void resume_starved(std::vector<mp::shared_ptr<connection> >* hold);
+
+	void record_latency(uint64_t usec);
+
+	bool probe();
+	void record_result(bool failed);
+	void eject(uint64_t now);
+	std::string address() const;
+
+private:
+	mp::pthread_mutex m_mutex;
+
+	struct channel {
+		channel() : batch_seq(0), connecting(false), flush_scheduled(false),
+			streams(0) { }
+
+		std::deque<entry> queue;
+
+		// single-key gets waiting to be merged into one multi-get
+		mp::shared_ptr<get_batch> batch;
+		uint64_t batch_seq;
+
+		mp::weak_ptr<connection> conn;
+		bool connecting;
+
+		// flush_writes() is going to send the queue
+		bool flush_scheduled;
+
+		// value streams sent or queued to a stream channel
+		size_t streams;
+	};
+
+	// the pool is followed by the stream channels, which carry one
+	// value stream at a time
+	const size_t m_pool;
+	std::vector<channel> m_channels;
+
+	// keys of the value streams which are not answered yet; commands of
+	// them wait for the fence
+	struct stream_key {
+		std::string key;
+		mp::shared_ptr<stream_fence> stored;
+	};
+	std::vector<stream_key> m_stream_keys;
+
+	// bytes of noreply writes in the queues
+	size_t m_noreply_bytes;
+
+	// bulkhead: requests sent and waiting for the response, and requests
+	// waiting in the queues to be sent
+	// readable without m_mutex
+	volatile size_t m_inflight;
+	volatile size_t m_waiting;
+	bool m_starved;  // a queue waits for m_inflight to decrease
+
+	// requests dropped by send_next; completed by complete_cancelled()
+	// after m_mutex is unlocked
+	std::vector<shared_request> m_cancelled;
+
+	bool m_retired;
+
+	// preconnect() waiting for the connections
+	mp::function<void ()> m_ready;
+	size_t m_ready_min;
+	size_t m_ready_up;
+	size_t m_ready_tried;
+
+	const bool m_binary;
+	volatile uint32_t m_opaque;
+
+	// guarded by m_mutex; m_latency_p95 and m_latency_avg are readable
+	// without it
+	double m_latency_q;
+	volatile unsigned int m_latency_p95;
+	double m_latency_ewma;
+	volatile unsigned int m_latency_avg;
+	volatile uint64_t m_latency_at;  // usec of the last response
+
+	// circuit breaker; guarded by m_mutex, m_ejected is readable without it
+	volatile bool m_ejected;
+	unsigned int m_failures;    // consecutive failures
+	unsigned int m_ejections;   // consecutive ejections; doubles the back-off
+	unsigned int m_backoff;     // msec
+	uint64_t m_probe_after;     // msec; results before it are from old requests
+	uint64_t m_next_probe;      // msec
+
+	struct sockaddr_storage m_addr;
+	socklen_t m_addrlen;
+
+	friend class connection;
+	friend class timed_request;
+	friend class stream_request;
+	friend class fence_request;
+	friend class value_stream;
+
+private:
+	server();
+	server(const server&);
+};
+
+typedef mp::shared_ptr<server> shared_server;
+
+
+// The value of a set which is sent to the connection while the client is
+// still sending it.  Parts written before the command is sent are held
+// until then; after that they are written to the socket directly.  Parts
+// not written to the socket yet are limited to UPSTREAM_STREAM_QUEUE_SIZE
+// bytes so that the client is paused instead of filling the memory.
+class value_stream : public mp::enable_shared_from_this<value_stream> {
+public:
+	~value_stream();
+
+	// appends a part of the value; ref keeps data valid until it is
+	// written. returns false if the client should stop sending until
+	// the drained callback is called
+	bool write(const char* data, size_t len,
+			std::auto_ptr<mp::stream_buffer::reference> ref);
+
+	// all bytes of the value are written
+	void close();
+
+	// the value will never be completed; the connection is closed if
+	// the command is already sent
+	void abort();
+
+private:
+	value_stream(shared_server sv, size_t ch, const char* trailer,
+			mp::function<void ()> drained);
+
+	struct part;
+	void send(std::auto_ptr<part> pt, const char* data, size_t len);
+	void written(size_t len);
+	bool unblock();
+
+	// called by server::send_next after the command is committed;
+	// returns true if the connection must wait for the rest of the value
+	bool attach(const mp::shared_ptr<connection>& c);
+	void drop();
+	// returns true if the stream was aborted
+	bool detach();
+
+private:
+	mp::pthread_mutex m_mutex;
+
+	shared_server m_server;
+	const size_t m_channel;
+	const char* m_trailer;  // sent after the value
+
+	std::string m_pending;  // written before the command is sent
+	int m_fd;               // >= 0 while attached to the connection
+	mp::weak_ptr<connection> m_conn;
+	bool m_closed;
+	bool m_dropped;         // the rest of the value is discarded
+
+	// guards the following; locked after m_mutex as parts may be
+	// written while it is locked
+	mp::pthread_mutex m_queue_mutex;
+	size_t m_queued;        // bytes not written to the socket yet
+	bool m_blocked;         // write() returned false
+
+	// called without locks after m_blocked is cleared
+	const mp::function<void ()> m_drained;
+
+	friend class server;
+	friend class connection;
+
+private:
+	value_stream();
+	value_stream(const value_stream&);
+};
+
+typedef mp::shared_ptr<value_stream> shared_value_stream;
+
+
+// number of connections to a server
+void set_pool_size(size_t num);
+size_t get_pool_size();
+
+// maximum number of requests sent to a connection without waiting
+// for their responses
+void set_pipeline_depth(size_t depth);
+size_t get_pipeline_depth();
+
+// single-key gets sent to the same server within window_usec (rounded up
+// to milliseconds) are merged into one multi-get of at most max_keys keys;
+// 0 disables coalescing
+void set_coalesce(unsigned int window_usec, size_t max_keys);
+
+// sets and deletes are written to a connection by a task which runs
+// after the worker threads handle pending events, so that commands of
+// many clients go out in one writev(2); enabled by default
+void set_write_coalescing(bool enable);
+
+// bodies of values larger than this are moved from the upstream socket
+// to the client socket through a pipe with splice(2); 0 disables it
+void set_splice_threshold(size_t bytes);
+
+enum overflow {
+	OVERFLOW_DROP_NEWEST,
+	OVERFLOW_DROP_OLDEST,
+};
+
+// noreply writes waiting to be sent to a server are limited to this
+// size; 0 is unlimited
+void set_noreply_queue_size(size_t bytes);
+
+// which noreply write is dropped when the queue is full
+void set_noreply_overflow(overflow policy);
+
+// commands not answered within msec fail with STATUS_TIMEOUT;
+// 0 disables the timeout
+void set_timeout(unsigned int msec);
+
+// a server is ejected from the distribution after this number of
+// consecutive failures, or while its 95th percentile response time is
+// over latency_usec; 0 disables each
+void set_ejection(unsigned int failures, unsigned int latency_usec);
+
+// requests sent to a server without waiting for their responses are
+// limited to max_inflight, and requests waiting to be sent are limited
+// to max_waiting; requests over the limit fail with STATUS_OVERLOADED.
+// 0 is unlimited
+void set_bulkhead(size_t max_inflight, size_t max_waiting);
+
+// protocol of servers created after this call
+void set_protocol(protocol proto);
+
+
+}  // namespace upstream
+}  // namespace memxy
+
+#endif /* upstream.h */
+